@@ -0,0 +1,400 @@
+#include "Benchmark.h"
+
+#include "VertexKernel.h"
+#include "Window.h"
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLFunctions>
+#include <QSurfaceFormat>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+QString gl_string(QOpenGLFunctions & gl, const GLenum name)
+{
+	return QString::fromUtf8(reinterpret_cast<const char *>(gl.glGetString(name)));
+}
+
+QJsonObject to_json(const FrameProfiler::Stats & stats)
+{
+	return QJsonObject{
+		{"min_ms", stats.min},
+		{"avg_ms", stats.avg},
+		{"p99_ms", stats.p99},
+	};
+}
+
+template<class F>
+double best_time_ms(size_t runs, F && f)
+{
+	auto best = std::numeric_limits<double>::max();
+	for (size_t i = 0; i < runs; ++i)
+	{
+		QElapsedTimer timer;
+		timer.start();
+		f();
+		best = std::min(best, static_cast<double>(timer.nsecsElapsed()) / 1e6);
+	}
+	return best;
+}
+
+// Side of the render target of the vertex-bound benchmark, small enough that fragments cost nothing.
+constexpr size_t g_vertex_bound_size = 16;
+
+// Renders the frames of run_benchmark() and returns its report, or nothing if the model or
+// the context fails.
+std::optional<QJsonObject> benchmark_report(const BenchmarkOptions & options)
+{
+	if (!QFileInfo::exists(options.modelPath))
+	{
+		fprintf(stderr, "Model not found: %s\n", qPrintable(options.modelPath));
+		return std::nullopt;
+	}
+
+	QOpenGLContext context;
+	context.setFormat(QSurfaceFormat::defaultFormat());
+	if (!context.create())
+	{
+		fprintf(stderr, "Failed to create OpenGL context\n");
+		return std::nullopt;
+	}
+
+	QOffscreenSurface surface;
+	surface.setFormat(context.format());
+	surface.create();
+	if (!surface.isValid() || !context.makeCurrent(&surface))
+	{
+		fprintf(stderr, "Failed to make offscreen surface current\n");
+		return std::nullopt;
+	}
+
+	QOpenGLFramebufferObjectFormat fbo_format;
+	fbo_format.setAttachment(QOpenGLFramebufferObject::CombinedDepthStencil);
+	fbo_format.setSamples(context.format().samples());
+	QOpenGLFramebufferObject fbo(QSize(static_cast<int>(options.width), static_cast<int>(options.height)), fbo_format);
+	if (!fbo.isValid())
+	{
+		fprintf(stderr, "Failed to create %zux%zu framebuffer\n", options.width, options.height);
+		return std::nullopt;
+	}
+	fbo.bind();
+
+	std::vector<FrameProfiler::FrameRecord> records;
+	records.reserve(options.frames);
+	std::vector<std::string> scope_names;
+	size_t warmup_frames = 0;
+	QJsonObject load;
+	QJsonObject textures;
+	QJsonObject draws;
+	QJsonObject picking;
+	{
+		// Window never gets shown, so its resources live in our context.
+		Window window(options.modelPath, options.render);
+		QElapsedTimer load_timer;
+		load_timer.start();
+		window.initializeOffscreen();
+		const auto init_ms = static_cast<double>(load_timer.nsecsElapsed()) / 1e6;
+		window.onResize(options.width, options.height);
+
+		auto & profiler = window.profiler();
+
+		// Geometry and textures stream in over several frames, measure only once all of them are resident.
+		double first_draw_ms = -1.0;
+		while (window.loading() || window.textures().pending())
+		{
+			window.onRender();
+			profiler.flush();
+			++warmup_frames;
+			const auto & draw_stats = window.drawStats();
+			if (first_draw_ms < 0.0 && draw_stats.draws + draw_stats.culled > 0)
+			{
+				first_draw_ms = static_cast<double>(load_timer.nsecsElapsed()) / 1e6;
+			}
+		}
+		// A model that fails to load ends streaming with an empty scene, timing it means nothing.
+		if (window.loadFailed())
+		{
+			fprintf(stderr, "Failed to load model: %s\n", qPrintable(options.modelPath));
+			return std::nullopt;
+		}
+		load = QJsonObject{
+			{"init_ms", init_ms},
+			{"first_draw_ms", first_draw_ms},
+			{"complete_ms", static_cast<double>(load_timer.nsecsElapsed()) / 1e6},
+			{"scene_cache_hit", window.sceneCacheHit()},
+		};
+		if (options.render.weldVertices && !window.sceneCacheHit())
+		{
+			const auto weld_stats = window.weldStats();
+			load["vertex_welding"] = QJsonObject{
+				{"vertices_before", static_cast<qint64>(weld_stats.before)},
+				{"vertices_after", static_cast<qint64>(weld_stats.after)},
+				{"reduction", weld_stats.reduction()},
+			};
+		}
+		if (options.render.optimizeMeshes && !window.sceneCacheHit())
+		{
+			const auto mesh_stats = window.meshStats();
+			load["mesh_optimization"] = QJsonObject{
+				{"acmr_before", mesh_stats.before.acmr()},
+				{"acmr_after", mesh_stats.after.acmr()},
+				{"atvr_before", mesh_stats.before.atvr()},
+				{"atvr_after", mesh_stats.after.atvr()},
+			};
+		}
+
+		profiler.setFrameCallback([&records](const FrameProfiler::FrameRecord & record) {
+			records.push_back(record);
+		});
+
+		for (size_t i = 0; i < options.frames; ++i)
+		{
+			window.onRender();
+			// Waiting for every frame keeps frames from overlapping, so numbers stay comparable between runs.
+			profiler.flush();
+		}
+		scope_names = profiler.scopeNames();
+		const auto & draw_stats = window.drawStats();
+		draws = QJsonObject{
+			{"multi_draw_indirect", window.multiDrawIndirect()},
+			{"gpu_culling", window.gpuCulling()},
+			{"morph_cache", window.morphCached()},
+			{"morphed_vertices", static_cast<qint64>(draw_stats.morphedVertices)},
+			{"draws", static_cast<qint64>(draw_stats.draws)},
+			{"instances", static_cast<qint64>(draw_stats.instances)},
+			{"draw_calls", static_cast<qint64>(draw_stats.drawCalls)},
+			{"culled", static_cast<qint64>(draw_stats.culled)},
+			{"occluded", static_cast<qint64>(draw_stats.occluded)},
+			{"meshlets_culled", static_cast<qint64>(draw_stats.meshletsCulled)},
+			{"triangles", static_cast<qint64>(draw_stats.triangles)},
+			{"state_changes", static_cast<qint64>(draw_stats.stateChanges)},
+			{"state_changes_saved", static_cast<qint64>(draw_stats.stateChangesSaved)},
+		};
+
+		// Rays through a grid of pixels, the first pass builds the triangle BVHs it reaches.
+		constexpr int pick_grid = 32;
+		size_t pick_hits = 0;
+		const auto pick_all = [&] {
+			pick_hits = 0;
+			for (int y = 0; y < pick_grid; ++y)
+			{
+				for (int x = 0; x < pick_grid; ++x)
+				{
+					pick_hits += window.pick(QPointF((x + 0.5) * 2.0 / pick_grid - 1.0, (y + 0.5) * 2.0 / pick_grid - 1.0)).has_value();
+				}
+			}
+		};
+		const auto first_pick_ms = best_time_ms(1, pick_all);
+		const auto pick_ms = best_time_ms(3, pick_all);
+		picking = QJsonObject{
+			{"bvh_nodes", static_cast<qint64>(window.instanceBvh().nodeCount())},
+			{"rays", pick_grid * pick_grid},
+			{"hits", static_cast<qint64>(pick_hits)},
+			{"first_ms", first_pick_ms},
+			{"ms", pick_ms},
+		};
+		textures = QJsonObject{
+			{"requested", static_cast<qint64>(window.textures().requestCount())},
+			{"unique", static_cast<qint64>(window.textures().textureCount())},
+		};
+	}
+
+	QJsonArray frames;
+	std::vector<double> cpu_times;
+	std::vector<double> gpu_times;
+	// Per scope, over the frames it ran in.
+	std::vector<std::vector<double>> scope_cpu_times(scope_names.size());
+	std::vector<std::vector<double>> scope_gpu_times(scope_names.size());
+	for (const auto & record: records)
+	{
+		QJsonObject scopes;
+		for (size_t i = 0; i < record.scopes.size(); ++i)
+		{
+			scopes.insert(QString::fromStdString(scope_names[i]), QJsonObject{
+				{"cpu_ms", record.scopes[i].cpu_ms},
+				{"gpu_ms", record.scopes[i].gpu_ms},
+			});
+			if (record.scopes[i].cpu_ms > 0.0)
+			{
+				scope_cpu_times[i].push_back(record.scopes[i].cpu_ms);
+				scope_gpu_times[i].push_back(record.scopes[i].gpu_ms);
+			}
+		}
+		frames.append(QJsonObject{
+			{"frame", static_cast<qint64>(record.index)},
+			{"cpu_ms", record.cpu_ms},
+			{"gpu_ms", record.gpu_ms},
+			{"scopes", scopes},
+		});
+		cpu_times.push_back(record.cpu_ms);
+		gpu_times.push_back(record.gpu_ms);
+	}
+
+	QJsonObject scope_stats;
+	for (size_t i = 0; i < scope_names.size(); ++i)
+	{
+		scope_stats.insert(QString::fromStdString(scope_names[i]), QJsonObject{
+			{"frames", static_cast<qint64>(scope_cpu_times[i].size())},
+			{"cpu", to_json(FrameProfiler::computeStats(std::move(scope_cpu_times[i])))},
+			{"gpu", to_json(FrameProfiler::computeStats(std::move(scope_gpu_times[i])))},
+		});
+	}
+
+	auto & gl = *context.functions();
+	const QJsonObject report{
+		{"model", options.modelPath},
+		{"packed_vertices", options.render.packedVertices},
+		{"width", static_cast<qint64>(options.width)},
+		{"height", static_cast<qint64>(options.height)},
+		{"renderer", gl_string(gl, GL_RENDERER)},
+		{"version", gl_string(gl, GL_VERSION)},
+		{"load", load},
+		{"warmup_frames", static_cast<qint64>(warmup_frames)},
+		{"textures", textures},
+		{"draws", draws},
+		{"picking", picking},
+		{"cpu", to_json(FrameProfiler::computeStats(std::move(cpu_times)))},
+		{"gpu", to_json(FrameProfiler::computeStats(std::move(gpu_times)))},
+		{"scopes", scope_stats},
+		{"frames", frames},
+	};
+	fbo.release();
+	context.doneCurrent();
+	return report;
+}
+
+}// namespace
+
+int run_benchmark(const BenchmarkOptions & options)
+{
+	const auto report = benchmark_report(options);
+	if (!report)
+	{
+		return 1;
+	}
+	fputs(QJsonDocument(*report).toJson().constData(), stdout);
+	return 0;
+}
+
+int run_vertex_bound_benchmark(BenchmarkOptions options)
+{
+	// Every vertex is transformed at full detail into a few pixels, so the vertex shader decides the GPU time.
+	options.width = g_vertex_bound_size;
+	options.height = g_vertex_bound_size;
+	options.render.frustumCulling = false;
+	options.render.occlusionCulling = false;
+	options.render.meshletCulling = false;
+	options.render.lod = false;
+
+	QJsonObject report{
+		{"model", options.modelPath},
+		{"packed_vertices", options.render.packedVertices},
+		{"morph_speed", static_cast<double>(options.render.morphSpeed)},
+	};
+	for (const auto analytic: {false, true})
+	{
+		options.render.analyticMorph = analytic;
+		const auto variant = benchmark_report(options);
+		if (!variant)
+		{
+			return 1;
+		}
+		report[analytic ? "analytic" : "finite"] = QJsonObject{
+			{"triangles", (*variant)["draws"].toObject()["triangles"]},
+			{"cpu", (*variant)["cpu"]},
+			{"gpu", (*variant)["gpu"]},
+		};
+	}
+	const auto gpu_ms = [&](const char * variant) {
+		return report[variant].toObject()["gpu"].toObject()["avg_ms"].toDouble();
+	};
+	report["gpu_speedup"] = gpu_ms("analytic") > 0.0 ? gpu_ms("finite") / gpu_ms("analytic") : 0.0;
+	fputs(QJsonDocument(report).toJson().constData(), stdout);
+	return 0;
+}
+
+int run_vertex_kernel_benchmark(const size_t vertices)
+{
+	constexpr size_t runs = 10;
+
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+	const auto random_floats = [&](size_t count) {
+		std::vector<float> values(count);
+		std::generate(values.begin(), values.end(), [&] { return dist(rng); });
+		return values;
+	};
+
+	const auto positions = random_floats(vertices * 3);
+	const auto normals = random_floats(vertices * 3);
+	const auto texcoords = random_floats(vertices * 2);
+	auto tangents = random_floats(vertices * 4);
+	for (size_t i = 0; i < vertices; ++i)
+	{
+		tangents[i * 4 + 3] = tangents[i * 4 + 3] < 0.0f ? -1.0f : 1.0f;
+	}
+
+	VertexStreams streams;
+	streams.positions = positions.data();
+	streams.normals = normals.data();
+	streams.texcoords = texcoords.data();
+	streams.tangents = tangents.data();
+	streams.count = vertices;
+
+	QMatrix4x4 transform;
+	transform.translate(1.0f, -2.0f, 0.5f);
+	transform.rotate(30.0f, {0.3f, 1.0f, 0.2f});
+	transform.scale(1.5f, 0.5f, 2.0f);
+
+	// Both outputs are touched before timing so page faults are not measured.
+	std::vector<Vertex> reference(vertices);
+	std::vector<Vertex> result(vertices);
+	const auto reference_ms = best_time_ms(runs, [&] { transform_vertices_reference(transform, streams, reference.data()); });
+	const auto kernel_ms = best_time_ms(runs, [&] { transform_vertices(transform, streams, result.data()); });
+
+	// The baseline leaves the tangent frame alone, the expected one is derived here untimed.
+	const auto normal_transform = transform.inverted().transposed();
+	float max_error = 0.0f;
+	for (size_t i = 0; i < vertices; ++i)
+	{
+		const QVector3D tangent(tangents[i * 4], tangents[i * 4 + 1], tangents[i * 4 + 2]);
+		auto & vertex = reference[i];
+		vertex.normal = normal_transform.mapVector(vertex.normal).normalized();
+		vertex.tangent = transform.mapVector(tangent).normalized();
+		vertex.bitangent = QVector3D::crossProduct(vertex.normal, vertex.tangent) * tangents[i * 4 + 3];
+
+		const auto * expected = reinterpret_cast<const float *>(&vertex);
+		const auto * actual = reinterpret_cast<const float *>(&result[i]);
+		for (size_t c = 0; c < sizeof(Vertex) / sizeof(float); ++c)
+		{
+			max_error = std::max(max_error, std::abs(expected[c] - actual[c]));
+		}
+	}
+
+	const QJsonObject report{
+		{"isa", vertex_kernel_isa()},
+		{"vertices", static_cast<qint64>(vertices)},
+		{"reference_ms", reference_ms},
+		{"kernel_ms", kernel_ms},
+		{"speedup", kernel_ms > 0.0 ? reference_ms / kernel_ms : 0.0},
+		{"max_abs_error", static_cast<double>(max_error)},
+	};
+	fputs(QJsonDocument(report).toJson().constData(), stdout);
+	return 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "RenderOptions.h"
+
+#include <QString>
+
+struct BenchmarkOptions {
+	QString modelPath;
+	size_t frames = 100;
+	size_t width = 640;
+	size_t height = 480;
+	RenderOptions render;
+};
+
+// Renders options.frames frames of the model into an offscreen FBO through Window::onRender
+// and prints per-frame CPU and GPU times as JSON to stdout. Returns the process exit code.
+int run_benchmark(const BenchmarkOptions & options);
+
+// Renders the model into a tiny target at full detail without culling, once with finite
+// difference and once with analytic morph derivatives, and prints the GPU times of both as
+// JSON to stdout. Returns the process exit code.
+int run_vertex_bound_benchmark(BenchmarkOptions options);
+
+// Times transform_vertices against the per-vertex QMatrix4x4 loop on random vertices
+// and prints the best of several runs as JSON to stdout. Returns the process exit code.
+int run_vertex_kernel_benchmark(size_t vertices);
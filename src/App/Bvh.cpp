@@ -0,0 +1,221 @@
+#include "Bvh.h"
+
+#include "Frustum.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace
+{
+
+constexpr size_t g_bins = 16;
+constexpr uint32_t g_max_leaf_items = 4;
+// Cost of visiting a node relative to testing one item.
+constexpr float g_traversal_cost = 1.0f;
+
+struct Bounds {
+	QVector3D min{std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max()};
+	QVector3D max{-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max()};
+
+	void grow(const QVector3D & point)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			min[i] = std::min(min[i], point[i]);
+			max[i] = std::max(max[i], point[i]);
+		}
+	}
+
+	// Empty bounds leave these unchanged.
+	void grow(const Bounds & other)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			min[i] = std::min(min[i], other.min[i]);
+			max[i] = std::max(max[i], other.max[i]);
+		}
+	}
+
+	[[nodiscard]] float area() const
+	{
+		const auto d = max - min;
+		return d.x() < 0.0f ? 0.0f : 2.0f * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+	}
+};
+
+struct Bin {
+	Bounds bounds;
+	uint32_t count = 0;
+};
+
+// Node waiting for its bounds and split.
+struct Task {
+	uint32_t node;
+	size_t depth;
+};
+
+}// namespace
+
+void Bvh::build(const std::vector<Box> & boxes)
+{
+	nodes_.clear();
+	items_.resize(boxes.size());
+	if (boxes.empty())
+	{
+		return;
+	}
+	std::vector<QVector3D> centroids(boxes.size());
+	for (uint32_t i = 0; i < boxes.size(); ++i)
+	{
+		items_[i] = i;
+		centroids[i] = (boxes[i].min + boxes[i].max) * 0.5f;
+	}
+
+	nodes_.reserve(boxes.size() * 2);
+	nodes_.push_back({{}, {}, 0, static_cast<uint32_t>(boxes.size()), 0});
+	std::vector<Task> tasks{{0, 0}};
+	while (!tasks.empty())
+	{
+		const auto task = tasks.back();
+		tasks.pop_back();
+
+		Bounds bounds;
+		Bounds centroid_bounds;
+		const auto first = nodes_[task.node].first;
+		const auto count = nodes_[task.node].count;
+		for (uint32_t i = first; i < first + count; ++i)
+		{
+			bounds.grow(Bounds{boxes[items_[i]].min, boxes[items_[i]].max});
+			centroid_bounds.grow(centroids[items_[i]]);
+		}
+		nodes_[task.node].min = bounds.min;
+		nodes_[task.node].max = bounds.max;
+		if (count <= g_max_leaf_items)
+		{
+			continue;
+		}
+
+		// Split along the axis where centroids spread the most.
+		const auto extent = centroid_bounds.max - centroid_bounds.min;
+		const int axis = extent.x() >= extent.y() && extent.x() >= extent.z() ? 0 : (extent.y() >= extent.z() ? 1 : 2);
+		if (extent[axis] <= 0.0f)
+		{
+			continue;
+		}
+
+		auto * begin = items_.data() + first;
+		auto * end = begin + count;
+		uint32_t * middle = nullptr;
+		if (task.depth < kMaxSahDepth)
+		{
+			const auto bin_of = [&](const uint32_t item) {
+				const auto bin = static_cast<size_t>((centroids[item][axis] - centroid_bounds.min[axis]) / extent[axis] * g_bins);
+				return std::min(bin, g_bins - 1);
+			};
+			std::array<Bin, g_bins> bins;
+			for (const auto * it = begin; it != end; ++it)
+			{
+				auto & bin = bins[bin_of(*it)];
+				bin.bounds.grow(Bounds{boxes[*it].min, boxes[*it].max});
+				++bin.count;
+			}
+
+			// Cost of every split plane from both sides, the cheapest one wins if it beats a leaf.
+			std::array<float, g_bins - 1> left_cost;
+			Bounds left;
+			uint32_t left_count = 0;
+			for (size_t i = 0; i + 1 < g_bins; ++i)
+			{
+				left.grow(bins[i].bounds);
+				left_count += bins[i].count;
+				left_cost[i] = left.area() * left_count;
+			}
+			Bounds right;
+			uint32_t right_count = 0;
+			float best_cost = std::numeric_limits<float>::max();
+			size_t best_split = 0;
+			for (size_t i = g_bins - 1; i > 0; --i)
+			{
+				right.grow(bins[i].bounds);
+				right_count += bins[i].count;
+				const auto cost = left_cost[i - 1] + right.area() * right_count;
+				if (right_count > 0 && right_count < count && cost < best_cost)
+				{
+					best_cost = cost;
+					best_split = i;
+				}
+			}
+			if (best_split == 0 || g_traversal_cost + best_cost / bounds.area() >= static_cast<float>(count))
+			{
+				continue;
+			}
+			middle = std::partition(begin, end, [&](const uint32_t item) { return bin_of(item) < best_split; });
+		}
+		else
+		{
+			middle = begin + count / 2;
+			std::nth_element(begin, middle, end, [&](const uint32_t a, const uint32_t b) {
+				return centroids[a][axis] < centroids[b][axis];
+			});
+		}
+
+		const auto left_count = static_cast<uint32_t>(middle - begin);
+		const auto child = static_cast<uint32_t>(nodes_.size());
+		nodes_[task.node].child = child;
+		nodes_.push_back({{}, {}, first, left_count, 0});
+		nodes_.push_back({{}, {}, first + left_count, count - left_count, 0});
+		tasks.push_back({child, task.depth + 1});
+		tasks.push_back({child + 1, task.depth + 1});
+	}
+}
+
+void Bvh::cull(const Frustum & frustum, std::vector<uint32_t> & items) const
+{
+	if (nodes_.empty())
+	{
+		return;
+	}
+	std::array<uint32_t, kStackSize> stack;
+	size_t size = 0;
+	stack[size++] = 0;
+	while (size > 0)
+	{
+		const auto & node = nodes_[stack[--size]];
+		if (!frustum.intersects(node.min, node.max))
+		{
+			continue;
+		}
+		if (node.child == 0 || frustum.contains(node.min, node.max))
+		{
+			items.insert(items.end(), items_.begin() + node.first, items_.begin() + node.first + node.count);
+			continue;
+		}
+		stack[size++] = node.child;
+		stack[size++] = node.child + 1;
+	}
+}
+
+float Bvh::enter(const Node & node, const QVector3D & origin, const QVector3D & inverse_direction, const float max_distance)
+{
+	// Slab test, axes the ray is parallel to give infinities that drop out of min and max.
+	float t_min = 0.0f;
+	float t_max = max_distance;
+	for (int i = 0; i < 3; ++i)
+	{
+		const auto t0 = (node.min[i] - origin[i]) * inverse_direction[i];
+		const auto t1 = (node.max[i] - origin[i]) * inverse_direction[i];
+		t_min = std::max(t_min, std::min(t0, t1));
+		t_max = std::min(t_max, std::max(t0, t1));
+	}
+	return t_min <= t_max ? t_min : -1.0f;
+}
+
+float Bvh::distance(const Node & node, const QVector3D & point)
+{
+	QVector3D delta;
+	for (int i = 0; i < 3; ++i)
+	{
+		delta[i] = std::max({node.min[i] - point[i], 0.0f, point[i] - node.max[i]});
+	}
+	return delta.length();
+}
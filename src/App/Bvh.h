@@ -0,0 +1,169 @@
+#pragma once
+
+#include <QVector3D>
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+class Frustum;
+
+// Bounding volume hierarchy over axis-aligned boxes, split with the binned surface area
+// heuristic. Items are the indices of the boxes passed to build().
+class Bvh final
+{
+public:
+	struct Box {
+		QVector3D min;
+		QVector3D max;
+	};
+
+	struct Hit {
+		uint32_t item;
+		float distance;
+	};
+
+	void build(const std::vector<Box> & boxes);
+
+	[[nodiscard]] bool empty() const noexcept { return nodes_.empty(); }
+	[[nodiscard]] size_t nodeCount() const noexcept { return nodes_.size(); }
+
+	// Appends the items whose boxes intersect frustum. Subtrees entirely inside are taken
+	// without testing the boxes below them.
+	void cull(const Frustum & frustum, std::vector<uint32_t> & items) const;
+
+	// Closest item along origin + t * direction, t in [0, max_distance]. hit(item, max_distance)
+	// returns the exact t of the item or nothing, boxes further away than the closest hit
+	// so far are skipped.
+	template<class F>
+	[[nodiscard]] std::optional<Hit> raycast(const QVector3D & origin, const QVector3D & direction, float max_distance, F && hit) const;
+
+	// Item closest to point within max_distance. distance(item, max_distance) returns the exact
+	// distance of the item or nothing, boxes further away than the closest item so far are skipped.
+	template<class F>
+	[[nodiscard]] std::optional<Hit> nearest(const QVector3D & point, float max_distance, F && distance) const;
+
+private:
+	// Children of inner nodes are stored next to each other, leaves have no child. Items of a
+	// subtree are contiguous in items_, from first on.
+	struct Node {
+		QVector3D min;
+		QVector3D max;
+		uint32_t first;
+		uint32_t count;
+		uint32_t child;
+	};
+
+	// Deeper nodes are split at the median, so traversal stacks stay bounded.
+	static constexpr size_t kMaxSahDepth = 32;
+	static constexpr size_t kStackSize = 2 * kMaxSahDepth + 32;
+
+	// Entry distance of the ray into the box or a negative value if it misses.
+	[[nodiscard]] static float enter(const Node & node, const QVector3D & origin, const QVector3D & inverse_direction, float max_distance);
+	[[nodiscard]] static float distance(const Node & node, const QVector3D & point);
+
+	std::vector<Node> nodes_;
+	std::vector<uint32_t> items_;
+};
+
+template<class F>
+std::optional<Bvh::Hit> Bvh::raycast(const QVector3D & origin, const QVector3D & direction, float max_distance, F && hit) const
+{
+	std::optional<Hit> ans;
+	const QVector3D inverse_direction(1.0f / direction.x(), 1.0f / direction.y(), 1.0f / direction.z());
+	const auto root_entry = nodes_.empty() ? -1.0f : enter(nodes_[0], origin, inverse_direction, max_distance);
+	if (root_entry < 0.0f)
+	{
+		return ans;
+	}
+
+	std::array<std::pair<uint32_t, float>, kStackSize> stack;
+	size_t size = 0;
+	stack[size++] = {0, root_entry};
+	while (size > 0)
+	{
+		const auto [index, entry] = stack[--size];
+		if (entry > max_distance)
+		{
+			continue;
+		}
+		const auto & node = nodes_[index];
+		if (node.child == 0)
+		{
+			for (uint32_t i = node.first; i < node.first + node.count; ++i)
+			{
+				const std::optional<float> t = hit(items_[i], max_distance);
+				if (t && *t <= max_distance)
+				{
+					max_distance = *t;
+					ans = Hit{items_[i], *t};
+				}
+			}
+			continue;
+		}
+
+		// The nearer child goes on top, so it is visited first and tightens max_distance.
+		auto near = std::make_pair(node.child, enter(nodes_[node.child], origin, inverse_direction, max_distance));
+		auto far = std::make_pair(node.child + 1, enter(nodes_[node.child + 1], origin, inverse_direction, max_distance));
+		if (near.second < 0.0f || (far.second >= 0.0f && far.second < near.second))
+		{
+			std::swap(near, far);
+		}
+		if (far.second >= 0.0f)
+		{
+			stack[size++] = far;
+		}
+		if (near.second >= 0.0f)
+		{
+			stack[size++] = near;
+		}
+	}
+	return ans;
+}
+
+template<class F>
+std::optional<Bvh::Hit> Bvh::nearest(const QVector3D & point, float max_distance, F && distance) const
+{
+	std::optional<Hit> ans;
+	if (nodes_.empty())
+	{
+		return ans;
+	}
+
+	std::array<std::pair<uint32_t, float>, kStackSize> stack;
+	size_t size = 0;
+	stack[size++] = {0, Bvh::distance(nodes_[0], point)};
+	while (size > 0)
+	{
+		const auto [index, bound] = stack[--size];
+		if (bound > max_distance)
+		{
+			continue;
+		}
+		const auto & node = nodes_[index];
+		if (node.child == 0)
+		{
+			for (uint32_t i = node.first; i < node.first + node.count; ++i)
+			{
+				const std::optional<float> d = distance(items_[i], max_distance);
+				if (d && *d <= max_distance)
+				{
+					max_distance = *d;
+					ans = Hit{items_[i], *d};
+				}
+			}
+			continue;
+		}
+
+		auto near = std::make_pair(node.child, Bvh::distance(nodes_[node.child], point));
+		auto far = std::make_pair(node.child + 1, Bvh::distance(nodes_[node.child + 1], point));
+		if (far.second < near.second)
+		{
+			std::swap(near, far);
+		}
+		stack[size++] = far;
+		stack[size++] = near;
+	}
+	return ans;
+}
@@ -0,0 +1,59 @@
+#include "Frustum.h"
+
+Frustum::Frustum(const QMatrix4x4 & viewProjection)
+{
+	// Gribb-Hartmann: every plane is the last row plus or minus one of the others.
+	const auto w = viewProjection.row(3);
+	for (int i = 0; i < 3; ++i)
+	{
+		const auto row = viewProjection.row(i);
+		planes_[i * 2 + 0] = w + row;
+		planes_[i * 2 + 1] = w - row;
+	}
+}
+
+bool Frustum::intersects(const QVector3D & bounds_min, const QVector3D & bounds_max) const
+{
+	for (const auto & plane: planes_)
+	{
+		// Corner of the box furthest along the plane normal.
+		const QVector3D corner(plane.x() >= 0.0f ? bounds_max.x() : bounds_min.x(),
+							   plane.y() >= 0.0f ? bounds_max.y() : bounds_min.y(),
+							   plane.z() >= 0.0f ? bounds_max.z() : bounds_min.z());
+		if (QVector3D::dotProduct(plane.toVector3D(), corner) + plane.w() < 0.0f)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Frustum::contains(const QVector3D & bounds_min, const QVector3D & bounds_max) const
+{
+	for (const auto & plane: planes_)
+	{
+		// Corner of the box nearest along the plane normal.
+		const QVector3D corner(plane.x() >= 0.0f ? bounds_min.x() : bounds_max.x(),
+							   plane.y() >= 0.0f ? bounds_min.y() : bounds_max.y(),
+							   plane.z() >= 0.0f ? bounds_min.z() : bounds_max.z());
+		if (QVector3D::dotProduct(plane.toVector3D(), corner) + plane.w() < 0.0f)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Frustum::intersects(const QVector3D & center, const float radius) const
+{
+	for (const auto & plane: planes_)
+	{
+		// Planes are not normalized, so the radius is scaled instead.
+		const auto normal = plane.toVector3D();
+		if (QVector3D::dotProduct(normal, center) + plane.w() < -radius * normal.length())
+		{
+			return false;
+		}
+	}
+	return true;
+}
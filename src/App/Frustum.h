@@ -0,0 +1,27 @@
+#pragma once
+
+#include <QMatrix4x4>
+#include <QVector3D>
+#include <QVector4D>
+
+#include <array>
+
+// Clip-space planes of a view-projection matrix, normals point inside.
+class Frustum final
+{
+public:
+	explicit Frustum(const QMatrix4x4 & viewProjection);
+
+	// Conservative: boxes crossing a corner outside of all planes may still pass.
+	[[nodiscard]] bool intersects(const QVector3D & bounds_min, const QVector3D & bounds_max) const;
+	// Exact: true if the box is inside of every plane.
+	[[nodiscard]] bool contains(const QVector3D & bounds_min, const QVector3D & bounds_max) const;
+	// Same for spheres.
+	[[nodiscard]] bool intersects(const QVector3D & center, float radius) const;
+
+	// (a, b, c, d) with a * x + b * y + c * z + d >= 0 inside, not normalized.
+	[[nodiscard]] const std::array<QVector4D, 6> & planes() const noexcept { return planes_; }
+
+private:
+	std::array<QVector4D, 6> planes_;
+};
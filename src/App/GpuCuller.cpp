@@ -0,0 +1,154 @@
+#include "GpuCuller.h"
+
+#include "Frustum.h"
+
+#include <QOpenGLContext>
+
+#include <numeric>
+
+#ifndef GL_PARAMETER_BUFFER
+#define GL_PARAMETER_BUFFER 0x80EE
+#endif
+
+namespace
+{
+
+// local_size_x of cull.comp.
+constexpr GLuint g_group_size = 64;
+
+// Allocates buffer as shader storage of size bytes, filled from data when it is not null.
+void storage(QOpenGLFunctions_4_3_Core & gl, const GLuint buffer, const size_t size, const void * data, const GLenum usage)
+{
+	gl.glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+	gl.glBufferData(GL_SHADER_STORAGE_BUFFER, static_cast<GLsizeiptr>(size), data, usage);
+	if (!data)
+	{
+		gl.glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+	}
+}
+
+}// namespace
+
+std::unique_ptr<GpuCuller> GpuCuller::create(QOpenGLFunctions_4_3_Core & gl)
+{
+	std::unique_ptr<GpuCuller> ans(new GpuCuller(gl));
+	if (!ans->program_.addShaderFromSourceFile(QOpenGLShader::Compute, ":/Shaders/cull.comp") || !ans->program_.link())
+	{
+		return nullptr;
+	}
+	ans->instanceCountUniform_ = ans->program_.uniformLocation("instanceCount");
+	ans->cullFrustumUniform_ = ans->program_.uniformLocation("cullFrustum");
+	ans->planesUniform_ = ans->program_.uniformLocation("planes");
+	ans->selectLodsUniform_ = ans->program_.uniformLocation("selectLods");
+	ans->eyeUniform_ = ans->program_.uniformLocation("eye");
+	ans->lodPixelScaleUniform_ = ans->program_.uniformLocation("lodPixelScale");
+
+	// Core since 4.6, before that only with the ARB extension.
+	auto * context = QOpenGLContext::currentContext();
+	if (context->format().version() >= qMakePair(4, 6))
+	{
+		ans->multiDrawElementsIndirectCount_ = reinterpret_cast<MultiDrawElementsIndirectCount>(context->getProcAddress("glMultiDrawElementsIndirectCount"));
+	}
+	else if (context->hasExtension("GL_ARB_indirect_parameters"))
+	{
+		ans->multiDrawElementsIndirectCount_ = reinterpret_cast<MultiDrawElementsIndirectCount>(context->getProcAddress("glMultiDrawElementsIndirectCountARB"));
+	}
+	return ans;
+}
+
+GpuCuller::GpuCuller(QOpenGLFunctions_4_3_Core & gl)
+	: gl_(gl)
+{
+	for (auto * buffer: {&instances_, &primitives_, &offsets_, &counters_, &commands_, &lods_})
+	{
+		gl_.glGenBuffers(1, buffer);
+	}
+}
+
+GpuCuller::~GpuCuller()
+{
+	for (const auto * buffer: {&instances_, &primitives_, &offsets_, &counters_, &commands_, &lods_})
+	{
+		gl_.glDeleteBuffers(1, buffer);
+	}
+}
+
+void GpuCuller::upload(const std::vector<GpuPrimitive> & primitives, const std::vector<GpuInstance> & instances, const std::vector<uint32_t> & batch_capacity)
+{
+	instanceCount_ = static_cast<uint32_t>(instances.size());
+	batchCapacity_ = batch_capacity;
+	batchOffsets_.resize(batch_capacity.size());
+	std::exclusive_scan(batch_capacity.begin(), batch_capacity.end(), batchOffsets_.begin(), 0u);
+
+	// Every instance lands in the region of its batch, so the regions hold all of them at most.
+	storage(gl_, instances_, instances.size() * sizeof(GpuInstance), instances.data(), GL_STATIC_DRAW);
+	storage(gl_, primitives_, primitives.size() * sizeof(GpuPrimitive), primitives.data(), GL_STATIC_DRAW);
+	storage(gl_, offsets_, batchOffsets_.size() * sizeof(uint32_t), batchOffsets_.data(), GL_STATIC_DRAW);
+	storage(gl_, counters_, batch_capacity.size() * sizeof(uint32_t), nullptr, GL_DYNAMIC_COPY);
+	storage(gl_, commands_, instances.size() * sizeof(DrawElementsIndirectCommand), nullptr, GL_DYNAMIC_COPY);
+	// Levels start at full detail and settle within a few frames.
+	storage(gl_, lods_, instances.size() * sizeof(uint32_t), nullptr, GL_DYNAMIC_COPY);
+	gl_.glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void GpuCuller::cull(const Frustum * frustum, const QVector3D & eye, const float lodPixelScale, const bool selectLods)
+{
+	if (instanceCount_ == 0)
+	{
+		return;
+	}
+
+	gl_.glBindBuffer(GL_SHADER_STORAGE_BUFFER, counters_);
+	gl_.glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+	if (!indirectCount())
+	{
+		// Regions are drawn whole, what culling left out has to draw nothing.
+		gl_.glBindBuffer(GL_SHADER_STORAGE_BUFFER, commands_);
+		gl_.glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+	}
+	gl_.glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	GLuint binding = 0;
+	for (const auto buffer: {instances_, primitives_, offsets_, counters_, commands_, lods_})
+	{
+		gl_.glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding++, buffer);
+	}
+
+	program_.bind();
+	program_.setUniformValue(instanceCountUniform_, static_cast<GLuint>(instanceCount_));
+	program_.setUniformValue(cullFrustumUniform_, static_cast<GLint>(frustum != nullptr));
+	if (frustum)
+	{
+		program_.setUniformValueArray(planesUniform_, frustum->planes().data(), static_cast<int>(frustum->planes().size()));
+	}
+	program_.setUniformValue(selectLodsUniform_, static_cast<GLint>(selectLods));
+	program_.setUniformValue(eyeUniform_, eye);
+	program_.setUniformValue(lodPixelScaleUniform_, lodPixelScale);
+	gl_.glDispatchCompute((instanceCount_ + g_group_size - 1) / g_group_size, 1, 1);
+	program_.release();
+
+	// Commands and counters are read as draw arguments next.
+	gl_.glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void GpuCuller::draw(const size_t batch, const GLenum index_type)
+{
+	if (batchCapacity_[batch] == 0)
+	{
+		return;
+	}
+	const auto * commands = reinterpret_cast<const void *>(static_cast<size_t>(batchOffsets_[batch]) * sizeof(DrawElementsIndirectCommand));
+	const auto capacity = static_cast<GLsizei>(batchCapacity_[batch]);
+	gl_.glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commands_);
+	if (indirectCount())
+	{
+		gl_.glBindBuffer(GL_PARAMETER_BUFFER, counters_);
+		multiDrawElementsIndirectCount_(GL_TRIANGLES, index_type, commands, static_cast<GLintptr>(batch * sizeof(uint32_t)), capacity, 0);
+		gl_.glBindBuffer(GL_PARAMETER_BUFFER, 0);
+	}
+	else
+	{
+		gl_.glMultiDrawElementsIndirect(GL_TRIANGLES, index_type, commands, capacity, 0);
+	}
+	gl_.glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <QOpenGLFunctions_4_3_Core>
+#include <QOpenGLShaderProgram>
+#include <QVector3D>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class Frustum;
+
+// Layout fixed by GL_DRAW_INDIRECT_BUFFER.
+struct DrawElementsIndirectCommand {
+	GLuint count;
+	GLuint instanceCount;
+	GLuint firstIndex;
+	GLuint baseVertex;
+	GLuint baseInstance;
+};
+
+// Instance as cull.comp reads it, std430 layout.
+struct GpuInstance {
+	float model[16];// Column-major.
+	float bounds_min[4];// World bounds grown by the morph margin, w unused.
+	float bounds_max[4];
+	uint32_t primitive;
+	float max_scale;
+	uint32_t padding[2];
+};
+
+// Draw arguments of every LOD level of a primitive, std430 layout. Level 0 is full detail.
+struct GpuPrimitive {
+	static constexpr size_t kLevels = 4;
+
+	uint32_t lod_count;
+	uint32_t batch;
+	int32_t base_vertex;
+	uint32_t padding;
+	uint32_t index_count[kLevels];
+	uint32_t first_index[kLevels];
+	float lod_error[kLevels];// Of level i, level 0 has none.
+};
+
+static_assert(sizeof(GpuInstance) == 112, "Layout must match cull.comp");
+static_assert(sizeof(GpuPrimitive) == 64, "Layout must match cull.comp");
+
+// GPU-driven culling for GL 4.3: a compute shader tests every instance against the
+// frustum, selects its LOD level and appends a draw command to the region of its batch.
+// The CPU only sets uniforms, dispatches and issues one multi-draw per batch, whatever
+// the instance count. With GL 4.6 or ARB_indirect_parameters the draw count is read
+// from the GPU counters; otherwise every region is drawn to its capacity, with the
+// commands behind the counter cleared to zero triangles.
+class GpuCuller final
+{
+public:
+	// Requires a current GL 4.3 context, fails if the compute shader does not link.
+	[[nodiscard]] static std::unique_ptr<GpuCuller> create(QOpenGLFunctions_4_3_Core & gl);
+	~GpuCuller();
+
+	// Replaces what culling reads, batch_capacity[i] is the number of instances whose
+	// primitive is in batch i.
+	void upload(const std::vector<GpuPrimitive> & primitives, const std::vector<GpuInstance> & instances, const std::vector<uint32_t> & batch_capacity);
+	// Fills the command regions. frustum may be null to keep everything. Levels are only
+	// selected with selectLods, otherwise full detail is drawn. Leaves no program bound.
+	void cull(const Frustum * frustum, const QVector3D & eye, float lodPixelScale, bool selectLods);
+	// Draws the commands of batch, with its textures and the instance attributes bound.
+	// baseInstance is the index of the instance in what upload() was given.
+	void draw(size_t batch, GLenum index_type);
+
+	[[nodiscard]] bool indirectCount() const noexcept { return multiDrawElementsIndirectCount_ != nullptr; }
+
+private:
+	using MultiDrawElementsIndirectCount = void(QOPENGLF_APIENTRYP)(GLenum mode, GLenum type, const void * indirect, GLintptr drawcount, GLsizei maxdrawcount, GLsizei stride);
+
+	explicit GpuCuller(QOpenGLFunctions_4_3_Core & gl);
+
+private:
+	QOpenGLFunctions_4_3_Core & gl_;
+	QOpenGLShaderProgram program_;
+	GLint instanceCountUniform_ = -1;
+	GLint cullFrustumUniform_ = -1;
+	GLint planesUniform_ = -1;
+	GLint selectLodsUniform_ = -1;
+	GLint eyeUniform_ = -1;
+	GLint lodPixelScaleUniform_ = -1;
+	MultiDrawElementsIndirectCount multiDrawElementsIndirectCount_ = nullptr;
+
+	// Shader storage: instances, primitives, command region offsets, per-batch counters,
+	// commands and the LOD level every instance had last frame.
+	GLuint instances_ = 0;
+	GLuint primitives_ = 0;
+	GLuint offsets_ = 0;
+	GLuint counters_ = 0;
+	GLuint commands_ = 0;
+	GLuint lods_ = 0;
+	uint32_t instanceCount_ = 0;
+	std::vector<uint32_t> batchOffsets_;
+	std::vector<uint32_t> batchCapacity_;
+};
@@ -0,0 +1,1026 @@
+#include "MeshOptimizer.h"
+
+#include <QVector3D>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+namespace
+{
+
+// LRU cache Forsyth's scores model, larger than the FIFO stats are simulated with on purpose.
+constexpr size_t g_lru_cache_size = 32;
+constexpr size_t g_max_valence = 32;
+// Overdraw ordering may cost this much vertex cache efficiency at most.
+constexpr double g_overdraw_acmr_threshold = 1.05;
+// Soft cluster boundaries are not placed closer than this many triangles.
+constexpr size_t g_min_cluster_triangles = 16;
+// LOD levels may deviate from the full primitive by this fraction of its bounds diagonal.
+constexpr float g_lod_max_error = 0.05f;
+// Cosine of the largest turn a collapse may give a triangle.
+constexpr float g_max_flip_cos = 0.5f;
+// Meshlets whose triangles spread further from the average normal than this cosine get no
+// usable cone, it would reject them from almost no direction.
+constexpr float g_min_cone_cos = 0.1f;
+constexpr size_t g_no_triangle = std::numeric_limits<size_t>::max();
+
+struct ScoreTables {
+	std::array<float, g_lru_cache_size> cache;
+	std::array<float, g_max_valence + 1> valence;
+
+	ScoreTables()
+	{
+		// The last triangle's vertices score the same, so its orientation does not matter.
+		for (size_t i = 0; i < g_lru_cache_size; ++i)
+		{
+			cache[i] = i < 3 ? 0.75f : std::pow(1.0f - static_cast<float>(i - 3) / (g_lru_cache_size - 3), 1.5f);
+		}
+		// Vertices with few triangles left are preferred, so they leave no stragglers behind.
+		valence[0] = 0.0f;
+		for (size_t i = 1; i <= g_max_valence; ++i)
+		{
+			valence[i] = 2.0f / std::sqrt(static_cast<float>(i));
+		}
+	}
+};
+
+const ScoreTables & score_tables()
+{
+	static const ScoreTables tables;
+	return tables;
+}
+
+float vertex_score(const int cache_position, const uint32_t live_triangles)
+{
+	if (live_triangles == 0)
+	{
+		return -1.0f;
+	}
+	const auto & tables = score_tables();
+	const auto cache = cache_position >= 0 ? tables.cache[cache_position] : 0.0f;
+	return cache + tables.valence[std::min<size_t>(live_triangles, g_max_valence)];
+}
+
+// FIFO cache of vertex indices: a vertex is cached while fewer than size misses happened since it was loaded.
+class FifoCache
+{
+public:
+	explicit FifoCache(size_t vertex_count, size_t size = kVertexCacheStatsSize)
+		: size_{size}
+		, loadedAt_(vertex_count, 0)
+		, clock_{size + 1}
+	{
+	}
+
+	// Looks up the vertices of a triangle and returns how many were not cached.
+	size_t misses(const uint32_t * triangle)
+	{
+		size_t ans = 0;
+		for (size_t k = 0; k < 3; ++k)
+		{
+			ans += miss(triangle[k]) ? 1 : 0;
+		}
+		return ans;
+	}
+
+	bool miss(uint32_t index)
+	{
+		if (clock_ - loadedAt_[index] <= size_)
+		{
+			return false;
+		}
+		loadedAt_[index] = clock_++;
+		return true;
+	}
+
+	// Evicts everything.
+	void clear() { clock_ += size_ + 1; }
+
+private:
+	size_t size_;
+	std::vector<size_t> loadedAt_;
+	size_t clock_;
+};
+
+constexpr size_t g_vertex_floats = sizeof(Vertex) / sizeof(float);
+static_assert(sizeof(Vertex) == g_vertex_floats * sizeof(float) && std::is_trivially_copyable_v<Vertex>);
+
+// Cell of the welding grid a position falls into, cells are epsilon wide.
+using WeldCell = std::array<int64_t, 3>;
+
+WeldCell weld_cell(const Vertex & vertex, const float epsilon)
+{
+	return {static_cast<int64_t>(std::floor(vertex.pos.x() / epsilon)), static_cast<int64_t>(std::floor(vertex.pos.y() / epsilon)),
+			static_cast<int64_t>(std::floor(vertex.pos.z() / epsilon))};
+}
+
+// FNV-1a over the cell coordinates.
+uint64_t weld_hash(const WeldCell & cell)
+{
+	uint64_t ans = 14695981039346656037ull;
+	for (const auto value: cell)
+	{
+		ans ^= static_cast<uint64_t>(value);
+		ans *= 1099511628211ull;
+	}
+	return ans;
+}
+
+// Whether every attribute of a and b differs by at most epsilon.
+bool weld_equal(const Vertex & a, const Vertex & b, const float epsilon)
+{
+	std::array<float, g_vertex_floats> lhs;
+	std::array<float, g_vertex_floats> rhs;
+	memcpy(lhs.data(), &a, sizeof(a));
+	memcpy(rhs.data(), &b, sizeof(b));
+	for (size_t i = 0; i < g_vertex_floats; ++i)
+	{
+		if (!(std::abs(lhs[i] - rhs[i]) <= epsilon))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+std::vector<uint32_t> read_indices(const unsigned char * src, size_t count, size_t index_size)
+{
+	std::vector<uint32_t> ans(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (index_size == sizeof(uint32_t))
+		{
+			memcpy(&ans[i], src + i * sizeof(uint32_t), sizeof(uint32_t));
+		}
+		else
+		{
+			uint16_t index;
+			memcpy(&index, src + i * sizeof(uint16_t), sizeof(index));
+			ans[i] = index;
+		}
+	}
+	return ans;
+}
+
+void write_indices(const std::vector<uint32_t> & indices, size_t index_size, unsigned char * dst)
+{
+	for (size_t i = 0; i < indices.size(); ++i)
+	{
+		if (index_size == sizeof(uint32_t))
+		{
+			memcpy(dst + i * sizeof(uint32_t), &indices[i], sizeof(uint32_t));
+		}
+		else
+		{
+			const auto index = static_cast<uint16_t>(indices[i]);
+			memcpy(dst + i * sizeof(uint16_t), &index, sizeof(index));
+		}
+	}
+}
+
+// Sum of squared distances to a set of planes, kept as the symmetric 4x4 matrix of Garland and Heckbert.
+struct Quadric {
+	double a00 = 0.0, a01 = 0.0, a02 = 0.0, a11 = 0.0, a12 = 0.0, a22 = 0.0;
+	double b0 = 0.0, b1 = 0.0, b2 = 0.0;
+	double c = 0.0;
+
+	// Adds the plane through a triangle, degenerate triangles add nothing.
+	void addTriangle(const QVector3D & p0, const QVector3D & p1, const QVector3D & p2)
+	{
+		const auto normal = QVector3D::crossProduct(p1 - p0, p2 - p0);
+		const double length = normal.length();
+		if (length <= 0.0)
+		{
+			return;
+		}
+		const auto x = normal.x() / length;
+		const auto y = normal.y() / length;
+		const auto z = normal.z() / length;
+		const auto d = -(x * p0.x() + y * p0.y() + z * p0.z());
+		a00 += x * x;
+		a01 += x * y;
+		a02 += x * z;
+		a11 += y * y;
+		a12 += y * z;
+		a22 += z * z;
+		b0 += x * d;
+		b1 += y * d;
+		b2 += z * d;
+		c += d * d;
+	}
+
+	Quadric & operator+=(const Quadric & other)
+	{
+		a00 += other.a00;
+		a01 += other.a01;
+		a02 += other.a02;
+		a11 += other.a11;
+		a12 += other.a12;
+		a22 += other.a22;
+		b0 += other.b0;
+		b1 += other.b1;
+		b2 += other.b2;
+		c += other.c;
+		return *this;
+	}
+
+	[[nodiscard]] double error(const QVector3D & p) const
+	{
+		const double x = p.x();
+		const double y = p.y();
+		const double z = p.z();
+		const auto ans = a00 * x * x + a11 * y * y + a22 * z * z + 2.0 * (a01 * x * y + a02 * x * z + a12 * y * z)
+			+ 2.0 * (b0 * x + b1 * y + b2 * z) + c;
+		return std::max(ans, 0.0);
+	}
+};
+
+// Edge collapse simplification of one index buffer, collapses are applied in passes: every
+// pass takes the cheapest collapses whose triangles no other collapse of the pass changes,
+// so their costs and flip tests stay valid.
+class Simplifier
+{
+public:
+	Simplifier(std::vector<uint32_t> indices, const Vertex * vertices, size_t vertex_count)
+		: indices_{std::move(indices)}
+		, vertices_{vertices}
+		, quadrics_(vertex_count)
+	{
+		for (size_t i = 0; i + 2 < indices_.size(); i += 3)
+		{
+			Quadric quadric;
+			quadric.addTriangle(position(indices_[i]), position(indices_[i + 1]), position(indices_[i + 2]));
+			for (size_t k = 0; k < 3; ++k)
+			{
+				quadrics_[indices_[i + k]] += quadric;
+			}
+		}
+	}
+
+	// Collapses edges until at most target indices are left. Returns false if that would need
+	// a collapse costing more than max_error squared or if no more edges can collapse.
+	bool simplify(const size_t target, const double max_error)
+	{
+		while (indices_.size() > target)
+		{
+			if (!collapsePass(target, max_error * max_error))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	[[nodiscard]] const std::vector<uint32_t> & indices() const noexcept { return indices_; }
+	// Largest deviation any collapse so far introduced, in scene units.
+	[[nodiscard]] float error() const noexcept { return static_cast<float>(std::sqrt(error_)); }
+
+private:
+	struct Collapse {
+		uint32_t from;
+		uint32_t to;
+		double error;
+	};
+
+	[[nodiscard]] const QVector3D & position(uint32_t vertex) const { return vertices_[vertex].pos; }
+
+	bool collapsePass(const size_t target, const double max_error)
+	{
+		const auto vertex_count = quadrics_.size();
+		const auto triangle_count = indices_.size() / 3;
+
+		// Vertices on an edge without exactly two triangles are on a border, an attribute seam
+		// (welded vertices only share a position across a seam) or a non-manifold part and stay.
+		std::vector<uint64_t> edges;
+		edges.reserve(indices_.size());
+		for (size_t t = 0; t < triangle_count; ++t)
+		{
+			for (size_t k = 0; k < 3; ++k)
+			{
+				const uint64_t a = indices_[3 * t + k];
+				const uint64_t b = indices_[3 * t + (k + 1) % 3];
+				edges.push_back(std::min(a, b) << 32 | std::max(a, b));
+			}
+		}
+		std::sort(edges.begin(), edges.end());
+		std::vector<bool> locked(vertex_count, false);
+		for (size_t i = 0; i < edges.size();)
+		{
+			auto j = i;
+			while (j < edges.size() && edges[j] == edges[i])
+			{
+				++j;
+			}
+			if (j - i != 2)
+			{
+				locked[edges[i] >> 32] = true;
+				locked[edges[i] & 0xffffffff] = true;
+			}
+			i = j;
+		}
+
+		// Triangles around every vertex, for the flip test.
+		std::vector<uint32_t> offsets(vertex_count + 1, 0);
+		for (const auto index: indices_)
+		{
+			++offsets[index + 1];
+		}
+		for (size_t v = 0; v < vertex_count; ++v)
+		{
+			offsets[v + 1] += offsets[v];
+		}
+		std::vector<uint32_t> adjacency(indices_.size());
+		{
+			std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+			for (size_t i = 0; i < indices_.size(); ++i)
+			{
+				adjacency[fill[indices_[i]]++] = static_cast<uint32_t>(i / 3);
+			}
+		}
+
+		std::vector<Collapse> collapses;
+		for (size_t t = 0; t < triangle_count; ++t)
+		{
+			for (size_t k = 0; k < 3; ++k)
+			{
+				const auto a = indices_[3 * t + k];
+				const auto b = indices_[3 * t + (k + 1) % 3];
+				if (!locked[a])
+				{
+					collapses.push_back({a, b, cost(a, b)});
+				}
+				if (!locked[b])
+				{
+					collapses.push_back({b, a, cost(b, a)});
+				}
+			}
+		}
+		std::sort(collapses.begin(), collapses.end(), [](const Collapse & a, const Collapse & b) {
+			return a.error < b.error;
+		});
+
+		// An interior collapse removes the two triangles of its edge.
+		const auto needed = (indices_.size() - target + 2) / 3;
+		std::vector<uint32_t> remap(vertex_count);
+		for (size_t v = 0; v < vertex_count; ++v)
+		{
+			remap[v] = static_cast<uint32_t>(v);
+		}
+		std::vector<bool> touched(vertex_count, false);
+		size_t removed = 0;
+		for (const auto & collapse: collapses)
+		{
+			if (removed >= needed || collapse.error > max_error)
+			{
+				break;
+			}
+			// Nothing around from may move in the same pass, or the flip test would be stale.
+			const auto ring_touched = [&] {
+				for (auto i = offsets[collapse.from]; i < offsets[collapse.from + 1]; ++i)
+				{
+					const auto * triangle = &indices_[3 * adjacency[i]];
+					if (touched[triangle[0]] || touched[triangle[1]] || touched[triangle[2]])
+					{
+						return true;
+					}
+				}
+				return false;
+			};
+			if (touched[collapse.to] || ring_touched() || flips(collapse, offsets, adjacency))
+			{
+				continue;
+			}
+			remap[collapse.from] = collapse.to;
+			for (auto i = offsets[collapse.from]; i < offsets[collapse.from + 1]; ++i)
+			{
+				const auto * triangle = &indices_[3 * adjacency[i]];
+				touched[triangle[0]] = touched[triangle[1]] = touched[triangle[2]] = true;
+			}
+			quadrics_[collapse.to] += quadrics_[collapse.from];
+			error_ = std::max(error_, collapse.error);
+			removed += 2;
+		}
+		if (removed == 0)
+		{
+			return false;
+		}
+
+		size_t write = 0;
+		for (size_t t = 0; t < triangle_count; ++t)
+		{
+			const auto a = remap[indices_[3 * t]];
+			const auto b = remap[indices_[3 * t + 1]];
+			const auto c = remap[indices_[3 * t + 2]];
+			if (a != b && b != c && c != a)
+			{
+				indices_[write++] = a;
+				indices_[write++] = b;
+				indices_[write++] = c;
+			}
+		}
+		indices_.resize(write);
+		return true;
+	}
+
+	[[nodiscard]] double cost(uint32_t from, uint32_t to) const
+	{
+		return quadrics_[from].error(position(to)) + quadrics_[to].error(position(to));
+	}
+
+	// True if moving from onto to turns one of the remaining triangles of from too far. Small
+	// turns add up over many passes, so they are limited well below 90 degrees.
+	[[nodiscard]] bool flips(const Collapse & collapse, const std::vector<uint32_t> & offsets, const std::vector<uint32_t> & adjacency) const
+	{
+		for (auto i = offsets[collapse.from]; i < offsets[collapse.from + 1]; ++i)
+		{
+			const auto * triangle = &indices_[3 * adjacency[i]];
+			if (triangle[0] == collapse.to || triangle[1] == collapse.to || triangle[2] == collapse.to)
+			{
+				continue;
+			}
+			std::array<QVector3D, 3> before;
+			std::array<QVector3D, 3> after;
+			for (size_t k = 0; k < 3; ++k)
+			{
+				before[k] = position(triangle[k]);
+				after[k] = triangle[k] == collapse.from ? position(collapse.to) : before[k];
+			}
+			const auto normal_before = QVector3D::crossProduct(before[1] - before[0], before[2] - before[0]);
+			const auto normal_after = QVector3D::crossProduct(after[1] - after[0], after[2] - after[0]);
+			if (QVector3D::dotProduct(normal_before, normal_after) <= g_max_flip_cos * normal_before.length() * normal_after.length())
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	std::vector<uint32_t> indices_;
+	const Vertex * vertices_;
+	std::vector<Quadric> quadrics_;
+	double error_ = 0.0;
+};
+
+Meshlet meshlet_bounds(const std::vector<uint32_t> & indices, size_t first, size_t end, const Vertex * vertices, const std::vector<uint32_t> & meshlet_vertices, bool double_sided)
+{
+	Meshlet ans;
+	ans.first_index = static_cast<uint32_t>(first);
+	ans.index_count = static_cast<uint32_t>(end - first);
+
+	auto box_min = vertices[meshlet_vertices.front()].pos;
+	auto box_max = box_min;
+	for (const auto v: meshlet_vertices)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			box_min[i] = std::min(box_min[i], vertices[v].pos[i]);
+			box_max[i] = std::max(box_max[i], vertices[v].pos[i]);
+		}
+	}
+	const auto center = (box_min + box_max) / 2.0f;
+	float radius = 0.0f;
+	for (const auto v: meshlet_vertices)
+	{
+		radius = std::max(radius, (vertices[v].pos - center).length());
+	}
+
+	std::vector<QVector3D> normals;
+	QVector3D axis;
+	for (auto i = first; i < end; i += 3)
+	{
+		const auto & a = vertices[indices[i]].pos;
+		const auto normal = QVector3D::crossProduct(vertices[indices[i + 1]].pos - a, vertices[indices[i + 2]].pos - a);
+		if (normal.lengthSquared() > 0.0f)
+		{
+			normals.push_back(normal.normalized());
+			axis += normals.back();
+		}
+	}
+	float min_cos = -1.0f;
+	if (!double_sided && axis.lengthSquared() > 0.0f)
+	{
+		axis.normalize();
+		min_cos = 1.0f;
+		for (const auto & normal: normals)
+		{
+			min_cos = std::min(min_cos, QVector3D::dotProduct(axis, normal));
+		}
+	}
+
+	for (int i = 0; i < 3; ++i)
+	{
+		ans.center[i] = center[i];
+		ans.cone_axis[i] = min_cos >= g_min_cone_cos ? axis[i] : 0.0f;
+	}
+	ans.radius = radius;
+	// Sine of the spread: viewers within 90 degrees minus the spread of the axis see only back faces.
+	ans.cone_cutoff = min_cos >= g_min_cone_cos ? std::sqrt(1.0f - min_cos * min_cos) : 1.0f;
+	return ans;
+}
+
+}// namespace
+
+VertexCacheStats & VertexCacheStats::operator+=(const VertexCacheStats & other)
+{
+	triangles += other.triangles;
+	vertices += other.vertices;
+	misses += other.misses;
+	return *this;
+}
+
+MeshOptimizationStats & MeshOptimizationStats::operator+=(const MeshOptimizationStats & other)
+{
+	before += other.before;
+	after += other.after;
+	return *this;
+}
+
+WeldStats & WeldStats::operator+=(const WeldStats & other)
+{
+	before += other.before;
+	after += other.after;
+	return *this;
+}
+
+VertexCacheStats analyze_vertex_cache(const std::vector<uint32_t> & indices, const size_t vertex_count, const size_t cache_size)
+{
+	VertexCacheStats ans;
+	ans.triangles = indices.size() / 3;
+	ans.vertices = vertex_count;
+
+	FifoCache cache(vertex_count, cache_size);
+	for (const auto index: indices)
+	{
+		ans.misses += cache.miss(index) ? 1 : 0;
+	}
+	return ans;
+}
+
+size_t weld_vertices(std::vector<uint32_t> & indices, Vertex * vertices, const size_t vertex_count, const float epsilon)
+{
+	// Open addressing table of unique vertices, at most half full.
+	size_t table_size = 1;
+	while (table_size < 2 * vertex_count)
+	{
+		table_size *= 2;
+	}
+	constexpr auto empty = std::numeric_limits<uint32_t>::max();
+	std::vector<uint32_t> table(table_size, empty);
+	std::vector<WeldCell> cells;
+	cells.reserve(vertex_count);
+
+	// Unique vertices are compacted in place, the write position never passes the read one.
+	// Positions within epsilon lie in the same or a neighbouring cell, so the 27 cells around
+	// a vertex hold every unique vertex it can be welded to.
+	std::vector<uint32_t> remap(vertex_count);
+	uint32_t unique = 0;
+	for (size_t v = 0; v < vertex_count; ++v)
+	{
+		const auto cell = weld_cell(vertices[v], epsilon);
+		auto match = empty;
+		for (int64_t dx = -1; dx <= 1; ++dx)
+		{
+			for (int64_t dy = -1; dy <= 1; ++dy)
+			{
+				for (int64_t dz = -1; dz <= 1; ++dz)
+				{
+					const WeldCell neighbour{cell[0] + dx, cell[1] + dy, cell[2] + dz};
+					for (auto slot = weld_hash(neighbour) & (table_size - 1); table[slot] != empty; slot = (slot + 1) & (table_size - 1))
+					{
+						// The earliest match wins, so the result does not depend on the probe order.
+						const auto candidate = table[slot];
+						if (candidate < match && cells[candidate] == neighbour && weld_equal(vertices[candidate], vertices[v], epsilon))
+						{
+							match = candidate;
+						}
+					}
+				}
+			}
+		}
+		if (match == empty)
+		{
+			auto slot = weld_hash(cell) & (table_size - 1);
+			while (table[slot] != empty)
+			{
+				slot = (slot + 1) & (table_size - 1);
+			}
+			table[slot] = unique;
+			cells.push_back(cell);
+			vertices[unique] = vertices[v];
+			match = unique++;
+		}
+		remap[v] = match;
+	}
+
+	for (auto & index: indices)
+	{
+		index = remap[index];
+	}
+	return unique;
+}
+
+void optimize_vertex_cache(std::vector<uint32_t> & indices, const size_t vertex_count)
+{
+	const auto triangle_count = indices.size() / 3;
+	if (triangle_count == 0)
+	{
+		return;
+	}
+
+	// Triangles of every vertex, the first live_triangles of them are not emitted yet.
+	std::vector<uint32_t> live_triangles(vertex_count, 0);
+	for (const auto index: indices)
+	{
+		++live_triangles[index];
+	}
+	std::vector<uint32_t> offsets(vertex_count + 1, 0);
+	for (size_t v = 0; v < vertex_count; ++v)
+	{
+		offsets[v + 1] = offsets[v] + live_triangles[v];
+	}
+	std::vector<uint32_t> adjacency(indices.size());
+	{
+		std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+		for (size_t i = 0; i < indices.size(); ++i)
+		{
+			adjacency[fill[indices[i]]++] = static_cast<uint32_t>(i / 3);
+		}
+	}
+
+	std::vector<int> cache_position(vertex_count, -1);
+	std::vector<float> vertex_scores(vertex_count);
+	for (size_t v = 0; v < vertex_count; ++v)
+	{
+		vertex_scores[v] = vertex_score(-1, live_triangles[v]);
+	}
+	std::vector<float> triangle_scores(triangle_count);
+	size_t best = 0;
+	for (size_t t = 0; t < triangle_count; ++t)
+	{
+		triangle_scores[t] = vertex_scores[indices[3 * t]] + vertex_scores[indices[3 * t + 1]] + vertex_scores[indices[3 * t + 2]];
+		if (triangle_scores[t] > triangle_scores[best])
+		{
+			best = t;
+		}
+	}
+
+	const auto update_score = [&](uint32_t v) {
+		const auto score = vertex_score(cache_position[v], live_triangles[v]);
+		const auto delta = score - vertex_scores[v];
+		vertex_scores[v] = score;
+		for (auto i = offsets[v]; i < offsets[v] + live_triangles[v]; ++i)
+		{
+			triangle_scores[adjacency[i]] += delta;
+		}
+	};
+
+	std::vector<bool> emitted(triangle_count, false);
+	std::vector<uint32_t> result;
+	result.reserve(indices.size());
+	std::array<uint32_t, g_lru_cache_size + 3> cache;
+	std::array<uint32_t, g_lru_cache_size + 3> next_cache;
+	size_t cache_count = 0;
+	size_t cursor = 0;
+	while (result.size() < indices.size())
+	{
+		if (best == g_no_triangle)
+		{
+			// Nothing in the cache has triangles left, continue with the next one in input order.
+			while (emitted[cursor])
+			{
+				++cursor;
+			}
+			best = cursor;
+		}
+
+		emitted[best] = true;
+		const std::array<uint32_t, 3> triangle = {indices[3 * best], indices[3 * best + 1], indices[3 * best + 2]};
+		result.insert(result.end(), triangle.begin(), triangle.end());
+		for (const auto v: triangle)
+		{
+			const auto begin = adjacency.begin() + offsets[v];
+			const auto end = begin + live_triangles[v];
+			std::iter_swap(std::find(begin, end, static_cast<uint32_t>(best)), end - 1);
+			--live_triangles[v];
+		}
+
+		// Emitted vertices move to the front of the cache, the rest shift back.
+		size_t next_count = 0;
+		for (const auto v: triangle)
+		{
+			if (std::find(next_cache.begin(), next_cache.begin() + next_count, v) == next_cache.begin() + next_count)
+			{
+				next_cache[next_count++] = v;
+			}
+		}
+		for (size_t i = 0; i < cache_count; ++i)
+		{
+			if (std::find(triangle.begin(), triangle.end(), cache[i]) == triangle.end())
+			{
+				next_cache[next_count++] = cache[i];
+			}
+		}
+		for (size_t i = g_lru_cache_size; i < next_count; ++i)
+		{
+			cache_position[next_cache[i]] = -1;
+			update_score(next_cache[i]);
+		}
+		cache_count = std::min(next_count, g_lru_cache_size);
+		std::swap(cache, next_cache);
+
+		for (size_t i = 0; i < cache_count; ++i)
+		{
+			cache_position[cache[i]] = static_cast<int>(i);
+			update_score(cache[i]);
+		}
+
+		// Only triangles touching the cache changed their score.
+		best = g_no_triangle;
+		for (size_t i = 0; i < cache_count; ++i)
+		{
+			const auto v = cache[i];
+			for (auto j = offsets[v]; j < offsets[v] + live_triangles[v]; ++j)
+			{
+				const auto t = adjacency[j];
+				if (best == g_no_triangle || triangle_scores[t] > triangle_scores[best])
+				{
+					best = t;
+				}
+			}
+		}
+	}
+	indices.swap(result);
+}
+
+void optimize_overdraw(std::vector<uint32_t> & indices, const Vertex * vertices, const size_t vertex_count)
+{
+	const auto triangle_count = indices.size() / 3;
+	if (triangle_count < 2 * g_min_cluster_triangles)
+	{
+		return;
+	}
+	const auto before = analyze_vertex_cache(indices, vertex_count);
+	const auto target_acmr = before.acmr() * g_overdraw_acmr_threshold;
+
+	// Hard boundaries where the cache starts over anyway.
+	std::vector<size_t> hard;
+	{
+		FifoCache cache(vertex_count);
+		for (size_t t = 0; t < triangle_count; ++t)
+		{
+			const auto misses = cache.misses(&indices[3 * t]);
+			if (t == 0 || misses == 3)
+			{
+				hard.push_back(t);
+			}
+		}
+	}
+	hard.push_back(triangle_count);
+
+	// Soft boundaries once a cluster, simulated from a cold cache, reaches the target miss
+	// ratio, so moving clusters around costs few extra misses.
+	std::vector<size_t> clusters;
+	{
+		FifoCache cache(vertex_count);
+		for (size_t i = 0; i + 1 < hard.size(); ++i)
+		{
+			clusters.push_back(hard[i]);
+			cache.clear();
+			size_t cluster_misses = 0;
+			size_t cluster_triangles = 0;
+			for (auto t = hard[i]; t < hard[i + 1]; ++t)
+			{
+				cluster_misses += cache.misses(&indices[3 * t]);
+				++cluster_triangles;
+				const auto rest = hard[i + 1] - t - 1;
+				if (cluster_triangles >= g_min_cluster_triangles && rest >= g_min_cluster_triangles && cluster_misses <= target_acmr * cluster_triangles)
+				{
+					clusters.push_back(t + 1);
+					cache.clear();
+					cluster_misses = 0;
+					cluster_triangles = 0;
+				}
+			}
+		}
+	}
+	if (clusters.size() < 2)
+	{
+		return;
+	}
+	clusters.push_back(triangle_count);
+
+	// Area weighted centroids and normals, cross products are twice the triangle area long.
+	std::vector<QVector3D> centroids(triangle_count);
+	std::vector<QVector3D> normals(triangle_count);
+	std::vector<float> areas(triangle_count);
+	QVector3D mesh_centroid;
+	float mesh_area = 0.0f;
+	for (size_t t = 0; t < triangle_count; ++t)
+	{
+		const auto & a = vertices[indices[3 * t]].pos;
+		const auto & b = vertices[indices[3 * t + 1]].pos;
+		const auto & c = vertices[indices[3 * t + 2]].pos;
+		normals[t] = QVector3D::crossProduct(b - a, c - a);
+		areas[t] = normals[t].length();
+		centroids[t] = (a + b + c) / 3.0f;
+		mesh_centroid += centroids[t] * areas[t];
+		mesh_area += areas[t];
+	}
+	if (mesh_area <= 0.0f)
+	{
+		return;
+	}
+	mesh_centroid /= mesh_area;
+
+	// Clusters facing away from the center are in front of the others from most directions.
+	struct Cluster {
+		size_t first;
+		size_t count;
+		float key;
+	};
+	std::vector<Cluster> sorted;
+	for (size_t i = 0; i + 1 < clusters.size(); ++i)
+	{
+		QVector3D centroid;
+		QVector3D normal;
+		float area = 0.0f;
+		for (auto t = clusters[i]; t < clusters[i + 1]; ++t)
+		{
+			centroid += centroids[t] * areas[t];
+			normal += normals[t];
+			area += areas[t];
+		}
+		const auto key = area > 0.0f ? QVector3D::dotProduct(centroid / area - mesh_centroid, normal.normalized()) : 0.0f;
+		sorted.push_back({clusters[i], clusters[i + 1] - clusters[i], key});
+	}
+	std::stable_sort(sorted.begin(), sorted.end(), [](const Cluster & a, const Cluster & b) {
+		return a.key > b.key;
+	});
+
+	std::vector<uint32_t> result;
+	result.reserve(indices.size());
+	for (const auto & cluster: sorted)
+	{
+		result.insert(result.end(), indices.begin() + 3 * cluster.first, indices.begin() + 3 * (cluster.first + cluster.count));
+	}
+	if (analyze_vertex_cache(result, vertex_count).acmr() <= target_acmr)
+	{
+		indices.swap(result);
+	}
+}
+
+void optimize_vertex_fetch(std::vector<uint32_t> & indices, Vertex * vertices, const size_t vertex_count)
+{
+	constexpr auto unused = std::numeric_limits<uint32_t>::max();
+	std::vector<uint32_t> remap(vertex_count, unused);
+	uint32_t next = 0;
+	for (auto & index: indices)
+	{
+		if (remap[index] == unused)
+		{
+			remap[index] = next++;
+		}
+		index = remap[index];
+	}
+	// Unreferenced vertices keep their slots at the end, so the range size does not change.
+	for (auto & slot: remap)
+	{
+		if (slot == unused)
+		{
+			slot = next++;
+		}
+	}
+
+	const std::vector<Vertex> source(vertices, vertices + vertex_count);
+	for (size_t v = 0; v < vertex_count; ++v)
+	{
+		vertices[remap[v]] = source[v];
+	}
+}
+
+WeldStats weld_primitive(SceneData & scene, PrimitiveRange & range)
+{
+	auto * index_data = scene.indices.data() + range.indices_byte_offset;
+	auto indices = read_indices(index_data, range.indices_count, range.index_size);
+
+	WeldStats ans;
+	ans.before = range.vertices_count;
+	ans.after = weld_vertices(indices, scene.vertices.data() + range.vertices_offset, range.vertices_count);
+	range.vertices_count = ans.after;
+
+	write_indices(indices, range.index_size, index_data);
+	return ans;
+}
+
+MeshOptimizationStats optimize_primitive(SceneData & scene, const PrimitiveRange & range)
+{
+	auto * index_data = scene.indices.data() + range.indices_byte_offset;
+	auto indices = read_indices(index_data, range.indices_count, range.index_size);
+	auto * vertices = scene.vertices.data() + range.vertices_offset;
+
+	MeshOptimizationStats ans;
+	ans.before = analyze_vertex_cache(indices, range.vertices_count);
+	optimize_vertex_cache(indices, range.vertices_count);
+	optimize_overdraw(indices, vertices, range.vertices_count);
+	optimize_vertex_fetch(indices, vertices, range.vertices_count);
+	ans.after = analyze_vertex_cache(indices, range.vertices_count);
+
+	write_indices(indices, range.index_size, index_data);
+	return ans;
+}
+
+std::vector<LodLevel> simplify_lods(const std::vector<uint32_t> & indices, const Vertex * vertices, const size_t vertex_count, const std::vector<size_t> & targets, const float max_error)
+{
+	std::vector<LodLevel> ans;
+	Simplifier simplifier(indices, vertices, vertex_count);
+	for (const auto target: targets)
+	{
+		if (!simplifier.simplify(target, max_error))
+		{
+			break;
+		}
+		ans.push_back({simplifier.indices(), simplifier.error()});
+	}
+	return ans;
+}
+
+void generate_lods(SceneData & scene, PrimitiveRange & range)
+{
+	range.lod_count = 0;
+	if (range.indices_count < 3 * kMinLodTriangles)
+	{
+		return;
+	}
+
+	auto * index_data = scene.indices.data() + range.indices_byte_offset;
+	const auto indices = read_indices(index_data, range.indices_count, range.index_size);
+	std::vector<size_t> targets;
+	for (size_t level = 1; level <= kMaxLods; ++level)
+	{
+		targets.push_back(lod_indices_budget(range.indices_count, level));
+	}
+	const auto max_error = g_lod_max_error * (range.bounds_max - range.bounds_min).length();
+	auto levels = simplify_lods(indices, scene.vertices.data() + range.vertices_offset, range.vertices_count, targets, max_error);
+
+	// Every level fits its budget, so writing them back to back stays within the reserved room.
+	auto * dst = index_data + range.indices_count * range.index_size;
+	for (auto & level: levels)
+	{
+		optimize_vertex_cache(level.indices, range.vertices_count);
+		write_indices(level.indices, range.index_size, dst);
+		dst += level.indices.size() * range.index_size;
+		range.lod_indices_count[range.lod_count] = level.indices.size();
+		range.lod_error[range.lod_count] = level.error;
+		++range.lod_count;
+	}
+}
+
+void build_meshlets(SceneData & scene, PrimitiveRange & range)
+{
+	const auto indices = read_indices(scene.indices.data() + range.indices_byte_offset, range.indices_count, range.index_size);
+	const auto * vertices = scene.vertices.data() + range.vertices_offset;
+	auto * meshlets = scene.meshlets.data() + range.meshlets_offset;
+	range.meshlets_count = 0;
+
+	// Vertices are stamped with the number of the meshlet they were last added to, so the
+	// set of the current meshlet never needs clearing.
+	std::vector<size_t> stamps(range.vertices_count, 0);
+	std::vector<uint32_t> meshlet_vertices;
+	size_t first = 0;
+	const auto finish = [&](const size_t end) {
+		meshlets[range.meshlets_count++] = meshlet_bounds(indices, first, end, vertices, meshlet_vertices, range.double_sided);
+		meshlet_vertices.clear();
+		first = end;
+	};
+	for (size_t i = 0; i + 2 < indices.size(); i += 3)
+	{
+		const auto * triangle = &indices[i];
+		size_t added = 0;
+		for (size_t k = 0; k < 3; ++k)
+		{
+			const auto repeated = std::find(triangle, triangle + k, triangle[k]) != triangle + k;
+			added += !repeated && stamps[triangle[k]] != range.meshlets_count + 1 ? 1 : 0;
+		}
+		if ((i - first) / 3 == kMeshletMaxTriangles || meshlet_vertices.size() + added > kMeshletMaxVertices)
+		{
+			finish(i);
+		}
+		for (size_t k = 0; k < 3; ++k)
+		{
+			if (stamps[triangle[k]] != range.meshlets_count + 1)
+			{
+				stamps[triangle[k]] = range.meshlets_count + 1;
+				meshlet_vertices.push_back(triangle[k]);
+			}
+		}
+	}
+	if (first + 2 < indices.size())
+	{
+		finish(indices.size() / 3 * 3);
+	}
+}
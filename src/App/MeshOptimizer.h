@@ -0,0 +1,90 @@
+#pragma once
+
+#include "SceneLoader.h"
+
+#include <cstdint>
+#include <vector>
+
+// Post-transform cache behaviour of an index buffer, simulated with a FIFO cache.
+struct VertexCacheStats {
+	size_t triangles = 0;
+	size_t vertices = 0;
+	size_t misses = 0;
+
+	// Average cache miss ratio: transformed vertices per triangle, 0.5 is the ideal for large grids.
+	[[nodiscard]] double acmr() const { return triangles ? static_cast<double>(misses) / triangles : 0.0; }
+	// Average transform to vertex ratio: how often every vertex is transformed, 1 is ideal.
+	[[nodiscard]] double atvr() const { return vertices ? static_cast<double>(misses) / vertices : 0.0; }
+
+	VertexCacheStats & operator+=(const VertexCacheStats & other);
+};
+
+struct MeshOptimizationStats {
+	VertexCacheStats before;
+	VertexCacheStats after;
+
+	MeshOptimizationStats & operator+=(const MeshOptimizationStats & other);
+};
+
+struct WeldStats {
+	size_t before = 0;
+	size_t after = 0;
+
+	// Fraction of vertices removed.
+	[[nodiscard]] double reduction() const { return before ? 1.0 - static_cast<double>(after) / before : 0.0; }
+
+	WeldStats & operator+=(const WeldStats & other);
+};
+
+// FIFO size stats are simulated with, close to what current GPUs reuse in practice.
+constexpr size_t kVertexCacheStatsSize = 16;
+
+VertexCacheStats analyze_vertex_cache(const std::vector<uint32_t> & indices, size_t vertex_count, size_t cache_size = kVertexCacheStatsSize);
+
+// Attributes closer than this are the same when welding, positions are in scene units.
+constexpr float kWeldEpsilon = 1e-5f;
+
+// Merges every vertex into the earliest kept vertex whose attributes all differ from its own
+// by at most epsilon. Unique vertices move to the front in order of first occurrence and
+// indices are remapped; returns how many there are.
+size_t weld_vertices(std::vector<uint32_t> & indices, Vertex * vertices, size_t vertex_count, float epsilon = kWeldEpsilon);
+
+// Reorders triangles for post-transform cache locality with Forsyth's linear-speed algorithm.
+void optimize_vertex_cache(std::vector<uint32_t> & indices, size_t vertex_count);
+
+// Splits a cache-optimized triangle order into clusters where the cache starts over or where
+// a cluster is cache efficient on its own, and sorts them so outward facing clusters are drawn
+// first, which lets the depth test reject more fragments of the ones behind. Keeps the input
+// if the cache would suffer noticeably.
+void optimize_overdraw(std::vector<uint32_t> & indices, const Vertex * vertices, size_t vertex_count);
+
+// Reorders vertices by first use and remaps indices, so vertex fetch walks memory linearly.
+void optimize_vertex_fetch(std::vector<uint32_t> & indices, Vertex * vertices, size_t vertex_count);
+
+// Simplified index buffer and how far, in scene units, it deviates from the full mesh at most.
+struct LodLevel {
+	std::vector<uint32_t> indices;
+	float error = 0.0f;
+};
+
+// Simplifies indices with quadric error edge collapses down to each of targets (index counts,
+// descending) in turn, every level continuing from the previous one. A collapse moves a vertex
+// onto a neighbour, so no vertices are added, and border and attribute seam vertices never move.
+// Stops at the first target that cannot be reached without deviating more than max_error.
+std::vector<LodLevel> simplify_lods(const std::vector<uint32_t> & indices, const Vertex * vertices, size_t vertex_count, const std::vector<size_t> & targets, float max_error);
+
+// Welds a loaded primitive of scene in place and shrinks range to the unique vertices at the
+// front of its slots. The rest are left unused, SceneStreamer compacts welded primitives.
+WeldStats weld_primitive(SceneData & scene, PrimitiveRange & range);
+
+// Runs the three reordering passes above on a loaded primitive of scene, in place.
+MeshOptimizationStats optimize_primitive(SceneData & scene, const PrimitiveRange & range);
+
+// Cuts the full index range of a loaded primitive of scene into meshlets in its current
+// triangle order, so every meshlet is a contiguous index range, and computes their bounds.
+// Double sided primitives get cones that never cull.
+void build_meshlets(SceneData & scene, PrimitiveRange & range);
+
+// Simplifies a loaded primitive of scene into the LOD budgets plan_scene reserved behind its
+// indices and records the levels in range. Levels are ordered for the vertex cache too.
+void generate_lods(SceneData & scene, PrimitiveRange & range);
@@ -0,0 +1,251 @@
+#include "ModelFile.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+
+constexpr quint32 g_glb_magic = 0x46546C67;// "glTF"
+constexpr quint32 g_glb_version = 2;
+constexpr quint32 g_chunk_json = 0x4E4F534A;
+constexpr quint32 g_chunk_bin = 0x004E4942;
+constexpr size_t g_glb_header_size = 12;
+constexpr size_t g_chunk_header_size = 8;
+
+// A data URI tinygltf accepts as the whole buffer 0 after its real bytes were cut out.
+constexpr auto g_stub_buffer_uri = "data:application/octet-stream;base64,AA==";
+
+quint32 read_u32(const unsigned char * bytes)
+{
+	quint32 value;
+	memcpy(&value, bytes, sizeof(value));
+	return value;
+}
+
+struct GlbChunks {
+	const unsigned char * json = nullptr;
+	size_t json_size = 0;
+	const unsigned char * bin = nullptr;
+	size_t bin_size = 0;
+};
+
+bool parse_glb(const unsigned char * data, size_t size, GlbChunks & chunks)
+{
+	if (size < g_glb_header_size + g_chunk_header_size || read_u32(data) != g_glb_magic || read_u32(data + 4) != g_glb_version)
+	{
+		return false;
+	}
+
+	size_t offset = g_glb_header_size;
+	const auto json_size = static_cast<size_t>(read_u32(data + offset));
+	if (read_u32(data + offset + 4) != g_chunk_json || json_size > size - offset - g_chunk_header_size)
+	{
+		return false;
+	}
+	chunks.json = data + offset + g_chunk_header_size;
+	chunks.json_size = json_size;
+	offset += g_chunk_header_size + json_size;
+
+	if (offset + g_chunk_header_size <= size && read_u32(data + offset + 4) == g_chunk_bin)
+	{
+		const auto bin_size = static_cast<size_t>(read_u32(data + offset));
+		if (bin_size > size - offset - g_chunk_header_size)
+		{
+			return false;
+		}
+		chunks.bin = data + offset + g_chunk_header_size;
+		chunks.bin_size = bin_size;
+	}
+	return true;
+}
+
+void print_messages(const std::string & warn, const std::string & err)
+{
+	if (!warn.empty())
+	{
+		fprintf(stderr, "Warn: %s\n", warn.c_str());
+	}
+	if (!err.empty())
+	{
+		fprintf(stderr, "Err: %s\n", err.c_str());
+	}
+}
+
+}// namespace
+
+bool ModelFile::load(const QString & path)
+{
+	auto file = std::make_shared<QFile>(path);
+	if (!file->open(QIODevice::ReadOnly))
+	{
+		fprintf(stderr, "Failed to open model: %s\n", qPrintable(path));
+		return false;
+	}
+
+	size_ = static_cast<size_t>(file->size());
+	data_ = file->map(0, file->size());
+	if (data_)
+	{
+		storage_ = file;
+	}
+	else
+	{
+		// Compressed resources and some file systems can not be mapped.
+		auto bytes = std::make_shared<QByteArray>(file->readAll());
+		data_ = reinterpret_cast<const unsigned char *>(bytes->constData());
+		size_ = static_cast<size_t>(bytes->size());
+		storage_ = bytes;
+	}
+
+	tinygltf::TinyGLTF loader;
+	loader.SetImageLoader(&ModelFile::loadImage, this);
+	std::string err;
+	std::string warn;
+	bool ret = false;
+	if (QFileInfo(path).suffix().compare("gltf", Qt::CaseInsensitive) == 0)
+	{
+		// External buffers and images are resolved relative to the .gltf file.
+		const auto base_dir = QFileInfo(path).absolutePath().toStdString();
+		ret = loader.LoadASCIIFromString(&model_, &err, &warn, reinterpret_cast<const char *>(data_), static_cast<unsigned int>(size_), base_dir);
+	}
+	else
+	{
+		ret = loadBinary(loader, err, warn);
+	}
+	print_messages(warn, err);
+	if (!ret)
+	{
+		fprintf(stderr, "Failed to parse glTF\n");
+	}
+	return ret;
+}
+
+bool ModelFile::loadBinary(tinygltf::TinyGLTF & loader, std::string & err, std::string & warn)
+{
+	const auto copy = [&] {
+		binary_ = nullptr;
+		binaryImages_.clear();
+		return loader.LoadBinaryFromMemory(&model_, &err, &warn, data_, static_cast<unsigned int>(size_));
+	};
+
+	GlbChunks chunks;
+	if (!parse_glb(data_, size_, chunks) || !chunks.bin)
+	{
+		// Let tinygltf report what is wrong with the file.
+		return copy();
+	}
+
+	auto json = QJsonDocument::fromJson(QByteArray::fromRawData(reinterpret_cast<const char *>(chunks.json), static_cast<int>(chunks.json_size))).object();
+	auto buffers = json["buffers"].toArray();
+	if (buffers.isEmpty() || buffers[0].toObject().contains("uri"))
+	{
+		return copy();
+	}
+
+	auto buffer = buffers[0].toObject();
+	if (static_cast<size_t>(buffer["byteLength"].toDouble()) > chunks.bin_size)
+	{
+		return copy();
+	}
+	buffer["uri"] = g_stub_buffer_uri;
+	buffer["byteLength"] = 1;
+	buffers[0] = buffer;
+	json["buffers"] = buffers;
+
+	// Images in the binary chunk are pointed at a one byte stub view, loadImage takes
+	// their real bytes from the mapping.
+	auto views = json["bufferViews"].toArray();
+	auto images = json["images"].toArray();
+	binaryImages_.assign(static_cast<size_t>(images.size()), {});
+	const auto stub_view = views.size();
+	bool stub_used = false;
+	for (int i = 0; i < images.size(); ++i)
+	{
+		auto image = images[i].toObject();
+		if (!image.contains("bufferView"))
+		{
+			continue;
+		}
+		// tinygltf validates views of images it loads itself, these are checked here.
+		const auto view_index = image["bufferView"].toInt(-1);
+		if (view_index < 0 || view_index >= views.size())
+		{
+			return copy();
+		}
+		const auto view = views[view_index].toObject();
+		if (view["buffer"].toInt() != 0)
+		{
+			continue;
+		}
+		const auto offset = view["byteOffset"].toDouble();
+		const auto size = view["byteLength"].toDouble();
+		if (offset < 0.0 || size < 0.0 || offset + size > static_cast<double>(chunks.bin_size))
+		{
+			return copy();
+		}
+		binaryImages_[i].offset = static_cast<size_t>(offset);
+		binaryImages_[i].size = static_cast<size_t>(size);
+		image["bufferView"] = stub_view;
+		images[i] = image;
+		stub_used = true;
+	}
+	if (stub_used)
+	{
+		views.append(QJsonObject{{"buffer", 0}, {"byteOffset", 0}, {"byteLength", 1}});
+		json["bufferViews"] = views;
+		json["images"] = images;
+	}
+
+	binary_ = chunks.bin;
+	const auto rewritten = QJsonDocument(json).toJson(QJsonDocument::Compact);
+	return loader.LoadASCIIFromString(&model_, &err, &warn, rewritten.constData(), static_cast<unsigned int>(rewritten.size()), "");
+}
+
+bool ModelFile::loadImage(tinygltf::Image * image, const int index, std::string *, std::string *, int, int, const unsigned char * bytes, const int size, void * user_data)
+{
+	// Images are left encoded, TextureStreamer decodes them on its worker threads.
+	auto & self = *static_cast<ModelFile *>(user_data);
+	if (self.images_.size() <= static_cast<size_t>(index))
+	{
+		self.images_.resize(static_cast<size_t>(index) + 1);
+	}
+
+	auto & encoded = self.images_[index];
+	if (self.binary_ && static_cast<size_t>(index) < self.binaryImages_.size() && self.binaryImages_[index].size > 0)
+	{
+		const auto & view = self.binaryImages_[index];
+		encoded = {self.storage_, self.binary_ + view.offset, view.size};
+	}
+	else
+	{
+		auto copy = std::make_shared<const std::vector<unsigned char>>(bytes, bytes + size);
+		encoded = {copy, copy->data(), copy->size()};
+	}
+	image->as_is = true;
+	return true;
+}
+
+const unsigned char * ModelFile::buffer(const int index) const
+{
+	if (index == 0 && binary_)
+	{
+		return binary_;
+	}
+	return model_.buffers[index].data.data();
+}
+
+TextureStreamer::EncodedImage ModelFile::image(const int index) const
+{
+	if (static_cast<size_t>(index) < images_.size())
+	{
+		return images_[index];
+	}
+	return {};
+}
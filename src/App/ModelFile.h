@@ -0,0 +1,52 @@
+#pragma once
+
+#include "TextureStreamer.h"
+
+#include <QString>
+
+#include <memory>
+#include <vector>
+
+#include <tinygltf/tiny_gltf.h>
+
+// A glTF model together with the bytes its accessors and images point to.
+// The file is memory-mapped; for .glb files tinygltf only parses the JSON chunk and
+// geometry and images are read straight from the mapped binary chunk, so nothing is
+// copied into tinygltf::Buffer::data. Draco compressed views are decoded by load_primitive().
+// .gltf files go through the regular copying loader.
+class ModelFile final
+{
+public:
+	// Prints warnings and errors. Returns false if the model could not be parsed.
+	bool load(const QString & path);
+
+	[[nodiscard]] const tinygltf::Model & model() const noexcept { return model_; }
+	// First byte of the buffer with given index.
+	[[nodiscard]] const unsigned char * buffer(int index) const;
+	// Encoded bytes of the image with given index, they keep the mapping alive on their own.
+	[[nodiscard]] TextureStreamer::EncodedImage image(int index) const;
+	// True if the binary chunk is read from the mapping rather than from a copy.
+	[[nodiscard]] bool zeroCopy() const noexcept { return binary_ != nullptr; }
+
+private:
+	bool loadBinary(tinygltf::TinyGLTF & loader, std::string & err, std::string & warn);
+	static bool loadImage(tinygltf::Image * image, int index, std::string * err, std::string * warn, int req_width, int req_height, const unsigned char * bytes, int size, void * user_data);
+
+private:
+	// Owns the mapping or, if the file can not be mapped, the bytes read from it.
+	std::shared_ptr<const void> storage_;
+	const unsigned char * data_ = nullptr;
+	size_t size_ = 0;
+
+	// Binary chunk of a .glb loaded without copying, it stands in for buffer 0.
+	const unsigned char * binary_ = nullptr;
+	// Byte ranges of images stored in the binary chunk, size == 0 for other images.
+	struct ImageView {
+		size_t offset = 0;
+		size_t size = 0;
+	};
+	std::vector<ImageView> binaryImages_;
+
+	std::vector<TextureStreamer::EncodedImage> images_;
+	tinygltf::Model model_;
+};
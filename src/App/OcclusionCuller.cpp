@@ -0,0 +1,271 @@
+#include "OcclusionCuller.h"
+
+#include "Frustum.h"
+
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OCCLUSION_CULLER_SSE2 1
+#endif
+
+namespace
+{
+
+static_assert(OcclusionCuller::kWidth % 4 == 0, "Rows are processed 4 pixels at a time");
+
+// Triangles with a vertex this close to the eye plane are skipped instead of clipped.
+constexpr float g_min_w = 1e-4f;
+
+// a * x + b * y + c, positive inside of a counter-clockwise triangle.
+struct Plane {
+	float a;
+	float b;
+	float c;
+};
+
+Plane edge(const QVector3D & p, const QVector3D & q)
+{
+	return {p.y() - q.y(), q.x() - p.x(), (q.y() - p.y()) * p.x() - (q.x() - p.x()) * p.y()};
+}
+
+uint32_t read_index(const Occluder & occluder, const size_t i)
+{
+	if (occluder.index_size == sizeof(uint32_t))
+	{
+		uint32_t index;
+		std::memcpy(&index, occluder.indices + i * sizeof(uint32_t), sizeof(uint32_t));
+		return index;
+	}
+	uint16_t index;
+	std::memcpy(&index, occluder.indices + i * sizeof(uint16_t), sizeof(uint16_t));
+	return index;
+}
+
+// Window coordinates: pixels in x and y, depth in [0, 1].
+QVector3D to_window(const QVector4D & clip)
+{
+	return QVector3D((clip.x() / clip.w() * 0.5f + 0.5f) * OcclusionCuller::kWidth,
+					 (clip.y() / clip.w() * 0.5f + 0.5f) * OcclusionCuller::kHeight,
+					 clip.z() / clip.w() * 0.5f + 0.5f);
+}
+
+bool in_front_of_near_plane(const QVector4D & clip)
+{
+	return clip.w() > g_min_w && clip.z() >= -clip.w();
+}
+
+float distance_to_box(const QVector3D & point, const QVector3D & box_min, const QVector3D & box_max)
+{
+	QVector3D delta;
+	for (int i = 0; i < 3; ++i)
+	{
+		delta[i] = std::max({box_min[i] - point[i], 0.0f, point[i] - box_max[i]});
+	}
+	return delta.length();
+}
+
+}// namespace
+
+OcclusionCuller::OcclusionCuller()
+	: depth_(static_cast<size_t>(kWidth) * kHeight, 1.0f)
+{
+	pool_.setMaxThreadCount(1);
+}
+
+OcclusionCuller::~OcclusionCuller()
+{
+	wait();
+}
+
+void OcclusionCuller::start(const QMatrix4x4 & viewProjection, const QVector3D & eye, const std::vector<Occluder> & occluders)
+{
+	wait();
+	viewProjection_ = viewProjection;
+	future_ = QtConcurrent::run(&pool_, [this, eye, &occluders] { render(eye, occluders); });
+}
+
+void OcclusionCuller::wait()
+{
+	future_.waitForFinished();
+}
+
+void OcclusionCuller::render(const QVector3D & eye, const std::vector<Occluder> & occluders)
+{
+	std::fill(depth_.begin(), depth_.end(), 1.0f);
+
+	// Occluders in view, the ones covering the most of it first.
+	const Frustum frustum(viewProjection_);
+	std::vector<std::pair<float, size_t>> ranked;
+	for (size_t i = 0; i < occluders.size(); ++i)
+	{
+		const auto & occluder = occluders[i];
+		if (frustum.intersects(occluder.bounds_min, occluder.bounds_max))
+		{
+			const auto size = (occluder.bounds_max - occluder.bounds_min).length();
+			const auto distance = std::max(distance_to_box(eye, occluder.bounds_min, occluder.bounds_max), g_min_w);
+			ranked.push_back({size / distance, i});
+		}
+	}
+	occluderCount_ = std::min(ranked.size(), kMaxOccluders);
+	std::partial_sort(ranked.begin(), ranked.begin() + occluderCount_, ranked.end(), std::greater<>());
+
+	triangleCount_ = 0;
+	for (size_t i = 0; i < occluderCount_; ++i)
+	{
+		const auto & occluder = occluders[ranked[i].second];
+		const auto mvp = viewProjection_ * occluder.model;
+		const auto corner = [&](const size_t index) {
+			return mvp * QVector4D(occluder.vertices[read_index(occluder, index)].pos, 1.0f);
+		};
+		for (size_t j = 0; j + 2 < occluder.index_count; j += 3)
+		{
+			rasterize(corner(j), corner(j + 1), corner(j + 2));
+		}
+		triangleCount_ += occluder.index_count / 3;
+	}
+}
+
+void OcclusionCuller::rasterize(const QVector4D & a, const QVector4D & b, const QVector4D & c)
+{
+	// Clipping is left out, occluders only have to hide less than they could.
+	if (!in_front_of_near_plane(a) || !in_front_of_near_plane(b) || !in_front_of_near_plane(c))
+	{
+		return;
+	}
+	auto p0 = to_window(a);
+	auto p1 = to_window(b);
+	auto p2 = to_window(c);
+	auto area = QVector3D::crossProduct(p1 - p0, p2 - p0).z();
+	if (std::abs(area) < 1e-6f)
+	{
+		return;
+	}
+	// Both faces occlude.
+	if (area < 0.0f)
+	{
+		std::swap(p1, p2);
+		area = -area;
+	}
+
+	const auto min_x = std::max(static_cast<int>(std::floor(std::min({p0.x(), p1.x(), p2.x()}))), 0);
+	const auto max_x = std::min(static_cast<int>(std::ceil(std::max({p0.x(), p1.x(), p2.x()}))), kWidth - 1);
+	const auto min_y = std::max(static_cast<int>(std::floor(std::min({p0.y(), p1.y(), p2.y()}))), 0);
+	const auto max_y = std::min(static_cast<int>(std::ceil(std::max({p0.y(), p1.y(), p2.y()}))), kHeight - 1);
+	if (min_x > max_x || min_y > max_y)
+	{
+		return;
+	}
+
+	const Plane edges[3] = {edge(p1, p2), edge(p2, p0), edge(p0, p1)};
+	// Depth is affine in window coordinates, its plane follows from the barycentric weights.
+	const Plane z{
+		(edges[0].a * p0.z() + edges[1].a * p1.z() + edges[2].a * p2.z()) / area,
+		(edges[0].b * p0.z() + edges[1].b * p1.z() + edges[2].b * p2.z()) / area,
+		(edges[0].c * p0.z() + edges[1].c * p1.z() + edges[2].c * p2.z()) / area,
+	};
+
+	// Pixels are sampled at their centers. Rows start 4-aligned, the edge functions reject
+	// the extra pixels.
+	const auto first_x = min_x & ~3;
+	for (int y = min_y; y <= max_y; ++y)
+	{
+		const auto fy = static_cast<float>(y) + 0.5f;
+		auto * row = depth_.data() + static_cast<size_t>(y) * kWidth;
+#if defined(OCCLUSION_CULLER_SSE2)
+		const auto plane_at = [&](const Plane & plane) {
+			return std::make_pair(_mm_set1_ps(plane.a * 4.0f), _mm_add_ps(_mm_set1_ps(plane.b * fy + plane.c), _mm_mul_ps(_mm_set1_ps(plane.a), _mm_setr_ps(first_x + 0.5f, first_x + 1.5f, first_x + 2.5f, first_x + 3.5f))));
+		};
+		auto [e0_step, e0] = plane_at(edges[0]);
+		auto [e1_step, e1] = plane_at(edges[1]);
+		auto [e2_step, e2] = plane_at(edges[2]);
+		auto [z_step, depth] = plane_at(z);
+		const auto zero = _mm_setzero_ps();
+		for (int x = first_x; x <= max_x; x += 4)
+		{
+			const auto inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+			const auto old = _mm_loadu_ps(row + x);
+			const auto nearer = _mm_min_ps(old, depth);
+			_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+			e0 = _mm_add_ps(e0, e0_step);
+			e1 = _mm_add_ps(e1, e1_step);
+			e2 = _mm_add_ps(e2, e2_step);
+			depth = _mm_add_ps(depth, z_step);
+		}
+#else
+		for (int x = first_x; x <= max_x; ++x)
+		{
+			const auto fx = static_cast<float>(x) + 0.5f;
+			const auto at = [&](const Plane & plane) { return plane.a * fx + plane.b * fy + plane.c; };
+			if (at(edges[0]) >= 0.0f && at(edges[1]) >= 0.0f && at(edges[2]) >= 0.0f)
+			{
+				row[x] = std::min(row[x], at(z));
+			}
+		}
+#endif
+	}
+}
+
+bool OcclusionCuller::occluded(const QVector3D & bounds_min, const QVector3D & bounds_max) const
+{
+	QVector3D window_min(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+	QVector3D window_max = -window_min;
+	for (int corner = 0; corner < 8; ++corner)
+	{
+		const auto clip = viewProjection_ * QVector4D(
+			corner & 1 ? bounds_max.x() : bounds_min.x(),
+			corner & 2 ? bounds_max.y() : bounds_min.y(),
+			corner & 4 ? bounds_max.z() : bounds_min.z(),
+			1.0f);
+		if (!in_front_of_near_plane(clip))
+		{
+			return false;
+		}
+		const auto p = to_window(clip);
+		for (int i = 0; i < 3; ++i)
+		{
+			window_min[i] = std::min(window_min[i], p[i]);
+			window_max[i] = std::max(window_max[i], p[i]);
+		}
+	}
+
+	// Every pixel the box touches, the nearest depth of the box has to be behind all of them.
+	const auto min_x = std::max(static_cast<int>(std::floor(window_min.x())), 0);
+	const auto max_x = std::min(static_cast<int>(std::floor(window_max.x())), kWidth - 1);
+	const auto min_y = std::max(static_cast<int>(std::floor(window_min.y())), 0);
+	const auto max_y = std::min(static_cast<int>(std::floor(window_max.y())), kHeight - 1);
+	if (min_x > max_x || min_y > max_y)
+	{
+		return false;
+	}
+	const auto box_depth = window_min.z();
+	for (int y = min_y; y <= max_y; ++y)
+	{
+		const auto * row = depth_.data() + static_cast<size_t>(y) * kWidth;
+		int x = min_x;
+#if defined(OCCLUSION_CULLER_SSE2)
+		const auto box = _mm_set1_ps(box_depth);
+		for (; x + 3 <= max_x; x += 4)
+		{
+			if (_mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(row + x), box)) != 0xF)
+			{
+				return false;
+			}
+		}
+#endif
+		for (; x <= max_x; ++x)
+		{
+			if (!(row[x] < box_depth))
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "SceneLoader.h"
+
+#include <QFuture>
+#include <QMatrix4x4>
+#include <QThreadPool>
+#include <QVector3D>
+#include <QVector4D>
+
+#include <vector>
+
+// Triangles rasterized into the occlusion buffer, a simplified level of a large primitive.
+struct Occluder {
+	QMatrix4x4 model;
+	const Vertex * vertices;// Indices are relative to this one.
+	const unsigned char * indices;
+	size_t index_size;
+	size_t index_count;
+	QVector3D bounds_min;// After the model transform.
+	QVector3D bounds_max;
+};
+
+// Software occlusion culling without GPU readback: every frame the occluders nearest to
+// the camera are rasterized into a small depth buffer on a worker thread, boxes are then
+// occluded if they are behind that depth everywhere they cover. Rows are filled and tested
+// 4 pixels at a time with SSE2.
+class OcclusionCuller final
+{
+public:
+	static constexpr int kWidth = 256;
+	static constexpr int kHeight = 128;
+	// Occluders rasterized per frame at most, the largest on screen first.
+	static constexpr size_t kMaxOccluders = 64;
+
+	OcclusionCuller();
+	~OcclusionCuller();
+
+	// Starts rasterizing occluders as seen through viewProjection from eye. occluders and
+	// what they point to must stay unchanged until wait() returned.
+	void start(const QMatrix4x4 & viewProjection, const QVector3D & eye, const std::vector<Occluder> & occluders);
+	// Waits for the depth buffer of the last start().
+	void wait();
+
+	// True if the part of the box inside of the view is hidden behind the occluders. Boxes
+	// crossing the near plane are never occluded.
+	[[nodiscard]] bool occluded(const QVector3D & bounds_min, const QVector3D & bounds_max) const;
+
+	[[nodiscard]] size_t occluderCount() const noexcept { return occluderCount_; }
+	[[nodiscard]] size_t triangleCount() const noexcept { return triangleCount_; }
+	// Depth in [0, 1] of pixel (x, y), y grows upwards like in NDC.
+	[[nodiscard]] float depth(int x, int y) const { return depth_[static_cast<size_t>(y) * kWidth + x]; }
+
+private:
+	void render(const QVector3D & eye, const std::vector<Occluder> & occluders);
+	void rasterize(const QVector4D & a, const QVector4D & b, const QVector4D & c);
+
+private:
+	QMatrix4x4 viewProjection_;
+	std::vector<float> depth_;
+	size_t occluderCount_ = 0;
+	size_t triangleCount_ = 0;
+	QFuture<void> future_;
+
+	// Declared last so it is destroyed first and the worker never outlives the buffer it writes to.
+	QThreadPool pool_;
+};
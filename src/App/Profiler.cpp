@@ -0,0 +1,243 @@
+#include "Profiler.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <numeric>
+
+namespace
+{
+
+double to_ms(const qint64 ns)
+{
+	return static_cast<double>(ns) / 1e6;
+}
+
+}// namespace
+
+FrameProfiler::ScopeGuard::ScopeGuard(FrameProfiler & profiler, const size_t scope)
+	: profiler_{profiler}
+	, scope_{scope}
+{
+	profiler_.beginScope(scope_);
+	timer_.start();
+}
+
+FrameProfiler::ScopeGuard::~ScopeGuard()
+{
+	profiler_.endScope(scope_, to_ms(timer_.nsecsElapsed()));
+}
+
+FrameProfiler::FrameGuard::FrameGuard(FrameProfiler & profiler)
+	: profiler_{profiler}
+{
+	profiler_.beginFrame();
+	timer_.start();
+}
+
+FrameProfiler::FrameGuard::~FrameGuard()
+{
+	profiler_.endFrame(to_ms(timer_.nsecsElapsed()));
+}
+
+auto FrameProfiler::frame() -> FrameGuard
+{
+	return FrameGuard{*this};
+}
+
+auto FrameProfiler::scope(const char * name) -> ScopeGuard
+{
+	const auto it = std::find(scopeNames_.begin(), scopeNames_.end(), name);
+	if (it != scopeNames_.end())
+	{
+		return ScopeGuard{*this, static_cast<size_t>(it - scopeNames_.begin())};
+	}
+
+	scopeNames_.emplace_back(name);
+	scopeCpu_.emplace_back();
+	scopeGpu_.emplace_back();
+	return ScopeGuard{*this, scopeNames_.size() - 1};
+}
+
+void FrameProfiler::flush()
+{
+	resolveAvailable(true);
+}
+
+void FrameProfiler::release()
+{
+	for (auto & frame: ring_)
+	{
+		frame.pending = false;
+		frame.queries.clear();
+		frame.issued.clear();
+	}
+}
+
+void FrameProfiler::setFrameCallback(std::function<void(const FrameRecord &)> callback)
+{
+	callback_ = std::move(callback);
+}
+
+void FrameProfiler::beginFrame()
+{
+	if (intervalTimer_.isValid())
+	{
+		frameInterval_.push(to_ms(intervalTimer_.nsecsElapsed()));
+	}
+	intervalTimer_.start();
+
+	auto & frame = current();
+	if (frame.pending && !resolve(frame, false))
+	{
+		// GPU is more than kFramesInFlight frames behind, reuse the queries and lose this sample.
+		frame.pending = false;
+		++dropped_;
+	}
+
+	frame.record.index = frameIndex_;
+	frame.record.cpu_ms = 0.0;
+	frame.record.gpu_ms = 0.0;
+	frame.record.scopes.assign(scopeNames_.size(), {});
+	frame.issued.assign(frame.queries.size(), 0);
+}
+
+void FrameProfiler::endFrame(const double cpu_ms)
+{
+	auto & frame = current();
+	frame.record.cpu_ms = cpu_ms;
+	frame.pending = true;
+	frameCpu_.push(cpu_ms);
+	for (size_t scope = 0; scope < frame.issued.size(); ++scope)
+	{
+		if (frame.issued[scope] > 0)
+		{
+			scopeCpu_[scope].push(frame.record.scopes[scope].cpu_ms);
+		}
+	}
+
+	++frameIndex_;
+	resolveAvailable(false);
+}
+
+void FrameProfiler::beginScope(const size_t scope)
+{
+	assert(!scopeActive_);
+	scopeActive_ = true;
+
+	auto & frame = current();
+	if (frame.queries.size() <= scope)
+	{
+		frame.queries.resize(scopeNames_.size());
+		frame.issued.resize(scopeNames_.size(), 0);
+	}
+	if (frame.record.scopes.size() <= scope)
+	{
+		frame.record.scopes.resize(scopeNames_.size());
+	}
+
+	auto & queries = frame.queries[scope];
+	if (queries.size() <= frame.issued[scope])
+	{
+		queries.push_back(std::make_unique<QOpenGLTimerQuery>());
+		queries.back()->create();
+	}
+	queries[frame.issued[scope]++]->begin();
+}
+
+void FrameProfiler::endScope(const size_t scope, const double cpu_ms)
+{
+	auto & frame = current();
+	frame.queries[scope][frame.issued[scope] - 1]->end();
+	frame.record.scopes[scope].cpu_ms += cpu_ms;
+	scopeActive_ = false;
+}
+
+bool FrameProfiler::resolve(PendingFrame & frame, const bool wait)
+{
+	if (!wait)
+	{
+		for (size_t scope = 0; scope < frame.issued.size(); ++scope)
+		{
+			for (size_t i = 0; i < frame.issued[scope]; ++i)
+			{
+				if (!frame.queries[scope][i]->isResultAvailable())
+				{
+					return false;
+				}
+			}
+		}
+	}
+
+	for (size_t scope = 0; scope < frame.issued.size(); ++scope)
+	{
+		if (frame.issued[scope] == 0)
+		{
+			continue;
+		}
+		auto gpu_ms = 0.0;
+		for (size_t i = 0; i < frame.issued[scope]; ++i)
+		{
+			gpu_ms += to_ms(static_cast<qint64>(frame.queries[scope][i]->waitForResult()));
+		}
+		frame.record.scopes[scope].gpu_ms = gpu_ms;
+		frame.record.gpu_ms += gpu_ms;
+		scopeGpu_[scope].push(gpu_ms);
+	}
+	frameGpu_.push(frame.record.gpu_ms);
+	frame.pending = false;
+
+	if (callback_)
+	{
+		callback_(frame.record);
+	}
+	return true;
+}
+
+void FrameProfiler::resolveAvailable(const bool wait)
+{
+	// Oldest frame first, so results are reported in submission order.
+	for (size_t i = 0; i < kFramesInFlight; ++i)
+	{
+		auto & frame = ring_[(frameIndex_ + i) % kFramesInFlight];
+		if (frame.pending && !resolve(frame, wait))
+		{
+			break;
+		}
+	}
+}
+
+void FrameProfiler::RollingStats::push(const double value)
+{
+	if (values_.size() < kHistorySize)
+	{
+		values_.push_back(value);
+	}
+	else
+	{
+		values_[next_] = value;
+	}
+	next_ = (next_ + 1) % kHistorySize;
+}
+
+auto FrameProfiler::RollingStats::stats() const -> Stats
+{
+	return computeStats(values_);
+}
+
+auto FrameProfiler::computeStats(std::vector<double> values) -> Stats
+{
+	if (values.empty())
+	{
+		return {};
+	}
+
+	std::sort(values.begin(), values.end());
+	const auto p99_index = static_cast<size_t>(std::ceil(0.99 * static_cast<double>(values.size()))) - 1;
+
+	Stats result;
+	result.min = values.front();
+	result.avg = std::accumulate(values.begin(), values.end(), 0.0) / static_cast<double>(values.size());
+	result.p99 = values[std::min(p99_index, values.size() - 1)];
+	return result;
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <QElapsedTimer>
+#include <QOpenGLTimerQuery>
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Scoped CPU/GPU profiler. Every scope records its CPU time and a GL_TIME_ELAPSED query.
+// Queries live in a ring of kFramesInFlight frames and are read back only once available,
+// so the CPU never waits for the GPU (unless flush() is called explicitly).
+class FrameProfiler final
+{
+public:
+	static constexpr size_t kFramesInFlight = 4;
+	static constexpr size_t kHistorySize = 240;
+
+	struct Stats {
+		double min = 0.0;
+		double avg = 0.0;
+		double p99 = 0.0;
+	};
+
+	struct ScopeSample {
+		double cpu_ms = 0.0;
+		double gpu_ms = 0.0;
+	};
+
+	struct FrameRecord {
+		size_t index = 0;
+		double cpu_ms = 0.0;
+		double gpu_ms = 0.0;
+		std::vector<ScopeSample> scopes;// Indexed like scopeNames().
+	};
+
+	class ScopeGuard final
+	{
+	public:
+		ScopeGuard(FrameProfiler & profiler, size_t scope);
+		~ScopeGuard();
+
+		ScopeGuard(const ScopeGuard &) = delete;
+		ScopeGuard(ScopeGuard &&) = delete;
+		ScopeGuard & operator=(const ScopeGuard &) = delete;
+		ScopeGuard & operator=(ScopeGuard &&) = delete;
+
+	private:
+		FrameProfiler & profiler_;
+		size_t scope_;
+		QElapsedTimer timer_;
+	};
+
+	class FrameGuard final
+	{
+	public:
+		explicit FrameGuard(FrameProfiler & profiler);
+		~FrameGuard();
+
+		FrameGuard(const FrameGuard &) = delete;
+		FrameGuard(FrameGuard &&) = delete;
+		FrameGuard & operator=(const FrameGuard &) = delete;
+		FrameGuard & operator=(FrameGuard &&) = delete;
+
+	private:
+		FrameProfiler & profiler_;
+		QElapsedTimer timer_;
+	};
+
+public:
+	FrameProfiler() = default;
+	FrameProfiler(const FrameProfiler &) = delete;
+	FrameProfiler & operator=(const FrameProfiler &) = delete;
+
+	// Scopes must not nest: GL_TIME_ELAPSED queries cannot be active at the same time.
+	// A name entered several times in a frame reports the sum of its times.
+	[[nodiscard]] FrameGuard frame();
+	[[nodiscard]] ScopeGuard scope(const char * name);
+
+	// Blocks until all issued queries are resolved.
+	void flush();
+	// Destroys query objects, the owning context must be current.
+	void release();
+
+	void setFrameCallback(std::function<void(const FrameRecord &)> callback);
+
+	[[nodiscard]] const std::vector<std::string> & scopeNames() const { return scopeNames_; }
+	[[nodiscard]] Stats frameIntervalStats() const { return frameInterval_.stats(); }
+	[[nodiscard]] Stats frameCpuStats() const { return frameCpu_.stats(); }
+	[[nodiscard]] Stats frameGpuStats() const { return frameGpu_.stats(); }
+	[[nodiscard]] Stats scopeCpuStats(size_t scope) const { return scopeCpu_[scope].stats(); }
+	[[nodiscard]] Stats scopeGpuStats(size_t scope) const { return scopeGpu_[scope].stats(); }
+	[[nodiscard]] static Stats computeStats(std::vector<double> values);
+	// Frames whose queries were still pending when their ring slot was reused.
+	[[nodiscard]] size_t droppedFrames() const { return dropped_; }
+
+private:
+	class RollingStats final
+	{
+	public:
+		void push(double value);
+		[[nodiscard]] Stats stats() const;
+
+	private:
+		std::vector<double> values_;
+		size_t next_ = 0;
+	};
+
+	struct PendingFrame {
+		bool pending = false;
+		FrameRecord record;
+		// Per scope, one query for every time it was entered in the frame.
+		std::vector<std::vector<std::unique_ptr<QOpenGLTimerQuery>>> queries;
+		std::vector<size_t> issued;// Queries of queries[scope] used this frame.
+	};
+
+	void beginFrame();
+	void endFrame(double cpu_ms);
+	void beginScope(size_t scope);
+	void endScope(size_t scope, double cpu_ms);
+
+	bool resolve(PendingFrame & frame, bool wait);
+	void resolveAvailable(bool wait);
+	PendingFrame & current() { return ring_[frameIndex_ % kFramesInFlight]; }
+
+private:
+	std::array<PendingFrame, kFramesInFlight> ring_;
+	size_t frameIndex_ = 0;
+	bool scopeActive_ = false;
+	size_t dropped_ = 0;
+
+	std::vector<std::string> scopeNames_;
+	QElapsedTimer intervalTimer_;
+
+	RollingStats frameInterval_;
+	RollingStats frameCpu_;
+	RollingStats frameGpu_;
+	std::vector<RollingStats> scopeCpu_;
+	std::vector<RollingStats> scopeGpu_;
+
+	std::function<void(const FrameRecord &)> callback_;
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+// Renderer switches selected on the command line.
+struct RenderOptions {
+	// Upload PackedVertex instead of Vertex and draw with diffuse.vs built with PACKED_VERTICES.
+	bool packedVertices = false;
+	// Submit one glMultiDrawElementsIndirect per texture pair when the context is GL 4.3+.
+	bool multiDrawIndirect = true;
+	// Cull instances and select their LODs in a compute shader that writes the indirect commands.
+	bool gpuCulling = false;
+	// Skip primitives whose bounds are outside of the view frustum.
+	bool frustumCulling = true;
+	// Skip instances hidden behind large occluders rasterized on the CPU, while nothing morphs.
+	bool occlusionCulling = false;
+	// Initial speed of the vertex shader deformation, 0 keeps the geometry static.
+	float morphSpeed = 0.2f;
+	// Bend the tangent frame with the Jacobian of the deformation instead of morphing three
+	// offset points and taking differences.
+	bool analyticMorph = true;
+	// Morph every vertex once per frame into a buffer all draws read, while the morph speed is not 0.
+	bool morphCache = false;
+	// Load the baked scene from the user cache directory and bake it on a miss.
+	bool sceneCache = true;
+	// Merge duplicate vertices of every primitive while loading.
+	bool weldVertices = true;
+	// Load primitives placed by several nodes once and draw their placements instanced.
+	bool instancing = true;
+	// Cull the meshlets of primitives drawn at full detail against the frustum and by their normal cones.
+	bool meshletCulling = false;
+	// Simplify large primitives into LOD levels while loading and draw distant ones with fewer triangles.
+	bool lod = true;
+	// Reorder primitives for the post-transform cache, overdraw and vertex fetch while loading.
+	bool optimizeMeshes = true;
+};
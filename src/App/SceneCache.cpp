@@ -0,0 +1,468 @@
+#include "SceneCache.h"
+
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+
+constexpr char g_magic[8] = {'F', 'G', 'L', 'S', 'C', 'E', 'N', 'E'};
+// Bump whenever the layout of the file or of any struct stored in it changes.
+constexpr uint32_t g_version = 7;
+constexpr size_t g_alignment = 16;
+constexpr size_t g_bytes_per_pixel = 4;
+// Larger images are taken as corruption, GL_MAX_TEXTURE_SIZE is far below.
+constexpr uint32_t g_max_image_size = 1 << 16;
+
+struct Header {
+	char magic[8];
+	uint32_t version;
+	uint32_t vertex_size;
+	uint32_t options;// load_options() of the RenderOptions the scene was baked with.
+	uint32_t reserved;
+	uint64_t source_hash;
+	uint64_t source_size;
+	uint64_t file_size;
+	uint64_t vertices_offset;
+	uint64_t vertex_count;
+	uint64_t indices_offset;
+	uint64_t index_bytes;
+	uint64_t primitives_offset;
+	uint64_t primitive_count;
+	uint64_t meshlets_offset;
+	uint64_t meshlet_count;
+	uint64_t instances_offset;
+	uint64_t instance_count;
+	uint64_t images_offset;
+	uint64_t image_count;
+};
+
+// Entry of the image table, levels are stored one after another starting at offset.
+struct CachedImage {
+	uint32_t width;
+	uint32_t height;
+	uint32_t levels;
+	uint32_t reserved;
+	uint64_t offset;
+};
+
+// Bits of the options that change what loading derives from the model.
+uint32_t load_options(const RenderOptions & options)
+{
+	return (options.weldVertices ? 1u : 0u) | (options.optimizeMeshes ? 2u : 0u) | (options.lod ? 4u : 0u) | (options.instancing ? 8u : 0u);
+}
+
+size_t align(size_t offset)
+{
+	return (offset + g_alignment - 1) / g_alignment * g_alignment;
+}
+
+uint64_t rotl(uint64_t value, int bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+// Non-cryptographic 64-bit content hash in the spirit of xxHash64: four independent lanes
+// keep it memory bound, so hashing on every start costs little next to parsing.
+uint64_t hash_bytes(const unsigned char * data, size_t size)
+{
+	constexpr uint64_t p1 = 11400714785074694791ull;
+	constexpr uint64_t p2 = 14029467366897019727ull;
+	constexpr uint64_t p3 = 1609587929392839161ull;
+
+	uint64_t lanes[4] = {p1 + p2, p2, 0, 0 - p1};
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		for (size_t lane = 0; lane < 4; ++lane)
+		{
+			uint64_t value;
+			memcpy(&value, data + i + lane * 8, sizeof(value));
+			lanes[lane] = rotl(lanes[lane] + value * p2, 31) * p1;
+		}
+	}
+
+	auto hash = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18) + size;
+	for (; i < size; ++i)
+	{
+		hash = rotl(hash ^ (data[i] * p3), 11) * p1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= p2;
+	hash ^= hash >> 29;
+	hash *= p3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+// Box-filters level 0 down to 1x1, odd edges repeat their last texel.
+std::vector<unsigned char> build_mip_chain(const TextureStreamer::MipLevel & base, uint32_t & levels)
+{
+	std::vector<unsigned char> chain(base.pixels, base.pixels + static_cast<size_t>(base.width) * base.height * g_bytes_per_pixel);
+	levels = 1;
+
+	size_t src_offset = 0;
+	int width = base.width;
+	int height = base.height;
+	while (width > 1 || height > 1)
+	{
+		const auto next_width = std::max(width / 2, 1);
+		const auto next_height = std::max(height / 2, 1);
+		const auto dst_offset = chain.size();
+		chain.resize(dst_offset + static_cast<size_t>(next_width) * next_height * g_bytes_per_pixel);
+
+		const auto texel = [&](int x, int y, size_t c) {
+			x = std::min(x, width - 1);
+			y = std::min(y, height - 1);
+			return static_cast<unsigned>(chain[src_offset + (static_cast<size_t>(y) * width + x) * g_bytes_per_pixel + c]);
+		};
+		for (int y = 0; y < next_height; ++y)
+		{
+			for (int x = 0; x < next_width; ++x)
+			{
+				for (size_t c = 0; c < g_bytes_per_pixel; ++c)
+				{
+					const auto sum = texel(2 * x, 2 * y, c) + texel(2 * x + 1, 2 * y, c) + texel(2 * x, 2 * y + 1, c) + texel(2 * x + 1, 2 * y + 1, c);
+					chain[dst_offset + (static_cast<size_t>(y) * next_width + x) * g_bytes_per_pixel + c] = static_cast<unsigned char>((sum + 2) / 4);
+				}
+			}
+		}
+
+		src_offset = dst_offset;
+		width = next_width;
+		height = next_height;
+		++levels;
+	}
+	return chain;
+}
+
+// Whether items [offset, offset + count) lie within total items.
+bool range_fits(uint64_t offset, uint64_t count, uint64_t total)
+{
+	return count <= total && offset <= total - count;
+}
+
+template<class Index>
+bool indices_below(const unsigned char * data, uint64_t count, uint64_t limit)
+{
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		Index index;
+		memcpy(&index, data + i * sizeof(Index), sizeof(index));
+		if (index >= limit)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Whether every range a primitive draws from, including its LOD levels, meshlets and the
+// vertices its indices refer to, lies within the sections of the file.
+bool primitive_fits(const CachedPrimitive & primitive, const Header & header, const unsigned char * data)
+{
+	if (!range_fits(primitive.vertices_offset, primitive.vertices_count, header.vertex_count)
+		|| (primitive.index_size != sizeof(uint16_t) && primitive.index_size != sizeof(uint32_t))
+		|| primitive.indices_byte_offset % primitive.index_size != 0 || primitive.lod_count > kMaxLods
+		|| !range_fits(primitive.meshlets_offset, primitive.meshlets_count, header.meshlet_count)
+		|| !range_fits(primitive.instances_offset, primitive.instances_count, header.instance_count))
+	{
+		return false;
+	}
+
+	auto index_count = primitive.indices_count;
+	for (uint32_t level = 0; level < primitive.lod_count; ++level)
+	{
+		index_count += primitive.lod_indices_count[level];
+	}
+	if (primitive.indices_count > header.index_bytes || index_count > header.index_bytes / primitive.index_size
+		|| !range_fits(primitive.indices_byte_offset, index_count * primitive.index_size, header.index_bytes))
+	{
+		return false;
+	}
+
+	for (uint64_t i = 0; i < primitive.meshlets_count; ++i)
+	{
+		Meshlet meshlet;
+		memcpy(&meshlet, data + header.meshlets_offset + (primitive.meshlets_offset + i) * sizeof(Meshlet), sizeof(meshlet));
+		if (!range_fits(meshlet.first_index, meshlet.index_count, primitive.indices_count))
+		{
+			return false;
+		}
+	}
+
+	const auto * indices = data + header.indices_offset + primitive.indices_byte_offset;
+	return primitive.index_size == sizeof(uint16_t) ? indices_below<uint16_t>(indices, index_count, primitive.vertices_count)
+													: indices_below<uint32_t>(indices, index_count, primitive.vertices_count);
+}
+
+// Whether the mip chain of every image table entry lies within the file.
+bool images_fit(const Header & header, const unsigned char * data, uint64_t size)
+{
+	for (uint64_t i = 0; i < header.image_count; ++i)
+	{
+		CachedImage image;
+		memcpy(&image, data + header.images_offset + i * sizeof(CachedImage), sizeof(image));
+		if (image.levels == 0)
+		{
+			continue;
+		}
+		if (image.width == 0 || image.height == 0 || image.width > g_max_image_size || image.height > g_max_image_size || image.levels > 32)
+		{
+			return false;
+		}
+
+		auto offset = image.offset;
+		uint64_t width = image.width;
+		uint64_t height = image.height;
+		for (uint32_t level = 0; level < image.levels; ++level)
+		{
+			const auto bytes = width * height * g_bytes_per_pixel;
+			if (!range_fits(offset, bytes, size))
+			{
+				return false;
+			}
+			offset += bytes;
+			width = std::max<uint64_t>(width / 2, 1);
+			height = std::max<uint64_t>(height / 2, 1);
+		}
+	}
+	return true;
+}
+
+template<class T>
+bool write_all(QSaveFile & file, const T * data, size_t count)
+{
+	const auto bytes = static_cast<qint64>(count * sizeof(T));
+	return bytes == 0 || file.write(reinterpret_cast<const char *>(data), bytes) == bytes;
+}
+
+bool write_padding(QSaveFile & file, size_t offset)
+{
+	static const char zeros[g_alignment] = {};
+	const auto padding = static_cast<qint64>(align(offset) - offset);
+	return padding == 0 || file.write(zeros, padding) == padding;
+}
+
+}// namespace
+
+SceneCache::SceneCache(const QString & sourcePath, const RenderOptions & options)
+	: options_(load_options(options))
+{
+	QFile source(sourcePath);
+	if (!source.open(QIODevice::ReadOnly))
+	{
+		return;
+	}
+
+	sourceSize_ = static_cast<uint64_t>(source.size());
+	if (const auto * data = source.map(0, source.size()))
+	{
+		sourceHash_ = hash_bytes(data, sourceSize_);
+	}
+	else
+	{
+		const auto bytes = source.readAll();
+		sourceHash_ = hash_bytes(reinterpret_cast<const unsigned char *>(bytes.constData()), static_cast<size_t>(bytes.size()));
+	}
+
+	const auto directory = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+	if (!directory.isEmpty())
+	{
+		path_ = QString("%1/scenes/%2-%3.scene").arg(directory).arg(static_cast<qulonglong>(sourceHash_), 16, 16, QChar('0')).arg(options_, 2, 16, QChar('0'));
+	}
+}
+
+bool SceneCache::open()
+{
+	if (path_.isEmpty())
+	{
+		return false;
+	}
+
+	auto file = std::make_shared<QFile>(path_);
+	if (!file->open(QIODevice::ReadOnly) || static_cast<size_t>(file->size()) < sizeof(Header))
+	{
+		return false;
+	}
+	const auto size = static_cast<uint64_t>(file->size());
+	const auto * data = file->map(0, file->size());
+	if (!data)
+	{
+		return false;
+	}
+
+	Header header;
+	memcpy(&header, data, sizeof(header));
+	const auto section_fits = [size](uint64_t offset, uint64_t count, uint64_t item_size) {
+		return offset <= size && count <= (size - offset) / item_size;
+	};
+	if (memcmp(header.magic, g_magic, sizeof(g_magic)) != 0 || header.version != g_version || header.vertex_size != sizeof(Vertex)
+		|| header.options != options_ || header.source_hash != sourceHash_ || header.source_size != sourceSize_ || header.file_size != size
+		|| !section_fits(header.vertices_offset, header.vertex_count, sizeof(Vertex))
+		|| !section_fits(header.indices_offset, header.index_bytes, 1)
+		|| !section_fits(header.primitives_offset, header.primitive_count, sizeof(CachedPrimitive))
+		|| !section_fits(header.meshlets_offset, header.meshlet_count, sizeof(Meshlet))
+		|| !section_fits(header.instances_offset, header.instance_count, sizeof(MeshInstance))
+		|| !section_fits(header.images_offset, header.image_count, sizeof(CachedImage)))
+	{
+		fprintf(stderr, "Ignoring stale scene cache: %s\n", qPrintable(path_));
+		return false;
+	}
+
+	const auto * primitives = reinterpret_cast<const CachedPrimitive *>(data + header.primitives_offset);
+	const auto primitives_fit = std::all_of(primitives, primitives + header.primitive_count, [&](const CachedPrimitive & primitive) {
+		return primitive_fits(primitive, header, data);
+	});
+	if (!primitives_fit || !images_fit(header, data, size))
+	{
+		fprintf(stderr, "Ignoring corrupt scene cache: %s\n", qPrintable(path_));
+		return false;
+	}
+
+	mapping_ = file;
+	data_ = data;
+	vertices_ = reinterpret_cast<const Vertex *>(data + header.vertices_offset);
+	vertexCount_ = header.vertex_count;
+	indices_ = data + header.indices_offset;
+	indexBytes_ = header.index_bytes;
+	primitives_ = reinterpret_cast<const CachedPrimitive *>(data + header.primitives_offset);
+	primitiveCount_ = header.primitive_count;
+	meshlets_ = reinterpret_cast<const Meshlet *>(data + header.meshlets_offset);
+	instances_ = reinterpret_cast<const MeshInstance *>(data + header.instances_offset);
+	imagesOffset_ = header.images_offset;
+	imageCount_ = header.image_count;
+	return true;
+}
+
+TextureStreamer::DecodedImage SceneCache::image(const int index) const
+{
+	TextureStreamer::DecodedImage ans;
+	if (index < 0 || static_cast<size_t>(index) >= imageCount_)
+	{
+		return ans;
+	}
+
+	CachedImage image;
+	memcpy(&image, data_ + imagesOffset_ + index * sizeof(CachedImage), sizeof(image));
+	ans.owner = mapping_;
+	auto offset = image.offset;
+	int width = static_cast<int>(image.width);
+	int height = static_cast<int>(image.height);
+	for (uint32_t level = 0; level < image.levels; ++level)
+	{
+		ans.levels.push_back({width, height, data_ + offset});
+		offset += static_cast<uint64_t>(width) * height * g_bytes_per_pixel;
+		width = std::max(width / 2, 1);
+		height = std::max(height / 2, 1);
+	}
+	return ans;
+}
+
+void SceneCache::bake(std::shared_ptr<const SceneData> scene, std::vector<CachedPrimitive> primitives, std::vector<TextureStreamer::EncodedImage> images) const
+{
+	if (path_.isEmpty())
+	{
+		return;
+	}
+
+	QtConcurrent::run([path = path_, options = options_, source_hash = sourceHash_, source_size = sourceSize_, scene = std::move(scene), primitives = std::move(primitives), images = std::move(images)]() mutable {
+		// Only images primitives draw with are decoded, the rest stay empty.
+		std::vector<bool> used(images.size(), false);
+		for (const auto & primitive: primitives)
+		{
+			for (const auto image: {primitive.tex.image, primitive.normals.image})
+			{
+				if (image >= 0 && static_cast<size_t>(image) < used.size())
+				{
+					used[image] = true;
+				}
+			}
+		}
+
+		// Welding and meshlet budgets leave unused slots behind primitives, they are baked without them.
+		std::vector<Vertex> vertices;
+		std::vector<Meshlet> meshlets;
+		for (auto & primitive: primitives)
+		{
+			const auto first = scene->vertices.begin() + static_cast<ptrdiff_t>(primitive.vertices_offset);
+			primitive.vertices_offset = vertices.size();
+			vertices.insert(vertices.end(), first, first + static_cast<ptrdiff_t>(primitive.vertices_count));
+			const auto first_meshlet = scene->meshlets.begin() + static_cast<ptrdiff_t>(primitive.meshlets_offset);
+			primitive.meshlets_offset = meshlets.size();
+			meshlets.insert(meshlets.end(), first_meshlet, first_meshlet + static_cast<ptrdiff_t>(primitive.meshlets_count));
+		}
+
+		Header header{};
+		memcpy(header.magic, g_magic, sizeof(g_magic));
+		header.version = g_version;
+		header.vertex_size = sizeof(Vertex);
+		header.options = options;
+		header.source_hash = source_hash;
+		header.source_size = source_size;
+		header.vertices_offset = align(sizeof(Header));
+		header.vertex_count = vertices.size();
+		header.indices_offset = align(header.vertices_offset + header.vertex_count * sizeof(Vertex));
+		header.index_bytes = scene->indices.size();
+		header.primitives_offset = align(header.indices_offset + header.index_bytes);
+		header.primitive_count = primitives.size();
+		header.meshlets_offset = align(header.primitives_offset + header.primitive_count * sizeof(CachedPrimitive));
+		header.meshlet_count = meshlets.size();
+		header.instances_offset = align(header.meshlets_offset + header.meshlet_count * sizeof(Meshlet));
+		header.instance_count = scene->instances.size();
+		header.images_offset = align(header.instances_offset + header.instance_count * sizeof(MeshInstance));
+		header.image_count = images.size();
+
+		std::vector<CachedImage> table(images.size(), CachedImage{});
+		std::vector<std::vector<unsigned char>> chains(images.size());
+		auto offset = align(header.images_offset + header.image_count * sizeof(CachedImage));
+		for (size_t i = 0; i < images.size(); ++i)
+		{
+			if (!used[i] || !images[i].data)
+			{
+				continue;
+			}
+			const auto decoded = TextureStreamer::decode(images[i]);
+			if (decoded.levels.empty())
+			{
+				continue;
+			}
+			chains[i] = build_mip_chain(decoded.levels[0], table[i].levels);
+			table[i].width = static_cast<uint32_t>(decoded.levels[0].width);
+			table[i].height = static_cast<uint32_t>(decoded.levels[0].height);
+			table[i].offset = offset;
+			offset = align(offset + chains[i].size());
+		}
+		header.file_size = offset;
+
+		QDir().mkpath(QFileInfo(path).absolutePath());
+		QSaveFile file(path);
+		if (!file.open(QIODevice::WriteOnly))
+		{
+			return;
+		}
+		bool ok = write_all(file, &header, 1) && write_padding(file, sizeof(Header))
+			&& write_all(file, vertices.data(), vertices.size()) && write_padding(file, header.vertices_offset + header.vertex_count * sizeof(Vertex))
+			&& write_all(file, scene->indices.data(), scene->indices.size()) && write_padding(file, header.indices_offset + header.index_bytes)
+			&& write_all(file, primitives.data(), primitives.size()) && write_padding(file, header.primitives_offset + header.primitive_count * sizeof(CachedPrimitive))
+			&& write_all(file, meshlets.data(), meshlets.size()) && write_padding(file, header.meshlets_offset + header.meshlet_count * sizeof(Meshlet))
+			&& write_all(file, scene->instances.data(), scene->instances.size()) && write_padding(file, header.instances_offset + header.instance_count * sizeof(MeshInstance))
+			&& write_all(file, table.data(), table.size()) && write_padding(file, header.images_offset + header.image_count * sizeof(CachedImage));
+		for (size_t i = 0; ok && i < chains.size(); ++i)
+		{
+			ok = write_all(file, chains[i].data(), chains[i].size()) && write_padding(file, table[i].offset + chains[i].size());
+		}
+		if (!ok || !file.commit())
+		{
+			fprintf(stderr, "Failed to write scene cache: %s\n", qPrintable(path));
+		}
+	});
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "RenderOptions.h"
+#include "SceneLoader.h"
+#include "TextureStreamer.h"
+
+#include <QString>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Texture of a cached primitive: glTF image index and sampler it is read with.
+struct CachedTexture {
+	int32_t image = -1;
+	int32_t minFilter = 0;
+	int32_t magFilter = 0;
+	int32_t wrapS = 0;
+	int32_t wrapT = 0;
+};
+
+// Draw range of one primitive as Window uploads it.
+struct CachedPrimitive {
+	CachedTexture tex;
+	CachedTexture normals;
+	float bounds_min[3];
+	float bounds_max[3];
+	uint64_t vertices_offset;
+	uint64_t vertices_count;
+	uint64_t indices_byte_offset;
+	uint64_t indices_count;
+	uint32_t index_size;
+	// Simplified levels stored after the full indices, see PrimitiveRange.
+	uint32_t lod_count;
+	uint32_t lod_indices_count[kMaxLods];
+	float lod_error[kMaxLods];
+	uint64_t meshlets_offset;
+	uint64_t meshlets_count;
+	uint64_t instances_offset;
+	uint64_t instances_count;
+};
+
+// On-disk copy of everything Window::onInit derives from a model: the Vertex and index
+// arrays, draw ranges with their texture references, meshlets and instances, and RGBA8 images
+// with full mip chains.
+// Files live in the user cache directory, are named after a hash of the source file and the
+// load options, and carry a format version, so a changed model, other options or an
+// incompatible build simply misses.
+// A hit is read through a memory mapping and goes straight to buffer upload.
+class SceneCache final
+{
+public:
+	// Hashes the source file, which is mapped for the duration of the call. Welding, mesh
+	// optimization, LODs and instancing of options change the baked scene, so they key it too.
+	SceneCache(const QString & sourcePath, const RenderOptions & options);
+
+	// Maps the cache file of the source. Returns false if it is missing, stale or has a range
+	// that points outside of its sections.
+	bool open();
+
+	[[nodiscard]] const Vertex * vertices() const noexcept { return vertices_; }
+	[[nodiscard]] size_t vertexCount() const noexcept { return vertexCount_; }
+	[[nodiscard]] const unsigned char * indices() const noexcept { return indices_; }
+	[[nodiscard]] size_t indexBytes() const noexcept { return indexBytes_; }
+	[[nodiscard]] const CachedPrimitive * primitives() const noexcept { return primitives_; }
+	[[nodiscard]] size_t primitiveCount() const noexcept { return primitiveCount_; }
+	[[nodiscard]] const Meshlet * meshlets() const noexcept { return meshlets_; }
+	[[nodiscard]] const MeshInstance * instances() const noexcept { return instances_; }
+	// Mip chain of the image with given index, pixels point into the mapping and keep it alive.
+	[[nodiscard]] TextureStreamer::DecodedImage image(int index) const;
+
+	// Decodes images, builds their mip chains and writes the cache file on the global thread pool.
+	// Does nothing if the source could not be hashed.
+	void bake(std::shared_ptr<const SceneData> scene, std::vector<CachedPrimitive> primitives, std::vector<TextureStreamer::EncodedImage> images) const;
+
+private:
+	QString path_;
+	uint32_t options_ = 0;
+	uint64_t sourceHash_ = 0;
+	uint64_t sourceSize_ = 0;
+
+	std::shared_ptr<const void> mapping_;
+	const unsigned char * data_ = nullptr;
+	const Vertex * vertices_ = nullptr;
+	size_t vertexCount_ = 0;
+	const unsigned char * indices_ = nullptr;
+	size_t indexBytes_ = 0;
+	const CachedPrimitive * primitives_ = nullptr;
+	size_t primitiveCount_ = 0;
+	const Meshlet * meshlets_ = nullptr;
+	const MeshInstance * instances_ = nullptr;
+	size_t imagesOffset_ = 0;
+	size_t imageCount_ = 0;
+};
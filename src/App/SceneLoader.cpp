@@ -0,0 +1,384 @@
+#include "SceneLoader.h"
+
+#include "ModelFile.h"
+#include "VertexKernel.h"
+
+#include <QQuaternion>
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <tuple>
+
+#include <draco/compression/decode.h>
+#include <tinygltf/tiny_gltf.h>
+
+namespace
+{
+
+const tinygltf::Accessor & attribute_accessor(const tinygltf::Primitive & primitive, const tinygltf::Model & model, const std::string & key)
+{
+	assert(primitive.attributes.contains(key));
+	return model.accessors[primitive.attributes.at(key)];
+}
+
+std::pair<const void *, size_t> read_attribute(const tinygltf::Primitive & primitive, const ModelFile & file, const std::string & key)
+{
+	const auto & model = file.model();
+	const auto & accessor = attribute_accessor(primitive, model, key);
+	assert(!accessor.sparse.isSparse);
+	const auto & bufferView = model.bufferViews[accessor.bufferView];
+	return {static_cast<const void *>(file.buffer(bufferView.buffer) + bufferView.byteOffset + accessor.byteOffset), accessor.count};
+}
+
+QMatrix4x4 node_transform(const tinygltf::Node & node, const QMatrix4x4 & parent_transform)
+{
+	QMatrix4x4 transform;
+	transform.setToIdentity();
+
+	if (node.translation.size() == 3)
+	{
+		transform.translate(node.translation[0], node.translation[1], node.translation[2]);
+	}
+	if (node.rotation.size() == 4)
+	{
+		QQuaternion q(node.rotation[3], node.rotation[0], node.rotation[1], node.rotation[2]);
+		transform.rotate(q);
+	}
+	if (node.scale.size() == 3)
+	{
+		transform.scale(node.scale[0], node.scale[1], node.scale[2]);
+	}
+
+	return parent_transform * transform;
+}
+
+// Copies indices in their stored width, they stay relative to the primitive's first vertex.
+// Byte indices are widened to 16 bits on the way, GL has no fast path for them.
+void read_inds(const tinygltf::Primitive & primitive, const ModelFile & file, size_t index_size, unsigned char * dst)
+{
+	const auto & model = file.model();
+	const auto & accessor_ind = model.accessors[primitive.indices];
+	const auto & bufferView_ind = model.bufferViews[accessor_ind.bufferView];
+
+	const size_t indexCount = accessor_ind.count;
+	const auto * src = file.buffer(bufferView_ind.buffer) + accessor_ind.byteOffset + bufferView_ind.byteOffset;
+	assert(accessor_ind.type == TINYGLTF_TYPE_SCALAR);
+	if (accessor_ind.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE)
+	{
+		assert(index_size == sizeof(GLushort));
+		for (size_t i = 0; i < indexCount; ++i)
+		{
+			const GLushort index = src[i];
+			memcpy(dst + i * sizeof(GLushort), &index, sizeof(index));
+		}
+	}
+	else
+	{
+		assert(accessor_ind.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT || accessor_ind.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT);
+		memcpy(dst, src, indexCount * index_size);
+	}
+}
+
+void read_verts(const tinygltf::Primitive & primitive, const ModelFile & file, const QMatrix4x4 & transform, Vertex * dst)
+{
+	const auto & model = file.model();
+	{
+		[[maybe_unused]] const auto & accessor = attribute_accessor(primitive, model, "POSITION");
+		assert(accessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT);
+		assert(accessor.type == TINYGLTF_TYPE_VEC3);
+	}
+	auto position_data = read_attribute(primitive, file, "POSITION");
+
+	{
+		[[maybe_unused]] const auto & accessor_tex = attribute_accessor(primitive, model, "TEXCOORD_0");
+		assert(accessor_tex.type == TINYGLTF_TYPE_VEC2);
+		assert(accessor_tex.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT);
+	}
+	auto texcoords_data = read_attribute(primitive, file, "TEXCOORD_0");
+
+	{
+		[[maybe_unused]] const auto & accessor_norm = attribute_accessor(primitive, model, "NORMAL");
+		assert(accessor_norm.type == TINYGLTF_TYPE_VEC3);
+		assert(accessor_norm.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT);
+	}
+	auto normals_data = read_attribute(primitive, file, "NORMAL");
+
+	{
+		[[maybe_unused]] const auto & accessor_tan = attribute_accessor(primitive, model, "TANGENT");
+		assert(accessor_tan.type == TINYGLTF_TYPE_VEC4);
+		assert(accessor_tan.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT);
+	}
+	auto tangents_data = read_attribute(primitive, file, "TANGENT");
+
+	assert(texcoords_data.second == position_data.second);
+	assert(texcoords_data.second == normals_data.second);
+	assert(texcoords_data.second == tangents_data.second);
+
+	VertexStreams streams;
+	streams.positions = static_cast<const float *>(position_data.first);
+	streams.normals = static_cast<const float *>(normals_data.first);
+	streams.texcoords = static_cast<const float *>(texcoords_data.first);
+	streams.tangents = static_cast<const float *>(tangents_data.first);
+	streams.count = position_data.second;
+	transform_vertices(transform, streams, dst);
+}
+
+// KHR_draco_mesh_compression object of primitive, nullptr if the primitive is not compressed.
+const tinygltf::Value * draco_extension(const tinygltf::Primitive & primitive)
+{
+	const auto it = primitive.extensions.find("KHR_draco_mesh_compression");
+	return it == primitive.extensions.end() ? nullptr : &it->second;
+}
+
+// Float stream of the decoded attribute mapped to key, nullptr if it is missing.
+// Tightly packed float attributes are read in place, others are converted into scratch.
+const float * draco_stream(const draco::Mesh & mesh, const tinygltf::Value & attributes, const std::string & key, int components, std::vector<float> & scratch)
+{
+	if (!attributes.Has(key))
+	{
+		return nullptr;
+	}
+	const auto * attribute = mesh.GetAttributeByUniqueId(static_cast<uint32_t>(attributes.Get(key).GetNumberAsInt()));
+	if (!attribute || attribute->num_components() < components)
+	{
+		return nullptr;
+	}
+
+	if (attribute->data_type() == draco::DT_FLOAT32 && attribute->is_mapping_identity() && attribute->num_components() == components
+		&& attribute->byte_stride() == static_cast<int64_t>(components * sizeof(float)))
+	{
+		return reinterpret_cast<const float *>(attribute->GetAddress(draco::AttributeValueIndex(0)));
+	}
+
+	scratch.resize(static_cast<size_t>(mesh.num_points()) * components);
+	for (draco::PointIndex i(0); i < mesh.num_points(); ++i)
+	{
+		if (!attribute->ConvertValue<float>(attribute->mapped_index(i), static_cast<int8_t>(components), scratch.data() + static_cast<size_t>(i.value()) * components))
+		{
+			return nullptr;
+		}
+	}
+	return scratch.data();
+}
+
+// Decodes a Draco compressed primitive straight into its part of the scene arrays.
+bool read_draco(const tinygltf::Value & extension, const ModelFile & file, const PrimitiveRange & range, Vertex * vertices, unsigned char * indices)
+{
+	const auto & view = file.model().bufferViews[extension.Get("bufferView").GetNumberAsInt()];
+	draco::DecoderBuffer buffer;
+	buffer.Init(reinterpret_cast<const char *>(file.buffer(view.buffer) + view.byteOffset), view.byteLength);
+
+	draco::Decoder decoder;
+	auto decoded = decoder.DecodeMeshFromBuffer(&buffer);
+	if (!decoded.ok())
+	{
+		fprintf(stderr, "Failed to decode Draco mesh %d/%d: %s\n", range.mesh, range.primitive, decoded.status().error_msg());
+		return false;
+	}
+	const auto mesh = std::move(decoded).value();
+	// Pass 1 sized the arrays from the accessors, which must describe the decoded mesh.
+	if (mesh->num_points() != range.vertices_count || static_cast<size_t>(mesh->num_faces()) * 3 != range.indices_count)
+	{
+		fprintf(stderr, "Draco mesh %d/%d does not match its accessors\n", range.mesh, range.primitive);
+		return false;
+	}
+
+	const auto & attributes = extension.Get("attributes");
+	std::array<std::vector<float>, 4> scratch;
+	VertexStreams streams;
+	streams.positions = draco_stream(*mesh, attributes, "POSITION", 3, scratch[0]);
+	streams.normals = draco_stream(*mesh, attributes, "NORMAL", 3, scratch[1]);
+	streams.texcoords = draco_stream(*mesh, attributes, "TEXCOORD_0", 2, scratch[2]);
+	streams.tangents = draco_stream(*mesh, attributes, "TANGENT", 4, scratch[3]);
+	streams.count = mesh->num_points();
+	if (!streams.positions || !streams.normals || !streams.texcoords || !streams.tangents)
+	{
+		fprintf(stderr, "Draco mesh %d/%d lacks a required attribute\n", range.mesh, range.primitive);
+		return false;
+	}
+	transform_vertices(range.transform, streams, vertices);
+
+	for (draco::FaceIndex f(0); f < mesh->num_faces(); ++f)
+	{
+		const auto & face = mesh->face(f);
+		for (size_t i = 0; i < 3; ++i)
+		{
+			auto * dst = indices + (static_cast<size_t>(f.value()) * 3 + i) * range.index_size;
+			if (range.index_size == sizeof(GLuint))
+			{
+				const GLuint index = face[i].value();
+				memcpy(dst, &index, sizeof(index));
+			}
+			else
+			{
+				const auto index = static_cast<GLushort>(face[i].value());
+				memcpy(dst, &index, sizeof(index));
+			}
+		}
+	}
+	return true;
+}
+
+void compute_bounds(const Vertex * vertices, size_t count, PrimitiveRange & range)
+{
+	if (count == 0)
+	{
+		return;
+	}
+
+	auto lo = vertices[0].pos;
+	auto hi = vertices[0].pos;
+	for (size_t i = 1; i < count; ++i)
+	{
+		const auto & pos = vertices[i].pos;
+		lo = {std::min(lo.x(), pos.x()), std::min(lo.y(), pos.y()), std::min(lo.z(), pos.z())};
+		hi = {std::max(hi.x(), pos.x()), std::max(hi.y(), pos.y()), std::max(hi.z(), pos.z())};
+	}
+	range.bounds_min = lo;
+	range.bounds_max = hi;
+}
+
+// Every range starts at a multiple of its index size, so the offset converts to firstIndex of an indirect draw.
+size_t align_index_offset(size_t offset)
+{
+	return (offset + sizeof(GLuint) - 1) / sizeof(GLuint) * sizeof(GLuint);
+}
+
+// Pass 1: walks the node tree, only reads accessor counts.
+void collect_node(const tinygltf::Model & model, int32_t node_ind, std::vector<PrimitiveRange> & primitives, const QMatrix4x4 & parent_transform = QMatrix4x4(), int parent_texture = -1)
+{
+	const auto & node = model.nodes[node_ind];
+
+	if (node.mesh < 0)
+		return;
+
+	const auto transform = node_transform(node, parent_transform);
+	const auto & mesh = model.meshes[node.mesh];
+	for (size_t i = 0; i < mesh.primitives.size(); ++i)
+	{
+		const auto & primitive = mesh.primitives[i];
+		assert(primitive.mode == TINYGLTF_MODE_TRIANGLES);
+		assert(primitive.indices >= 0);
+
+		const auto & material = model.materials[primitive.material];
+
+		PrimitiveRange range;
+		range.mesh = node.mesh;
+		range.primitive = static_cast<int>(i);
+		range.texture = material.pbrMetallicRoughness.baseColorTexture.index > 0 ? material.pbrMetallicRoughness.baseColorTexture.index : parent_texture;
+		range.normal_texture = material.normalTexture.index;
+		range.double_sided = material.doubleSided;
+		range.transform = transform;
+		range.vertices_count = attribute_accessor(primitive, model, "POSITION").count;
+		const auto & indices = model.accessors[primitive.indices];
+		range.indices_count = indices.count;
+		range.index_size = indices.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT ? sizeof(GLuint) : sizeof(GLushort);
+		primitives.push_back(range);
+	}
+
+	const auto & material = model.materials[mesh.primitives[0].material];
+	for (auto i: node.children)
+	{
+		assert(material.pbrMetallicRoughness.baseColorTexture.index > 0);
+		collect_node(model, i, primitives, transform, material.pbrMetallicRoughness.baseColorTexture.index);
+	}
+}
+
+}// namespace
+
+SceneData plan_scene(const ModelFile & file, const bool reserve_lods, const bool share_meshes)
+{
+	const auto & model = file.model();
+	SceneData scene;
+
+	std::vector<PrimitiveRange> placed;
+	const auto & gltf_scene = model.scenes[model.defaultScene];
+	for (auto node_ind: gltf_scene.nodes)
+	{
+		collect_node(model, node_ind, placed);
+	}
+
+	// Nodes inherit textures from their parents, so a shared primitive is keyed by its texture too.
+	std::map<std::tuple<int, int, int>, size_t> shared;
+	std::vector<std::vector<QMatrix4x4>> transforms;
+	for (auto & range: placed)
+	{
+		if (!share_meshes)
+		{
+			scene.primitives.push_back(range);
+			transforms.push_back({QMatrix4x4()});
+			continue;
+		}
+		const auto [it, inserted] = shared.emplace(std::make_tuple(range.mesh, range.primitive, range.texture), scene.primitives.size());
+		if (inserted)
+		{
+			scene.primitives.push_back(range);
+			scene.primitives.back().transform = QMatrix4x4();
+			transforms.emplace_back();
+		}
+		transforms[it->second].push_back(range.transform);
+	}
+	for (size_t i = 0; i < scene.primitives.size(); ++i)
+	{
+		scene.primitives[i].instances_offset = scene.instances.size();
+		scene.primitives[i].instances_count = transforms[i].size();
+		for (const auto & transform: transforms[i])
+		{
+			MeshInstance instance;
+			transform.copyDataTo(instance.model);
+			scene.instances.push_back(instance);
+		}
+	}
+
+	size_t vertices_count = 0;
+	size_t indices_bytes = 0;
+	size_t meshlets_count = 0;
+	for (auto & range: scene.primitives)
+	{
+		range.vertices_offset = vertices_count;
+		range.meshlets_offset = meshlets_count;
+		meshlets_count += meshlet_budget(range.indices_count);
+		range.indices_byte_offset = align_index_offset(indices_bytes);
+		vertices_count += range.vertices_count;
+		auto indices_count = range.indices_count;
+		if (reserve_lods && range.indices_count >= 3 * kMinLodTriangles)
+		{
+			for (size_t level = 1; level <= kMaxLods; ++level)
+			{
+				indices_count += lod_indices_budget(range.indices_count, level);
+			}
+		}
+		indices_bytes = range.indices_byte_offset + indices_count * range.index_size;
+	}
+
+	scene.vertices.resize(vertices_count);
+	scene.indices.resize(indices_bytes);
+	scene.meshlets.resize(meshlets_count);
+	return scene;
+}
+
+bool load_primitive(const ModelFile & file, SceneData & scene, PrimitiveRange & range)
+{
+	const auto & primitive = file.model().meshes[range.mesh].primitives[range.primitive];
+	auto * vertices = scene.vertices.data() + range.vertices_offset;
+	auto * indices = scene.indices.data() + range.indices_byte_offset;
+	if (const auto * draco = draco_extension(primitive))
+	{
+		if (!read_draco(*draco, file, range, vertices, indices))
+		{
+			fprintf(stderr, "Skipping primitive %d/%d\n", range.mesh, range.primitive);
+			return false;
+		}
+	}
+	else
+	{
+		read_verts(primitive, file, range.transform, vertices);
+		read_inds(primitive, file, range.index_size, indices);
+	}
+	compute_bounds(vertices, range.vertices_count, range);
+	return true;
+}
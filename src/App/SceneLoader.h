@@ -0,0 +1,107 @@
+#pragma once
+
+#include <QMatrix4x4>
+#include <QOpenGLFunctions>
+#include <QVector2D>
+#include <QVector3D>
+
+#include <cstdint>
+#include <vector>
+
+struct Vertex {
+	QVector3D pos;
+	QVector3D normal;
+	QVector2D tex;
+	QVector3D tangent;
+	QVector3D bitangent;
+};
+
+class ModelFile;
+
+// Simplified levels of detail a primitive may have besides the full one.
+constexpr size_t kMaxLods = 3;
+// Primitives with fewer triangles are not simplified.
+constexpr size_t kMinLodTriangles = 256;
+
+// Meshlets are cut from the full index range of a primitive in its vertex cache order.
+constexpr size_t kMeshletMaxVertices = 64;
+constexpr size_t kMeshletMaxTriangles = 124;
+
+// Meshlets reserved for a primitive: only the last one ends before it has vertices for
+// another triangle, so all others have at least kMeshletMaxVertices / 3 triangles.
+constexpr size_t meshlet_budget(size_t indices_count)
+{
+	return indices_count / 3 / (kMeshletMaxVertices / 3) + 1;
+}
+
+// Indices reserved for LOD level (1 to kMaxLods) of a primitive, every level halves the triangles.
+constexpr size_t lod_indices_budget(size_t indices_count, size_t level)
+{
+	return (indices_count / 3 >> level) * 3;
+}
+
+// Contiguous part of a primitive's full index range, with bounds for culling it on its own.
+// Plain floats, so it can be stored in SceneCache as is.
+struct Meshlet {
+	uint32_t first_index;// Relative to the first index of the primitive.
+	uint32_t index_count;
+	float center[3];// Bounding sphere, in the space of the primitive's vertices.
+	float radius;
+	// Every triangle faces away from a viewer at p if dot(center - p, cone_axis) is at least
+	// cone_cutoff * |center - p| + radius. A cutoff of 1 never culls.
+	float cone_axis[3];
+	float cone_cutoff;
+};
+
+// Placement of a primitive in the scene, 16 floats in the row-major order of QMatrix4x4::copyDataTo.
+struct MeshInstance {
+	float model[16];
+};
+
+// One glTF primitive flattened into the shared vertex/index arrays.
+struct PrimitiveRange {
+	int mesh = -1;
+	int primitive = -1;
+	int texture = -1;       // glTF texture index of the base color.
+	int normal_texture = -1;// glTF texture index of the normal map.
+	bool double_sided = false;
+	QMatrix4x4 transform;// Baked into the vertices, identity for shared primitives.
+	QVector3D bounds_min;// Bounds of the vertices as stored, before instance transforms.
+	QVector3D bounds_max;
+	size_t vertices_offset = 0;
+	size_t vertices_count = 0;
+	size_t indices_byte_offset = 0;// Into SceneData::indices, a multiple of index_size.
+	size_t indices_count = 0;
+	size_t index_size = sizeof(GLuint);// 2 or 4 bytes, as stored in the glTF file.
+	// Simplified levels stored right after the full indices, each one after the previous.
+	size_t lod_count = 0;
+	size_t lod_indices_count[kMaxLods] = {};
+	float lod_error[kMaxLods] = {};// Deviation from the full primitive, before instance transforms.
+	size_t meshlets_offset = 0;// Into SceneData::meshlets, meshlet_budget() of them are reserved.
+	size_t meshlets_count = 0;
+	size_t instances_offset = 0;// Into SceneData::instances.
+	size_t instances_count = 0;
+};
+
+struct SceneData {
+	std::vector<Vertex> vertices;
+	// Indices of every primitive in its own width, relative to its first vertex:
+	// primitives are drawn with their vertices_offset as base vertex.
+	std::vector<unsigned char> indices;
+	std::vector<PrimitiveRange> primitives;
+	std::vector<Meshlet> meshlets;
+	std::vector<MeshInstance> instances;
+};
+
+// Pass 1 of flattening the default scene: walks the node tree, prefix-sums vertex, index
+// and meshlet counts of every primitive and allocates the arrays they are written to. With
+// reserve_lods large enough primitives get room for their LOD budgets behind their indices.
+// With share_meshes a glTF primitive placed by several nodes is loaded once, untransformed,
+// with one instance per node; otherwise every node bakes its transform into its own copy.
+SceneData plan_scene(const ModelFile & file, bool reserve_lods, bool share_meshes);
+
+// Pass 2 for one primitive of a planned scene: transforms and writes its vertices and
+// indices, decoding KHR_draco_mesh_compression on the way, and computes its bounds.
+// Every primitive owns a disjoint part of the arrays, so primitives can load in parallel.
+// Returns false if a Draco primitive fails to decode, it must not be drawn then.
+bool load_primitive(const ModelFile & file, SceneData & scene, PrimitiveRange & range);
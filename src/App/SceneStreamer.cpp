@@ -0,0 +1,433 @@
+#include "SceneStreamer.h"
+
+#include "ModelFile.h"
+
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <cstdio>
+
+#include <tinygltf/tiny_gltf.h>
+
+namespace
+{
+
+// glTF filter and wrap values are the GL enums QOpenGLTexture uses.
+CachedTexture cached_texture(const tinygltf::Model & model, const int texture_index)
+{
+	CachedTexture ans;
+	const TextureStreamer::Sampler defaults;
+	ans.minFilter = defaults.minFilter;
+	ans.magFilter = defaults.magFilter;
+	ans.wrapS = defaults.wrapS;
+	ans.wrapT = defaults.wrapT;
+	if (texture_index < 0)
+	{
+		return ans;
+	}
+
+	const auto & texture = model.textures[texture_index];
+	ans.image = texture.source;
+	if (texture.sampler < 0)
+	{
+		return ans;
+	}
+
+	const auto & sampler = model.samplers[texture.sampler];
+	if (sampler.minFilter >= 0)
+	{
+		ans.minFilter = sampler.minFilter;
+	}
+	if (sampler.magFilter >= 0)
+	{
+		ans.magFilter = sampler.magFilter;
+	}
+	ans.wrapS = sampler.wrapS;
+	ans.wrapT = sampler.wrapT;
+	return ans;
+}
+
+TextureStreamer::Sampler texture_sampler(const CachedTexture & texture)
+{
+	TextureStreamer::Sampler ans;
+	ans.minFilter = static_cast<QOpenGLTexture::Filter>(texture.minFilter);
+	ans.magFilter = static_cast<QOpenGLTexture::Filter>(texture.magFilter);
+	ans.wrapS = static_cast<QOpenGLTexture::WrapMode>(texture.wrapS);
+	ans.wrapT = static_cast<QOpenGLTexture::WrapMode>(texture.wrapT);
+	return ans;
+}
+
+// Bounds and LOD levels are filled in once the primitive is loaded.
+CachedPrimitive cached_primitive(const tinygltf::Model & model, const PrimitiveRange & range)
+{
+	CachedPrimitive ans;
+	ans.tex = cached_texture(model, range.texture);
+	ans.normals = cached_texture(model, range.normal_texture);
+	ans.vertices_offset = range.vertices_offset;
+	ans.vertices_count = range.vertices_count;
+	ans.indices_byte_offset = range.indices_byte_offset;
+	ans.indices_count = range.indices_count;
+	ans.index_size = static_cast<uint32_t>(range.index_size);
+	ans.instances_offset = range.instances_offset;
+	ans.instances_count = range.instances_count;
+	ans.meshlets_offset = range.meshlets_offset;
+	ans.meshlets_count = 0;
+	ans.lod_count = 0;
+	for (size_t i = 0; i < kMaxLods; ++i)
+	{
+		ans.lod_indices_count[i] = 0;
+		ans.lod_error[i] = 0.0f;
+	}
+	return ans;
+}
+
+// Copies what is known once the primitive is loaded: its vertex range, bounds, meshlets and LOD levels.
+void set_loaded(CachedPrimitive & primitive, const PrimitiveRange & range)
+{
+	primitive.vertices_offset = range.vertices_offset;
+	primitive.vertices_count = range.vertices_count;
+	for (int i = 0; i < 3; ++i)
+	{
+		primitive.bounds_min[i] = range.bounds_min[i];
+		primitive.bounds_max[i] = range.bounds_max[i];
+	}
+	primitive.meshlets_count = range.meshlets_count;
+	primitive.lod_count = static_cast<uint32_t>(range.lod_count);
+	for (size_t i = 0; i < range.lod_count; ++i)
+	{
+		primitive.lod_indices_count[i] = static_cast<uint32_t>(range.lod_indices_count[i]);
+		primitive.lod_error[i] = range.lod_error[i];
+	}
+}
+
+// Only what packing reads is restored.
+PrimitiveRange primitive_range(const CachedPrimitive & primitive)
+{
+	PrimitiveRange ans;
+	ans.bounds_min = QVector3D(primitive.bounds_min[0], primitive.bounds_min[1], primitive.bounds_min[2]);
+	ans.bounds_max = QVector3D(primitive.bounds_max[0], primitive.bounds_max[1], primitive.bounds_max[2]);
+	ans.vertices_offset = static_cast<size_t>(primitive.vertices_offset);
+	ans.vertices_count = static_cast<size_t>(primitive.vertices_count);
+	ans.indices_byte_offset = static_cast<size_t>(primitive.indices_byte_offset);
+	ans.indices_count = static_cast<size_t>(primitive.indices_count);
+	ans.index_size = primitive.index_size;
+	return ans;
+}
+
+}// namespace
+
+SceneStreamer::SceneStreamer(const size_t frameBudget)
+	: frameBudget_{frameBudget}
+{
+	// One loader at a time, the loader itself fans primitives out to the global pool.
+	pool_.setMaxThreadCount(1);
+}
+
+SceneStreamer::~SceneStreamer()
+{
+	cancel();
+}
+
+void SceneStreamer::start(const QString & path, const RenderOptions & options)
+{
+	path_ = path;
+	options_ = options;
+	QtConcurrent::run(&pool_, [this] { load(); });
+}
+
+void SceneStreamer::cancel()
+{
+	canceled_ = true;
+	pool_.waitForDone();
+}
+
+void SceneStreamer::load()
+{
+	// Without the cache the source is not even hashed.
+	const auto cache = options_.sceneCache ? std::make_shared<SceneCache>(path_, options_) : nullptr;
+	if (cache && cache->open())
+	{
+		loadFromCache(cache);
+	}
+	else
+	{
+		loadFromModel(cache);
+	}
+
+	QMutexLocker lock(&mutex_);
+	planned_ = true;
+	loaded_ = true;
+}
+
+void SceneStreamer::loadFromCache(const std::shared_ptr<SceneCache> & cache)
+{
+	cache_ = cache;
+	cacheHit_ = true;
+	vertices_ = cache->vertices();
+	vertexCount_ = cache->vertexCount();
+	vertexEnd_ = vertexCount_;
+	indices_ = cache->indices();
+	indexBytes_ = cache->indexBytes();
+	primitives_.assign(cache->primitives(), cache->primitives() + cache->primitiveCount());
+	meshlets_ = cache->meshlets();
+	instances_ = cache->instances();
+
+	if (!options_.packedVertices)
+	{
+		QMutexLocker lock(&mutex_);
+		planned_ = true;
+		for (size_t i = 0; i < primitives_.size(); ++i)
+		{
+			ready_.push_back(i);
+		}
+		return;
+	}
+
+	packedVertices_.resize(vertexCount_);
+	{
+		QMutexLocker lock(&mutex_);
+		planned_ = true;
+	}
+	std::vector<size_t> indices(primitives_.size());
+	for (size_t i = 0; i < indices.size(); ++i)
+	{
+		indices[i] = i;
+	}
+	QtConcurrent::blockingMap(indices, [this](const size_t index) {
+		if (canceled_)
+		{
+			return;
+		}
+		pack_primitive(vertices_, primitive_range(primitives_[index]), packedVertices_.data());
+		setReady(index);
+	});
+}
+
+void SceneStreamer::loadFromModel(const std::shared_ptr<SceneCache> & cache)
+{
+	ModelFile file;
+	if (!file.load(path_))
+	{
+		QMutexLocker lock(&mutex_);
+		failed_ = true;
+		return;
+	}
+	const auto & model = file.model();
+
+	scene_ = std::make_shared<SceneData>(plan_scene(file, options_.lod, options_.instancing));
+	vertexCount_ = scene_->vertices.size();
+	// Welded primitives are moved next to each other in the order they finish, so the vertex
+	// buffer can shrink to the welded total. Until then the planned slots are kept around.
+	std::vector<Vertex> welded(options_.weldVertices ? vertexCount_ : 0);
+	vertices_ = options_.weldVertices ? welded.data() : scene_->vertices.data();
+	vertexEnd_ = options_.weldVertices ? 0 : vertexCount_;
+	indices_ = scene_->indices.data();
+	indexBytes_ = scene_->indices.size();
+	meshlets_ = scene_->meshlets.data();
+	instances_ = scene_->instances.data();
+	for (const auto & range: scene_->primitives)
+	{
+		primitives_.push_back(cached_primitive(model, range));
+	}
+	for (size_t i = 0; i < model.images.size(); ++i)
+	{
+		images_.push_back(file.image(static_cast<int>(i)));
+	}
+	if (options_.packedVertices)
+	{
+		packedVertices_.resize(vertexCount_);
+	}
+	{
+		// Buffers can be allocated and textures requested from here on.
+		QMutexLocker lock(&mutex_);
+		planned_ = true;
+	}
+
+	// A primitive that fails to load is never made ready, and the scene is not baked so the
+	// next start tries again.
+	std::atomic<bool> failed{false};
+	QtConcurrent::blockingMap(scene_->primitives, [&](PrimitiveRange & range) {
+		if (canceled_)
+		{
+			return;
+		}
+		if (!load_primitive(file, *scene_, range))
+		{
+			failed = true;
+			return;
+		}
+		const auto index = static_cast<size_t>(&range - scene_->primitives.data());
+		if (options_.weldVertices)
+		{
+			const auto stats = weld_primitive(*scene_, range);
+			QMutexLocker lock(&mutex_);
+			weldStats_ += stats;
+		}
+		if (options_.optimizeMeshes)
+		{
+			const auto stats = optimize_primitive(*scene_, range);
+			QMutexLocker lock(&mutex_);
+			meshStats_ += stats;
+		}
+		build_meshlets(*scene_, range);
+		if (options_.lod)
+		{
+			generate_lods(*scene_, range);
+		}
+		if (options_.weldVertices)
+		{
+			size_t offset = 0;
+			{
+				QMutexLocker lock(&mutex_);
+				offset = vertexEnd_;
+				vertexEnd_ += range.vertices_count;
+			}
+			const auto first = scene_->vertices.begin() + static_cast<ptrdiff_t>(range.vertices_offset);
+			std::copy(first, first + static_cast<ptrdiff_t>(range.vertices_count), welded.begin() + static_cast<ptrdiff_t>(offset));
+			range.vertices_offset = offset;
+		}
+		set_loaded(primitives_[index], range);
+		if (options_.packedVertices)
+		{
+			pack_primitive(vertices_, range, packedVertices_.data());
+		}
+		setReady(index);
+	});
+	if (options_.weldVertices)
+	{
+		// The scene keeps the compacted vertices for baking, vertices_ still points at them.
+		scene_->vertices.swap(welded);
+	}
+
+	if (!canceled_ && options_.weldVertices)
+	{
+		const auto stats = weldStats();
+		fprintf(stderr, "Vertex welding: %zu -> %zu vertices (%.1f%% fewer)\n", stats.before, stats.after, 100.0 * stats.reduction());
+	}
+	if (!canceled_ && options_.optimizeMeshes)
+	{
+		const auto stats = meshStats();
+		fprintf(stderr, "Mesh optimization: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n", stats.before.acmr(), stats.after.acmr(), stats.before.atvr(), stats.after.atvr());
+	}
+	if (!canceled_ && !failed && cache)
+	{
+		cache->bake(scene_, primitives_, images_);
+	}
+}
+
+void SceneStreamer::setReady(const size_t index)
+{
+	QMutexLocker lock(&mutex_);
+	ready_.push_back(index);
+}
+
+std::vector<CachedPrimitive> SceneStreamer::upload(QOpenGLBuffer & vbo, QOpenGLBuffer & ibo)
+{
+	std::vector<CachedPrimitive> ans;
+	{
+		QMutexLocker lock(&mutex_);
+		if (!planned_ || (allocated_ && ready_.empty() && (!loaded_ || vertexEnd_ == allocatedVertices_)))
+		{
+			return ans;
+		}
+	}
+
+	const auto vertex_size = options_.packedVertices ? sizeof(PackedVertex) : sizeof(Vertex);
+	const auto * vertices = options_.packedVertices ? static_cast<const void *>(packedVertices_.data()) : static_cast<const void *>(vertices_);
+	// ibo stays bound afterwards, it is part of the VAO state.
+	vbo.bind();
+	ibo.bind();
+	if (!allocated_)
+	{
+		vbo.allocate(static_cast<int>(vertexCount_ * vertex_size));
+		ibo.allocate(static_cast<int>(indexBytes_));
+		allocatedVertices_ = vertexCount_;
+		allocated_ = true;
+	}
+
+	// Whole primitives only, at least one per call even if it is larger than the budget.
+	size_t used = 0;
+	while (used < frameBudget_)
+	{
+		size_t index = 0;
+		{
+			QMutexLocker lock(&mutex_);
+			if (ready_.empty())
+			{
+				break;
+			}
+			index = ready_.front();
+			ready_.pop_front();
+		}
+
+		const auto & primitive = primitives_[index];
+		const auto vertex_bytes = primitive.vertices_count * vertex_size;
+		auto indices_count = primitive.indices_count;
+		for (size_t i = 0; i < primitive.lod_count; ++i)
+		{
+			indices_count += primitive.lod_indices_count[i];
+		}
+		const auto index_bytes = indices_count * primitive.index_size;
+		vbo.write(static_cast<int>(primitive.vertices_offset * vertex_size), static_cast<const unsigned char *>(vertices) + primitive.vertices_offset * vertex_size, static_cast<int>(vertex_bytes));
+		ibo.write(static_cast<int>(primitive.indices_byte_offset), indices_ + primitive.indices_byte_offset, static_cast<int>(index_bytes));
+		used += vertex_bytes + index_bytes;
+		ans.push_back(primitive);
+	}
+
+	// Welding leaves the planned size unused at the end, once every primitive is in the buffer
+	// is reallocated to the welded total in one write. The buffer name, and so the VAO, stays.
+	bool complete = false;
+	size_t vertex_end = 0;
+	{
+		QMutexLocker lock(&mutex_);
+		complete = loaded_ && ready_.empty();
+		vertex_end = vertexEnd_;
+	}
+	if (complete && vertex_end < allocatedVertices_)
+	{
+		vbo.allocate(vertices, static_cast<int>(vertex_end * vertex_size));
+		allocatedVertices_ = vertex_end;
+	}
+	vbo.release();
+	return ans;
+}
+
+TextureStreamer::Handle SceneStreamer::requestTexture(TextureStreamer & textures, const CachedTexture & texture, const TextureStreamer::Placeholder placeholder) const
+{
+	if (cacheHit_)
+	{
+		return textures.request(texture.image, cache_->image(texture.image), texture_sampler(texture), placeholder);
+	}
+	const auto in_range = texture.image >= 0 && static_cast<size_t>(texture.image) < images_.size();
+	return textures.request(texture.image, in_range ? images_[texture.image] : TextureStreamer::EncodedImage{}, texture_sampler(texture), placeholder);
+}
+
+bool SceneStreamer::pending() const
+{
+	QMutexLocker lock(&mutex_);
+	return !loaded_ || !ready_.empty();
+}
+
+bool SceneStreamer::failed() const
+{
+	QMutexLocker lock(&mutex_);
+	return failed_;
+}
+
+bool SceneStreamer::sceneCacheHit() const
+{
+	QMutexLocker lock(&mutex_);
+	return planned_ && cacheHit_;
+}
+
+WeldStats SceneStreamer::weldStats() const
+{
+	QMutexLocker lock(&mutex_);
+	return weldStats_;
+}
+
+MeshOptimizationStats SceneStreamer::meshStats() const
+{
+	QMutexLocker lock(&mutex_);
+	return meshStats_;
+}
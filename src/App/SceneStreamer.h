@@ -0,0 +1,111 @@
+#pragma once
+
+#include "MeshOptimizer.h"
+#include "RenderOptions.h"
+#include "SceneCache.h"
+#include "SceneLoader.h"
+#include "TextureStreamer.h"
+#include "VertexPacking.h"
+
+#include <QMutex>
+#include <QOpenGLBuffer>
+#include <QString>
+#include <QThreadPool>
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+
+// Loads a scene on a worker thread and streams it into the vertex and index buffers, so
+// the first frame does not wait for the whole model. Once pass 1 of the loader has sized
+// the scene both buffers are allocated at the planned size; upload() then copies the
+// primitives workers have finished, at most frameBudget bytes per call, and returns the
+// ones that became drawable. Welded vertices are compacted, so the vertex buffer shrinks
+// to the welded total once the last primitive is in. A scene cache hit makes every
+// primitive ready at once, a miss bakes the cache after the last primitive is loaded.
+class SceneStreamer final
+{
+public:
+	static constexpr size_t kDefaultFrameBudget = 16 * 1024 * 1024;
+
+	explicit SceneStreamer(size_t frameBudget = kDefaultFrameBudget);
+	~SceneStreamer();
+
+	// Starts loading the model at path. Packed vertices are packed on the workers too.
+	void start(const QString & path, const RenderOptions & options);
+	// Stops loading and waits for the worker.
+	void cancel();
+
+	// Copies ready primitives into vbo and ibo within the frame budget, allocating both on
+	// first use. Requires a current context and the VAO ibo is attached to bound.
+	std::vector<CachedPrimitive> upload(QOpenGLBuffer & vbo, QOpenGLBuffer & ibo);
+	// Requests the image of texture from wherever the scene was loaded from.
+	TextureStreamer::Handle requestTexture(TextureStreamer & textures, const CachedTexture & texture, TextureStreamer::Placeholder placeholder) const;
+
+	// Vertices and indices of the scene as loaded, CachedPrimitive offsets index them. Valid while
+	// the streamer lives, the ones of a primitive are final once upload() returned it.
+	[[nodiscard]] const Vertex * vertices() const noexcept { return vertices_; }
+	[[nodiscard]] const unsigned char * indices() const noexcept { return indices_; }
+	// Meshlets of the scene, CachedPrimitive::meshlets_offset indexes them. Valid while the
+	// streamer lives, meshlets of a primitive are final once upload() returned it.
+	[[nodiscard]] const Meshlet * meshlets() const noexcept { return meshlets_; }
+	// Placements of the primitives, CachedPrimitive::instances_offset indexes them. Valid once
+	// upload() returned anything.
+	[[nodiscard]] const MeshInstance * instances() const noexcept { return instances_; }
+
+	// True until upload() has returned every primitive.
+	[[nodiscard]] bool pending() const;
+	// True once the model could not be opened or parsed, nothing is ever uploaded then.
+	[[nodiscard]] bool failed() const;
+	[[nodiscard]] bool sceneCacheHit() const;
+	// Vertex counts of the primitives welded so far, empty on a scene cache hit.
+	[[nodiscard]] WeldStats weldStats() const;
+	// Cache statistics of the primitives optimized so far, empty on a scene cache hit.
+	[[nodiscard]] MeshOptimizationStats meshStats() const;
+
+private:
+	void load();
+	void loadFromCache(const std::shared_ptr<SceneCache> & cache);
+	// Bakes cache once every primitive is loaded, cache is null with the scene cache disabled.
+	void loadFromModel(const std::shared_ptr<SceneCache> & cache);
+	void setReady(size_t index);
+
+private:
+	size_t frameBudget_;
+	QString path_;
+	RenderOptions options_;
+
+	// Written by the worker before planned_ is set, only primitives_[i] and the vertices,
+	// indices and meshlets of primitive i change afterwards, before i is queued in ready_.
+	std::shared_ptr<SceneCache> cache_;
+	bool cacheHit_ = false;
+	std::shared_ptr<SceneData> scene_;
+	const Vertex * vertices_ = nullptr;
+	// Vertex slots of vertices_, the vertex buffer is allocated with this many at first.
+	size_t vertexCount_ = 0;
+	const unsigned char * indices_ = nullptr;
+	size_t indexBytes_ = 0;
+	const Meshlet * meshlets_ = nullptr;
+	const MeshInstance * instances_ = nullptr;
+	std::vector<PackedVertex> packedVertices_;
+	std::vector<CachedPrimitive> primitives_;
+	std::vector<TextureStreamer::EncodedImage> images_;
+
+	mutable QMutex mutex_;
+	bool planned_ = false;
+	bool loaded_ = false;
+	bool failed_ = false;
+	// End of the vertices primitives were placed at, below vertexCount_ once welded.
+	size_t vertexEnd_ = 0;
+	std::deque<size_t> ready_;
+	WeldStats weldStats_;
+	MeshOptimizationStats meshStats_;
+
+	bool allocated_ = false;
+	size_t allocatedVertices_ = 0;
+	std::atomic<bool> canceled_{false};
+
+	// Declared last so it is destroyed first and the worker never outlives the members it writes to.
+	QThreadPool pool_;
+};
@@ -1,15 +1,34 @@
 #version 330 core
 
+#ifdef PACKED_VERTICES
+// PackedVertex layout, see VertexPacking.h.
+layout(location=0) in vec4 pos_packed;
+layout(location=1) in vec2 normal_packed;
+layout(location=2) in vec2 tex;
+layout(location=3) in vec2 tangent_packed;
+// Quantization box of the primitive, from the instance buffer.
+layout(location=4) in vec3 boundsMin;
+layout(location=5) in vec3 boundsExtent;
+#else
 layout(location=0) in vec3 pos;
 layout(location=1) in vec3 normal;
 layout(location=2) in vec2 tex;
 layout(location=3) in vec3 tangent;
 layout(location=4) in vec3 bitangent;
+#endif
+// Placement of the primitive, from the instance buffer.
+layout(location=6) in mat4 instanceModel;
+// Entry of this instance's vertex 0 in morphCache, minus the base vertex of the primitive.
+layout(location=10) in int morphCacheOffset;
 
 uniform mat4 mvp;
 uniform mat4 model;
 uniform float timeValue;
 uniform float morphSpeed;
+// Morphed position and tangent frame of every vertex of every instance, written by the
+// MORPH_CAPTURE variant of this shader once per frame, three texels per vertex.
+uniform bool morphCached;
+uniform samplerBuffer morphCache;
 
 //out vec3 vert_col;
 out vec3 vert_pos;
@@ -17,22 +36,101 @@ out vec2 vert_tex;
 out vec3 vert_norm;
 out mat3 TBN;
 
+#ifdef MORPH_CAPTURE
+// Captured by transform feedback in the layout morphCache reads.
+out vec4 morphed0;
+out vec4 morphed1;
+out vec4 morphed2;
+#endif
+
+#ifdef PACKED_VERTICES
+vec3 decode_octahedral(vec2 e) {
+	vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	float t = max(-v.z, 0.0);
+	v.x += v.x >= 0.0 ? -t : t;
+	v.y += v.y >= 0.0 ? -t : t;
+	return normalize(v);
+}
+#endif
+
+// The cofactor matrix is the inverse transpose scaled by the determinant, whose sign is undone.
+vec3 instance_normal(vec3 n) {
+	mat3 m = mat3(instanceModel);
+	mat3 cofactor = mat3(cross(m[1], m[2]), cross(m[2], m[0]), cross(m[0], m[1]));
+	return normalize(cofactor * n) * sign(dot(m[0], cofactor[0]));
+}
+
+// morph() moves x by sin(phase) * 0.2.
+float morph_phase(vec3 pos) {
+	return morphSpeed * (timeValue / 500.0 + pos.x * 5.0);
+}
+
 vec3 morph(vec3 pos) {
 	vec3 newpos = pos;
-	newpos.x += sin(morphSpeed * (timeValue / 500.0 + newpos.x * 5)) * 0.2;
+	newpos.x += sin(morph_phase(pos)) * 0.2;
 	return newpos;
 }
 
+// Position and tangent frame of a placed vertex after morph().
+void morph_vertex(vec3 placedpos, vec3 tangent, vec3 bitangent, vec3 normal, out vec3 newpos, out vec3 newtangent, out vec3 newbitangent, out vec3 newnormal) {
+#ifdef FINITE_DIFFERENCE_MORPH
+	newpos = morph(placedpos);
+
+	vec3 posPlusTangent = morph(placedpos + normalize(mat3(instanceModel) * tangent) * 0.01);
+	vec3 posPlusBitangent = morph(placedpos + normalize(mat3(instanceModel) * bitangent) * 0.01);
+	vec3 posPlusnormal = morph(placedpos + instance_normal(normal) * 0.01);
+
+	newtangent = normalize(posPlusTangent - newpos);
+	newbitangent = normalize(posPlusBitangent - newpos);
+	newnormal = normalize(posPlusnormal - newpos);
+#else
+	// Only x depends on x, so the Jacobian of morph() is diag(dx, 1, 1). Tangents are
+	// multiplied by it, normals by its cofactor matrix diag(1, dx, dx).
+	float phase = morph_phase(placedpos);
+	newpos = vec3(placedpos.x + sin(phase) * 0.2, placedpos.yz);
+	float dx = 1.0 + morphSpeed * cos(phase);
+
+	newtangent = normalize(vec3(dx, 1.0, 1.0) * (mat3(instanceModel) * tangent));
+	newbitangent = normalize(vec3(dx, 1.0, 1.0) * (mat3(instanceModel) * bitangent));
+	newnormal = normalize(vec3(1.0, dx, dx) * instance_normal(normal));
+#endif
+}
+
 void main() {
-	vec3 newpos = morph(pos);
-	
-	vec3 posPlusTangent = morph(pos + tangent * 0.01);
-  vec3 posPlusBitangent = morph(pos + bitangent * 0.01);
-  vec3 posPlusnormal = morph(pos + normal * 0.01);
+#ifdef PACKED_VERTICES
+	vec3 pos = boundsMin + pos_packed.xyz * boundsExtent;
+	vec3 normal = decode_octahedral(normal_packed);
+	vec3 tangent = decode_octahedral(tangent_packed);
+	vec3 bitangent = cross(normal, tangent) * (pos_packed.w > 0.5 ? 1.0 : -1.0);
 
-	vec3 newtangent = normalize(posPlusTangent - newpos);
-  vec3 newbitangent = normalize(posPlusBitangent - newpos);
-	vec3 newnormal = normalize(posPlusnormal - newpos);
+#endif
+	// Morphing works on placed positions, as it did when node transforms were baked into the vertices.
+	vec3 placedpos = vec3(instanceModel * vec4(pos, 1.0));
+	vec3 newpos;
+	vec3 newtangent;
+	vec3 newbitangent;
+	vec3 newnormal;
+#ifdef MORPH_CAPTURE
+	morph_vertex(placedpos, tangent, bitangent, normal, newpos, newtangent, newbitangent, newnormal);
+	morphed0 = vec4(newpos, newtangent.x);
+	morphed1 = vec4(newtangent.yz, newbitangent.xy);
+	morphed2 = vec4(newbitangent.z, newnormal);
+	gl_Position = vec4(0.0);
+	return;
+#else
+	if (morphCached) {
+		int texel = (morphCacheOffset + gl_VertexID) * 3;
+		vec4 morphed0 = texelFetch(morphCache, texel);
+		vec4 morphed1 = texelFetch(morphCache, texel + 1);
+		vec4 morphed2 = texelFetch(morphCache, texel + 2);
+		newpos = morphed0.xyz;
+		newtangent = vec3(morphed0.w, morphed1.xy);
+		newbitangent = vec3(morphed1.zw, morphed2.x);
+		newnormal = morphed2.yzw;
+	} else {
+		morph_vertex(placedpos, tangent, bitangent, normal, newpos, newtangent, newbitangent, newnormal);
+	}
+#endif
 
 	vert_pos = vec3(model * vec4(newpos, 1.0));
 	vert_tex = tex;
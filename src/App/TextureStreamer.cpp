@@ -0,0 +1,285 @@
+#include "TextureStreamer.h"
+
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include <tinygltf/stb_image.h>
+
+namespace
+{
+
+constexpr size_t g_bytes_per_pixel = 4;
+
+std::unique_ptr<QOpenGLTexture> create_texture(int width, int height, const TextureStreamer::Sampler & sampler = {}, int mip_levels = 1)
+{
+	auto ans = std::make_unique<QOpenGLTexture>(QOpenGLTexture::Target2D);
+	ans->setMinMagFilters(sampler.minFilter, sampler.magFilter);
+	ans->setWrapMode(QOpenGLTexture::DirectionS, sampler.wrapS);
+	ans->setWrapMode(QOpenGLTexture::DirectionT, sampler.wrapT);
+	ans->create();
+	ans->setSize(width, height);
+	if (mip_levels > 1)
+	{
+		ans->setMipLevels(mip_levels);
+	}
+	else if (sampler.minFilter != QOpenGLTexture::Nearest && sampler.minFilter != QOpenGLTexture::Linear)
+	{
+		ans->setMipLevels(ans->maximumMipLevels());
+	}
+	ans->setFormat(QOpenGLTexture::TextureFormat::RGBA8_UNorm);
+	ans->allocateStorage(QOpenGLTexture::RGBA, QOpenGLTexture::UInt8);
+	return ans;
+}
+
+std::unique_ptr<QOpenGLTexture> create_placeholder(const std::array<unsigned char, g_bytes_per_pixel> & color)
+{
+	auto ans = create_texture(1, 1);
+	ans->setData(QOpenGLTexture::RGBA, QOpenGLTexture::UInt8, color.data());
+	return ans;
+}
+
+// A pending glTexSubImage2D call sourcing rows from the mapped pixel buffer.
+struct Chunk {
+	QOpenGLTexture * texture;
+	int level;
+	int width;
+	int row;
+	int rows;
+	size_t offset;
+};
+
+}// namespace
+
+TextureStreamer::TextureStreamer(const size_t frameBudget)
+	: frameBudget_{frameBudget}
+{
+}
+
+void TextureStreamer::init()
+{
+	placeholders_[static_cast<size_t>(Placeholder::Color)] = create_placeholder({255, 255, 255, 255});
+	placeholders_[static_cast<size_t>(Placeholder::Normal)] = create_placeholder({128, 128, 255, 255});
+
+	for (auto & buffer: pixelBuffers_)
+	{
+		buffer = QOpenGLBuffer(QOpenGLBuffer::PixelUnpackBuffer);
+		buffer.setUsagePattern(QOpenGLBuffer::StreamDraw);
+		buffer.create();
+	}
+}
+
+void TextureStreamer::release()
+{
+	pool_.clear();
+	pool_.waitForDone();
+
+	{
+		QMutexLocker lock(&mutex_);
+		decoded_.clear();
+	}
+	current_ = {};
+	currentLevel_ = 0;
+	currentRow_ = 0;
+
+	for (auto & entry: entries_)
+	{
+		entry.texture.reset();
+	}
+	cache_.clear();
+	for (auto & placeholder: placeholders_)
+	{
+		placeholder.reset();
+	}
+	for (auto & buffer: pixelBuffers_)
+	{
+		buffer.destroy();
+	}
+}
+
+std::pair<TextureStreamer::Handle, bool> TextureStreamer::entry(const int index, const Sampler & sampler, const Placeholder placeholder)
+{
+	++requests_;
+	const auto [cached, inserted] = cache_.emplace(CacheKey{index, sampler, placeholder}, entries_.size());
+	if (inserted)
+	{
+		Entry entry;
+		entry.sampler = sampler;
+		entry.placeholder = placeholder;
+		entries_.push_back(std::move(entry));
+	}
+	return {cached->second, inserted};
+}
+
+TextureStreamer::Handle TextureStreamer::request(const int index, const EncodedImage & encoded, const Sampler & sampler, const Placeholder placeholder)
+{
+	const auto [handle, inserted] = entry(index, sampler, placeholder);
+	if (!inserted || !encoded.data)
+	{
+		// Missing images keep showing the placeholder.
+		return handle;
+	}
+
+	{
+		QMutexLocker lock(&mutex_);
+		++decoding_;
+	}
+
+	QtConcurrent::run(&pool_, [this, handle = handle, encoded] {
+		Decoded decoded;
+		decoded.handle = handle;
+		decoded.image = decode(encoded);
+
+		QMutexLocker lock(&mutex_);
+		--decoding_;
+		if (!decoded.image.levels.empty())
+		{
+			decoded_.push_back(std::move(decoded));
+		}
+	});
+
+	return handle;
+}
+
+TextureStreamer::Handle TextureStreamer::request(const int index, DecodedImage decoded, const Sampler & sampler, const Placeholder placeholder)
+{
+	const auto [handle, inserted] = entry(index, sampler, placeholder);
+	if (inserted && !decoded.levels.empty())
+	{
+		QMutexLocker lock(&mutex_);
+		decoded_.push_back({handle, std::move(decoded)});
+	}
+	return handle;
+}
+
+TextureStreamer::DecodedImage TextureStreamer::decode(const EncodedImage & encoded)
+{
+	DecodedImage ans;
+	MipLevel level;
+	int components = 0;
+	auto * pixels = stbi_load_from_memory(encoded.data, static_cast<int>(encoded.size), &level.width, &level.height, &components, STBI_rgb_alpha);
+	if (!pixels)
+	{
+		fprintf(stderr, "Failed to decode image: %s\n", stbi_failure_reason());
+		return ans;
+	}
+	level.pixels = pixels;
+	ans.owner = std::shared_ptr<const unsigned char>(pixels, [](const unsigned char * p) { stbi_image_free(const_cast<unsigned char *>(p)); });
+	ans.levels.push_back(level);
+	return ans;
+}
+
+bool TextureStreamer::takeDecoded()
+{
+	QMutexLocker lock(&mutex_);
+	if (decoded_.empty())
+	{
+		return false;
+	}
+	current_ = std::move(decoded_.front());
+	decoded_.pop_front();
+	currentLevel_ = 0;
+	currentRow_ = 0;
+	return true;
+}
+
+void TextureStreamer::upload()
+{
+	if (current_.image.levels.empty() && !takeDecoded())
+	{
+		return;
+	}
+
+	auto & gl = *QOpenGLContext::currentContext()->functions();
+	auto & buffer = pixelBuffers_[nextPixelBuffer_];
+	nextPixelBuffer_ = (nextPixelBuffer_ + 1) % kPixelBuffers;
+
+	// A single row always fits, even if it is wider than the budget.
+	const auto buffer_size = std::max(frameBudget_, static_cast<size_t>(current_.image.levels[currentLevel_].width) * g_bytes_per_pixel);
+	buffer.bind();
+	buffer.allocate(static_cast<int>(buffer_size));
+	auto * staging = static_cast<unsigned char *>(buffer.mapRange(0, static_cast<int>(buffer_size), QOpenGLBuffer::RangeWrite | QOpenGLBuffer::RangeInvalidateBuffer));
+	if (!staging)
+	{
+		buffer.release();
+		return;
+	}
+
+	// Copy whole rows into the buffer until the budget runs out.
+	std::vector<Chunk> chunks;
+	std::vector<std::pair<Handle, bool>> completed;// handle, needs mipmaps
+	size_t used = 0;
+	while (!current_.image.levels.empty() || takeDecoded())
+	{
+		auto & entry = entries_[current_.handle];
+		const auto & levels = current_.image.levels;
+		const auto & level = levels[currentLevel_];
+		const auto row_bytes = static_cast<size_t>(level.width) * g_bytes_per_pixel;
+		const auto rows = std::min(static_cast<size_t>(level.height - currentRow_), (buffer_size - used) / row_bytes);
+		if (rows == 0)
+		{
+			break;
+		}
+
+		if (!entry.texture)
+		{
+			entry.texture = create_texture(level.width, level.height, entry.sampler, static_cast<int>(levels.size()));
+		}
+
+		memcpy(staging + used, level.pixels + currentRow_ * row_bytes, rows * row_bytes);
+		chunks.push_back({entry.texture.get(), static_cast<int>(currentLevel_), level.width, currentRow_, static_cast<int>(rows), used});
+		used += rows * row_bytes;
+		currentRow_ += static_cast<int>(rows);
+
+		if (currentRow_ < level.height)
+		{
+			continue;
+		}
+		currentRow_ = 0;
+		if (++currentLevel_ == levels.size())
+		{
+			completed.push_back({current_.handle, levels.size() == 1});
+			current_ = {};
+			currentLevel_ = 0;
+		}
+	}
+	buffer.unmap();
+
+	for (const auto & chunk: chunks)
+	{
+		chunk.texture->bind();
+		gl.glTexSubImage2D(GL_TEXTURE_2D, chunk.level, 0, chunk.row, chunk.width, chunk.rows, GL_RGBA, GL_UNSIGNED_BYTE, reinterpret_cast<const void *>(chunk.offset));
+		chunk.texture->release();
+	}
+	buffer.release();
+
+	for (const auto & [handle, generate_mipmaps]: completed)
+	{
+		auto & entry = entries_[handle];
+		if (generate_mipmaps)
+		{
+			entry.texture->generateMipMaps();
+		}
+		entry.resident = true;
+	}
+}
+
+QOpenGLTexture * TextureStreamer::texture(const Handle handle) const
+{
+	const auto & entry = entries_[handle];
+	if (entry.resident)
+	{
+		return entry.texture.get();
+	}
+	return placeholders_[static_cast<size_t>(entry.placeholder)].get();
+}
+
+bool TextureStreamer::pending() const
+{
+	QMutexLocker lock(&mutex_);
+	return decoding_ > 0 || !decoded_.empty() || !current_.image.levels.empty();
+}
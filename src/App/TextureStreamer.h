@@ -0,0 +1,132 @@
+#pragma once
+
+#include <QMutex>
+#include <QOpenGLBuffer>
+#include <QOpenGLTexture>
+#include <QThreadPool>
+
+#include <array>
+#include <deque>
+#include <map>
+#include <memory>
+#include <tuple>
+#include <vector>
+
+// Decodes glTF images on worker threads and streams their pixels into textures through
+// a ring of pixel unpack buffers, at most frameBudget bytes per upload() call.
+// Already decoded images, e.g. mip chains from SceneCache, skip the workers.
+// Until the last row of an image is uploaded its handle reads as a placeholder texture.
+// Requests are deduplicated by image index and sampler state, so every image is decoded
+// and uploaded once per sampler and handles are shared between primitives.
+class TextureStreamer final
+{
+public:
+	// Compressed image bytes, owner keeps them alive until decoding is done.
+	struct EncodedImage {
+		std::shared_ptr<const void> owner;
+		const unsigned char * data = nullptr;
+		size_t size = 0;
+	};
+
+	// Tightly packed RGBA8 pixels of one mip level.
+	struct MipLevel {
+		int width = 0;
+		int height = 0;
+		const unsigned char * pixels = nullptr;
+	};
+
+	// Level 0 first. With a single level mipmaps are generated on the GPU after upload.
+	struct DecodedImage {
+		std::shared_ptr<const void> owner;
+		std::vector<MipLevel> levels;
+	};
+
+	using Handle = size_t;
+
+	enum class Placeholder {
+		Color, // Opaque white.
+		Normal,// Flat tangent-space normal.
+	};
+
+	struct Sampler {
+		QOpenGLTexture::Filter minFilter = QOpenGLTexture::Linear;
+		QOpenGLTexture::Filter magFilter = QOpenGLTexture::Linear;
+		QOpenGLTexture::WrapMode wrapS = QOpenGLTexture::Repeat;
+		QOpenGLTexture::WrapMode wrapT = QOpenGLTexture::Repeat;
+
+		bool operator<(const Sampler & other) const
+		{
+			return std::tie(minFilter, magFilter, wrapS, wrapT) < std::tie(other.minFilter, other.magFilter, other.wrapS, other.wrapT);
+		}
+	};
+
+	static constexpr size_t kPixelBuffers = 3;
+	static constexpr size_t kDefaultFrameBudget = 16 * 1024 * 1024;
+
+	explicit TextureStreamer(size_t frameBudget = kDefaultFrameBudget);
+
+	// Creates placeholders and pixel buffers. Requires a current context.
+	void init();
+	// Stops decoding and frees GL objects. Requires the context of init() to be current.
+	void release();
+
+	// Returns the handle of image index with sampler, queueing encoded for decoding on the
+	// worker pool the first time the pair is requested.
+	Handle request(int index, const EncodedImage & encoded, const Sampler & sampler, Placeholder placeholder);
+	// Same for an image that is already decoded, it is queued for upload right away.
+	Handle request(int index, DecodedImage decoded, const Sampler & sampler, Placeholder placeholder);
+
+	// Decodes encoded to RGBA8 on the calling thread, returns no levels on failure.
+	static DecodedImage decode(const EncodedImage & encoded);
+
+	// Uploads decoded pixels within the frame budget. Requires a current context.
+	void upload();
+
+	[[nodiscard]] QOpenGLTexture * texture(Handle handle) const;
+	[[nodiscard]] bool pending() const;
+	[[nodiscard]] size_t requestCount() const noexcept { return requests_; }
+	[[nodiscard]] size_t textureCount() const noexcept { return entries_.size(); }
+
+private:
+	struct Decoded {
+		Handle handle = 0;
+		DecodedImage image;
+	};
+
+	struct Entry {
+		std::unique_ptr<QOpenGLTexture> texture;
+		Sampler sampler;
+		Placeholder placeholder = Placeholder::Color;
+		bool resident = false;
+	};
+
+	using CacheKey = std::tuple<int, Sampler, Placeholder>;
+
+	// Returns the entry of the key and true if it was just created.
+	std::pair<Handle, bool> entry(int index, const Sampler & sampler, Placeholder placeholder);
+	bool takeDecoded();
+
+private:
+	size_t frameBudget_;
+
+	std::vector<Entry> entries_;
+	std::map<CacheKey, Handle> cache_;
+	size_t requests_ = 0;
+	std::array<std::unique_ptr<QOpenGLTexture>, 2> placeholders_;
+
+	// Buffers are orphaned on every use, so a frame never waits for the upload of a previous one.
+	std::array<QOpenGLBuffer, kPixelBuffers> pixelBuffers_;
+	size_t nextPixelBuffer_ = 0;
+
+	// Image being uploaded and the first level and row that are not uploaded yet.
+	Decoded current_;
+	size_t currentLevel_ = 0;
+	int currentRow_ = 0;
+
+	mutable QMutex mutex_;
+	std::deque<Decoded> decoded_;
+	size_t decoding_ = 0;
+
+	// Declared last so it is destroyed first and no worker outlives the members it writes to.
+	QThreadPool pool_;
+};
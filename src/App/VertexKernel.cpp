@@ -0,0 +1,235 @@
+#include "VertexKernel.h"
+
+#include <QVector4D>
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VERTEX_KERNEL_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VERTEX_KERNEL_SSE2 1
+#endif
+
+namespace
+{
+
+static_assert(sizeof(Vertex) == 14 * sizeof(float), "Vertex is expected to be tightly packed floats");
+
+// Float offsets of the attributes inside Vertex.
+constexpr size_t g_pos = 0;
+constexpr size_t g_normal = 3;
+constexpr size_t g_tex = 6;
+constexpr size_t g_tangent = 8;
+constexpr size_t g_bitangent = 11;
+constexpr size_t g_stride = 14;
+
+struct ScalarLanes {
+	using reg = float;
+	static constexpr size_t width = 1;
+	static reg gather(const float * p, size_t) { return *p; }
+	static void scatter(float * p, size_t, reg v) { *p = v; }
+	static reg set1(float v) { return v; }
+	static reg add(reg a, reg b) { return a + b; }
+	static reg sub(reg a, reg b) { return a - b; }
+	static reg mul(reg a, reg b) { return a * b; }
+	static reg div(reg a, reg b) { return a / b; }
+	static reg max(reg a, reg b) { return std::max(a, b); }
+	static reg sqrt(reg a) { return std::sqrt(a); }
+};
+
+#if defined(VERTEX_KERNEL_AVX2) || defined(VERTEX_KERNEL_SSE2)
+struct SseLanes {
+	using reg = __m128;
+	static constexpr size_t width = 4;
+	static reg gather(const float * p, size_t s) { return _mm_set_ps(p[3 * s], p[2 * s], p[s], p[0]); }
+	static void scatter(float * p, size_t s, reg v)
+	{
+		_mm_store_ss(p, v);
+		_mm_store_ss(p + s, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1)));
+		_mm_store_ss(p + 2 * s, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2)));
+		_mm_store_ss(p + 3 * s, _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3)));
+	}
+	static reg set1(float v) { return _mm_set1_ps(v); }
+	static reg add(reg a, reg b) { return _mm_add_ps(a, b); }
+	static reg sub(reg a, reg b) { return _mm_sub_ps(a, b); }
+	static reg mul(reg a, reg b) { return _mm_mul_ps(a, b); }
+	static reg div(reg a, reg b) { return _mm_div_ps(a, b); }
+	static reg max(reg a, reg b) { return _mm_max_ps(a, b); }
+	static reg sqrt(reg a) { return _mm_sqrt_ps(a); }
+};
+#endif
+
+#if defined(VERTEX_KERNEL_AVX2)
+struct AvxLanes {
+	using reg = __m256;
+	static constexpr size_t width = 8;
+	static reg gather(const float * p, size_t s)
+	{
+		return _mm256_set_ps(p[7 * s], p[6 * s], p[5 * s], p[4 * s], p[3 * s], p[2 * s], p[s], p[0]);
+	}
+	static void scatter(float * p, size_t s, reg v)
+	{
+		SseLanes::scatter(p, s, _mm256_castps256_ps128(v));
+		SseLanes::scatter(p + 4 * s, s, _mm256_extractf128_ps(v, 1));
+	}
+	static reg set1(float v) { return _mm256_set1_ps(v); }
+	static reg add(reg a, reg b) { return _mm256_add_ps(a, b); }
+	static reg sub(reg a, reg b) { return _mm256_sub_ps(a, b); }
+	static reg mul(reg a, reg b) { return _mm256_mul_ps(a, b); }
+	static reg div(reg a, reg b) { return _mm256_div_ps(a, b); }
+	static reg max(reg a, reg b) { return _mm256_max_ps(a, b); }
+	static reg sqrt(reg a) { return _mm256_sqrt_ps(a); }
+};
+using WideLanes = AvxLanes;
+#elif defined(VERTEX_KERNEL_SSE2)
+using WideLanes = SseLanes;
+#else
+using WideLanes = ScalarLanes;
+#endif
+
+// Row-major affine part of the transform, its normal matrix and its linear part.
+struct KernelMatrices {
+	float m[3][4];
+	float n[3][3];
+	float l[3][3];
+};
+
+KernelMatrices prepare_matrices(const QMatrix4x4 & transform)
+{
+	KernelMatrices result{};
+	const auto normal = transform.normalMatrix();
+	for (int r = 0; r < 3; ++r)
+	{
+		for (int c = 0; c < 4; ++c)
+		{
+			result.m[r][c] = transform(r, c);
+		}
+		for (int c = 0; c < 3; ++c)
+		{
+			result.n[r][c] = normal(r, c);
+			result.l[r][c] = transform(r, c);
+		}
+	}
+	return result;
+}
+
+template<class L>
+struct Vec3 {
+	typename L::reg x, y, z;
+};
+
+template<class L>
+Vec3<L> mul3x3(const float (&m)[3][3], const Vec3<L> & v)
+{
+	Vec3<L> result;
+	typename L::reg * out[3] = {&result.x, &result.y, &result.z};
+	for (int r = 0; r < 3; ++r)
+	{
+		*out[r] = L::add(L::add(L::mul(L::set1(m[r][0]), v.x), L::mul(L::set1(m[r][1]), v.y)), L::mul(L::set1(m[r][2]), v.z));
+	}
+	return result;
+}
+
+template<class L>
+Vec3<L> normalize(const Vec3<L> & v)
+{
+	// Clamping keeps zero vectors at zero instead of producing NaNs.
+	const auto length_sq = L::add(L::add(L::mul(v.x, v.x), L::mul(v.y, v.y)), L::mul(v.z, v.z));
+	const auto inv_length = L::div(L::set1(1.0f), L::sqrt(L::max(length_sq, L::set1(1e-30f))));
+	return {L::mul(v.x, inv_length), L::mul(v.y, inv_length), L::mul(v.z, inv_length)};
+}
+
+// Transforms L::width vertices starting at first. Every lane is loaded one float at a time
+// from the vec3/vec4 arrays of the glTF accessors, there is no hardware gather, and results
+// are stored one float at a time into the Vertex records.
+template<class L>
+void transform_batch(const KernelMatrices & m, const VertexStreams & src, const size_t first, float * dst)
+{
+	const auto * positions = src.positions + first * 3;
+	const auto * normals = src.normals + first * 3;
+	const auto * tangents = src.tangents + first * 4;
+
+	const Vec3<L> p{L::gather(positions, 3), L::gather(positions + 1, 3), L::gather(positions + 2, 3)};
+	Vec3<L> pos;
+	typename L::reg * pos_out[3] = {&pos.x, &pos.y, &pos.z};
+	for (int r = 0; r < 3; ++r)
+	{
+		const auto xy = L::add(L::mul(L::set1(m.m[r][0]), p.x), L::mul(L::set1(m.m[r][1]), p.y));
+		*pos_out[r] = L::add(xy, L::add(L::mul(L::set1(m.m[r][2]), p.z), L::set1(m.m[r][3])));
+	}
+
+	const auto normal = normalize<L>(mul3x3<L>(m.n, {L::gather(normals, 3), L::gather(normals + 1, 3), L::gather(normals + 2, 3)}));
+	const auto tangent = normalize<L>(mul3x3<L>(m.l, {L::gather(tangents, 4), L::gather(tangents + 1, 4), L::gather(tangents + 2, 4)}));
+	const auto sign = L::gather(tangents + 3, 4);
+	const Vec3<L> bitangent{
+		L::mul(L::sub(L::mul(normal.y, tangent.z), L::mul(normal.z, tangent.y)), sign),
+		L::mul(L::sub(L::mul(normal.z, tangent.x), L::mul(normal.x, tangent.z)), sign),
+		L::mul(L::sub(L::mul(normal.x, tangent.y), L::mul(normal.y, tangent.x)), sign),
+	};
+
+	auto * out = dst + first * g_stride;
+	const Vec3<L> * attributes[4] = {&pos, &normal, &tangent, &bitangent};
+	constexpr size_t offsets[4] = {g_pos, g_normal, g_tangent, g_bitangent};
+	for (size_t attribute = 0; attribute < 4; ++attribute)
+	{
+		L::scatter(out + offsets[attribute] + 0, g_stride, attributes[attribute]->x);
+		L::scatter(out + offsets[attribute] + 1, g_stride, attributes[attribute]->y);
+		L::scatter(out + offsets[attribute] + 2, g_stride, attributes[attribute]->z);
+	}
+
+	const auto * texcoords = src.texcoords + first * 2;
+	for (size_t lane = 0; lane < L::width; ++lane)
+	{
+		out[lane * g_stride + g_tex + 0] = texcoords[lane * 2 + 0];
+		out[lane * g_stride + g_tex + 1] = texcoords[lane * 2 + 1];
+	}
+}
+
+}// namespace
+
+void transform_vertices(const QMatrix4x4 & transform, const VertexStreams & src, Vertex * dst)
+{
+	const auto matrices = prepare_matrices(transform);
+	auto * out = reinterpret_cast<float *>(dst);
+
+	size_t i = 0;
+	for (; i + WideLanes::width <= src.count; i += WideLanes::width)
+	{
+		transform_batch<WideLanes>(matrices, src, i, out);
+	}
+	for (; i < src.count; ++i)
+	{
+		transform_batch<ScalarLanes>(matrices, src, i, out);
+	}
+}
+
+void transform_vertices_reference(const QMatrix4x4 & transform, const VertexStreams & src, Vertex * dst)
+{
+	const auto positions = reinterpret_cast<const QVector3D *>(src.positions);
+	const auto normals = reinterpret_cast<const QVector3D *>(src.normals);
+	const auto tex_coords = reinterpret_cast<const QVector2D *>(src.texcoords);
+	const auto tangents = reinterpret_cast<const QVector4D *>(src.tangents);
+
+	for (size_t i = 0; i < src.count; i++)
+	{
+		QVector4D p(positions[i], 1.0f);
+		p = transform * p;
+
+		QVector3D bitangent = QVector3D::crossProduct(normals[i], tangents[i].toVector3D()) * tangents[i].w();
+		dst[i] = {p.toVector3D(), normals[i], tex_coords[i], tangents[i].toVector3D(), bitangent};
+	}
+}
+
+const char * vertex_kernel_isa()
+{
+#if defined(VERTEX_KERNEL_AVX2)
+	return "avx2";
+#elif defined(VERTEX_KERNEL_SSE2)
+	return "sse2";
+#else
+	return "scalar";
+#endif
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "SceneLoader.h"
+
+#include <QMatrix4x4>
+
+// Attribute streams of one glTF primitive, tightly packed floats.
+struct VertexStreams {
+	const float * positions = nullptr;// vec3
+	const float * normals = nullptr;  // vec3
+	const float * texcoords = nullptr;// vec2
+	const float * tangents = nullptr; // vec4, w is the bitangent sign
+	size_t count = 0;
+};
+
+// Transforms positions by transform, normals by its normal matrix and tangents by its linear part,
+// derives bitangents and writes finished vertices straight into dst.
+// Processes 8 (AVX2) or 4 (SSE2) vertices per step, scalar code handles the tail and other targets.
+void transform_vertices(const QMatrix4x4 & transform, const VertexStreams & src, Vertex * dst);
+
+// The per-vertex QMatrix4x4 loop read_verts ran before transform_vertices, kept as a baseline
+// for benchmarks. It only transforms positions: normals and tangents are copied as they are.
+void transform_vertices_reference(const QMatrix4x4 & transform, const VertexStreams & src, Vertex * dst);
+
+// Instruction set transform_vertices was built for: "avx2", "sse2" or "scalar".
+const char * vertex_kernel_isa();
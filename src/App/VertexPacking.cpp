@@ -0,0 +1,73 @@
+#include "VertexPacking.h"
+
+#include <algorithm>
+#include <cmath>
+
+static_assert(sizeof(PackedVertex) == 20, "PackedVertex is expected to be tightly packed");
+
+namespace
+{
+
+int16_t to_snorm16(float value)
+{
+	return static_cast<int16_t>(std::lround(std::clamp(value, -1.0f, 1.0f) * 32767.0f));
+}
+
+uint16_t to_unorm16(float value)
+{
+	return static_cast<uint16_t>(std::lround(std::clamp(value, 0.0f, 1.0f) * 65535.0f));
+}
+
+float sign_not_zero(float value)
+{
+	return value >= 0.0f ? 1.0f : -1.0f;
+}
+
+// Projects a unit vector onto the octahedron and unfolds the lower half over the upper one.
+void encode_octahedral(const QVector3D & v, int16_t (&dst)[2])
+{
+	const auto l1 = std::abs(v.x()) + std::abs(v.y()) + std::abs(v.z());
+	auto x = l1 > 0.0f ? v.x() / l1 : 0.0f;
+	auto y = l1 > 0.0f ? v.y() / l1 : 0.0f;
+	if (v.z() < 0.0f)
+	{
+		const auto folded_x = (1.0f - std::abs(y)) * sign_not_zero(x);
+		y = (1.0f - std::abs(x)) * sign_not_zero(y);
+		x = folded_x;
+	}
+	dst[0] = to_snorm16(x);
+	dst[1] = to_snorm16(y);
+}
+
+}// namespace
+
+QVector3D quantization_extent(const QVector3D & bounds_min, const QVector3D & bounds_max)
+{
+	constexpr float min_extent = 1e-6f;
+	const auto extent = bounds_max - bounds_min;
+	return {std::max(extent.x(), min_extent), std::max(extent.y(), min_extent), std::max(extent.z(), min_extent)};
+}
+
+void pack_primitive(const Vertex * vertices, const PrimitiveRange & range, PackedVertex * packed)
+{
+	const auto extent = quantization_extent(range.bounds_min, range.bounds_max);
+	for (size_t i = range.vertices_offset; i < range.vertices_offset + range.vertices_count; ++i)
+	{
+		const auto & vertex = vertices[i];
+		auto & dst = packed[i];
+
+		const auto pos = (vertex.pos - range.bounds_min) / extent;
+		dst.pos[0] = to_unorm16(pos.x());
+		dst.pos[1] = to_unorm16(pos.y());
+		dst.pos[2] = to_unorm16(pos.z());
+
+		// Vertex stores the bitangent, its sign relative to cross(normal, tangent) is all the shader needs.
+		const auto sign = QVector3D::dotProduct(QVector3D::crossProduct(vertex.normal, vertex.tangent), vertex.bitangent);
+		dst.pos[3] = sign < 0.0f ? 0 : 65535;
+
+		encode_octahedral(vertex.normal, dst.normal);
+		encode_octahedral(vertex.tangent, dst.tangent);
+		dst.tex[0] = qfloat16(vertex.tex.x());
+		dst.tex[1] = qfloat16(vertex.tex.y());
+	}
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "SceneLoader.h"
+
+#include <QVector3D>
+#include <qfloat16.h>
+
+#include <cstdint>
+#include <vector>
+
+// 20-byte counterpart of Vertex, decoded by diffuse.vs built with PACKED_VERTICES.
+struct PackedVertex {
+	// xyz: unorm16 position inside the primitive bounds, w: bitangent sign (0 is -1, 65535 is +1).
+	uint16_t pos[4];
+	// snorm16 octahedral encodings of unit vectors.
+	int16_t normal[2];
+	int16_t tangent[2];
+	qfloat16 tex[2];
+};
+
+// Size of the box positions are quantized to; degenerate axes are widened so decoding never divides by zero.
+QVector3D quantization_extent(const QVector3D & bounds_min, const QVector3D & bounds_max);
+
+// Packs the vertices of range relative to its bounds into the same positions of packed.
+// Primitives write disjoint parts of packed, so they can be packed in parallel.
+void pack_primitive(const Vertex * vertices, const PrimitiveRange & range, PackedVertex * packed);
@@ -1,16 +1,29 @@
 #include "Window.h"
 
+#include "Frustum.h"
+#include "VertexPacking.h"
+
+#include <QFile>
 #include <QMouseEvent>
 #include <QLabel>
+#include <QOpenGLContext>
 #include <QOpenGLFunctions>
 #include <QOpenGLShaderProgram>
 #include <QVBoxLayout>
 #include <QScreen>
 #include <QDateTime>
 #include <QSlider>
+#include <QtMath>
 
+#include <algorithm>
 #include <array>
 #include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <tuple>
 
 #define TINYGLTF_IMPLEMENTATION
 #define STB_IMAGE_IMPLEMENTATION
@@ -18,8 +31,12 @@
 
 #include <tinygltf/tiny_gltf.h>
 
-Window::Window() noexcept
+Window::Window(QString modelPath, RenderOptions options) noexcept
+	: modelPath_{std::move(modelPath)}
+	, options_{options}
 {
+	morphSpeed_ = options_.morphSpeed;
+
 	const auto formatFPS = [](const auto value) {
 		return QString("FPS: %1").arg(QString::number(value));
 	};
@@ -27,6 +44,12 @@ Window::Window() noexcept
 	auto fps = new QLabel(formatFPS(0), this);
 	fps->setStyleSheet("QLabel { color : white; }");
 
+	auto frame_times = new QLabel(this);
+	frame_times->setStyleSheet("QLabel { color : white; }");
+
+	auto draw_stats = new QLabel(this);
+	draw_stats->setStyleSheet("QLabel { color : white; }");
+
 	
 	const float SLIDER_MULT = 100;
 
@@ -86,7 +109,7 @@ Window::Window() noexcept
 	
 	auto morph_slider = new QSlider(Qt::Horizontal);
 	morph_slider->setRange(0, 10 * SLIDER_MULT);
-	morph_slider->setValue(0.2f * SLIDER_MULT);
+	morph_slider->setValue(morphSpeed_ * SLIDER_MULT);
 	connect(morph_slider, &QSlider::valueChanged, this, [this, SLIDER_MULT](float value) { morphSpeed_ = value / SLIDER_MULT; });
 
 	auto morph_label = new QLabel("Morph: 0", this);
@@ -94,7 +117,9 @@ Window::Window() noexcept
 
 
 	auto layout = new QVBoxLayout();
-	layout->addWidget(fps, 1);
+	layout->addWidget(fps);
+	layout->addWidget(frame_times);
+	layout->addWidget(draw_stats, 1);
 	layout->addWidget(ambient_label);
 	layout->addWidget(ambient_slider);
 	layout->addWidget(diffuse_label);
@@ -117,6 +142,8 @@ Window::Window() noexcept
 
 	connect(this, &Window::updateUI, [=] {
 		fps->setText(formatFPS(ui_.fps));
+		frame_times->setText(ui_.frameTimes);
+		draw_stats->setText(ui_.drawStats);
 		ambient_label->setText(QString("Ambient: %1").arg(ambientStrength_));
 		diffuse_label->setText(QString("Diffuse: %1").arg(diffuseReflection_));
 		light1_label->setText(QString("Light1: %1").arg(Light1Param_));
@@ -132,198 +159,209 @@ Window::~Window()
 	{
 		// Free resources with context bounded.
 		const auto guard = bindContext();
-		for (auto & p: primitives_data)
+		textures_.release();
+		if (gl43_)
 		{
-			p.tex.reset();
-			p.normals.reset();
+			gl43_->glDeleteBuffers(1, &indirectBuffer_);
 		}
+		gpuCuller_.reset();
+		if (morphProgram_)
+		{
+			gl33_->glDeleteTextures(1, &morphCacheTexture_);
+			gl33_->glDeleteBuffers(1, &morphCacheBuffer_);
+			morphProgram_.reset();
+		}
+		allInstanceBuffer_.destroy();
+		instanceBuffer_.destroy();
 		program_.reset();
+		profiler_.release();
 	}
 }
 
-size_t read_inds(const tinygltf::Primitive & primitive, const tinygltf::Model & model, size_t model_vertexes_size, std::vector<GLuint> & model_indices)
+namespace
 {
-	assert(primitive.indices >= 0);
-	const auto & accessor_ind = model.accessors[primitive.indices];
-	const auto & bufferView_ind = model.bufferViews[accessor_ind.bufferView];
-	const auto & buffer_ind = model.buffers[bufferView_ind.buffer];
 
-	size_t indexCount = accessor_ind.count;
-	size_t byteOffset = accessor_ind.byteOffset + bufferView_ind.byteOffset;
-	assert(accessor_ind.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT || accessor_ind.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT);
-	assert(accessor_ind.type == TINYGLTF_TYPE_SCALAR);
-	if (accessor_ind.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT)
-	{
-		std::vector<GLuint> uintIndices(indexCount);
-		memcpy(uintIndices.data(), &buffer_ind.data[byteOffset], indexCount * sizeof(GLuint));
-		model_indices.reserve(model_vertexes_size + uintIndices.size());
-		for (auto & i: uintIndices)
-		{
-			model_indices.push_back(i + model_vertexes_size);
-		}
-	}
-	else if (accessor_ind.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT)
-	{
-		std::vector<GLushort> shortIndices(indexCount);
-		memcpy(shortIndices.data(), &buffer_ind.data[byteOffset], indexCount * sizeof(GLushort));
-		model_indices.reserve(model_vertexes_size + shortIndices.size());
-		for (auto i: shortIndices)
-		{
-			model_indices.push_back(i + model_vertexes_size);
-		}
-	}
+// First attribute location of the instance model matrix, one location per column.
+constexpr int g_instance_model_location = 6;
+constexpr int g_morph_cache_offset_location = 10;
 
-	return indexCount;
-}
+// Texture unit of the morph cache, 0 and 1 hold the material.
+constexpr int g_morph_cache_unit = 2;
+// Texels of the morph cache per vertex: position, tangent, bitangent and normal in three vec4.
+constexpr size_t g_morph_cache_texels = 3;
 
-std::pair<const void *, size_t> read_attribute(const tinygltf::Primitive & primitive, const tinygltf::Model & model, const std::string & key)
+// The unsorted loop switched the active unit, bound, set both sampler uniforms
+// and released both textures for every draw.
+constexpr size_t g_unsorted_state_changes = 8;
+
+GLsizei index_size(const GLenum index_type)
 {
-	assert(primitive.attributes.contains(key));
-	const auto & accessor = model.accessors[primitive.attributes.at(key)];
-	assert(!accessor.sparse.isSparse);
-	const auto & bufferView = model.bufferViews[accessor.bufferView];
-	const auto & buffer = model.buffers[bufferView.buffer];
-	return {static_cast<const void *>(&buffer.data[bufferView.byteOffset + accessor.byteOffset]), accessor.count};
+	return index_type == GL_UNSIGNED_INT ? sizeof(GLuint) : sizeof(GLushort);
 }
 
-QMatrix4x4 read_verts(const tinygltf::Primitive & primitive, const tinygltf::Node & node, const tinygltf::Model & model, std::vector<Vertex> & model_vertices, QMatrix4x4 parent_transform)
-{
-	QMatrix4x4 transform;
-	transform.setToIdentity();
+// Largest x offset morph() in diffuse.vs adds to a vertex.
+constexpr float g_morph_amplitude = 0.2f;
 
-	if (node.translation.size() == 3)
-	{
-		transform.translate(node.translation[0], node.translation[1], node.translation[2]);
-	}
-	if (node.rotation.size() == 4)
+// A coarser LOD is drawn once its error projects to at most this many pixels, and kept
+// until it projects to g_lod_hysteresis times as many, so levels do not pop back and forth.
+constexpr float g_lod_pixel_error = 1.0f;
+constexpr float g_lod_hysteresis = 1.5f;
+
+static_assert(GpuPrimitive::kLevels == kMaxLods + 1, "cull.comp reads every level of a primitive");
+
+// Indices of LOD level of primitive, 0 is full detail.
+IndexRange level_indices(const Primitive & primitive, const size_t level)
+{
+	IndexRange ans{primitive.indices_byte_offset, primitive.indices_size};
+	for (size_t i = 0; i < level; ++i)
 	{
-		QQuaternion q(node.rotation[3], node.rotation[0], node.rotation[1], node.rotation[2]);
-		transform.rotate(q);
+		ans.byte_offset += ans.count * index_size(primitive.index_type);
+		ans.count = primitive.lod_indices_size[i];
 	}
-	if (node.scale.size() == 3)
+	return ans;
+}
+
+// Indices of the LOD level primitive is drawn with.
+IndexRange lod_indices(const Primitive & primitive)
+{
+	return level_indices(primitive, primitive.lod);
+}
+
+// Primitives that arrive while streaming are drawn once they hold a 1/g_rebuild_growth share
+// of the instances drawn so far, or at the latest after g_rebuild_interval_ms.
+constexpr size_t g_rebuild_growth = 4;
+constexpr qint64 g_rebuild_interval_ms = 250;
+
+// Only primitives of at most this many triangles at full detail occlude, and only instances
+// at least g_min_occluder_size times the size of the scene.
+constexpr size_t g_max_occluder_triangles = 1024;
+constexpr float g_min_occluder_size = 0.1f;
+
+Instance make_instance(const QMatrix4x4 & model, const QVector3D & bounds_min, const QVector3D & bounds_max)
+{
+	Instance ans;
+	ans.model = model;
+	ans.inverse = model.inverted();
+	ans.bounds_min = QVector3D(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+	ans.bounds_max = -ans.bounds_min;
+	for (int corner = 0; corner < 8; ++corner)
 	{
-		transform.scale(node.scale[0], node.scale[1], node.scale[2]);
+		const auto p = model.map(QVector3D(
+			corner & 1 ? bounds_max.x() : bounds_min.x(),
+			corner & 2 ? bounds_max.y() : bounds_min.y(),
+			corner & 4 ? bounds_max.z() : bounds_min.z()));
+		for (int i = 0; i < 3; ++i)
+		{
+			ans.bounds_min[i] = std::min(ans.bounds_min[i], p[i]);
+			ans.bounds_max[i] = std::max(ans.bounds_max[i], p[i]);
+		}
 	}
 
-	transform = parent_transform * transform;
+	const std::array<QVector3D, 3> axes{model.column(0).toVector3D(), model.column(1).toVector3D(), model.column(2).toVector3D()};
+	ans.max_scale = std::max({axes[0].length(), axes[1].length(), axes[2].length()});
+	ans.min_scale = std::min({axes[0].length(), axes[1].length(), axes[2].length()});
+	ans.mirrored = QVector3D::dotProduct(QVector3D::crossProduct(axes[0], axes[1]), axes[2]) < 0.0f;
+	return ans;
+}
 
+uint32_t read_index(const unsigned char * indices, const GLenum index_type, const size_t i)
+{
+	if (index_type == GL_UNSIGNED_INT)
 	{
-		assert(primitive.attributes.contains("POSITION"));
-		[[maybe_unused]] const auto & accessor = model.accessors[primitive.attributes.at("POSITION")];
-		assert(accessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT);
-		assert(accessor.type == TINYGLTF_TYPE_VEC3);
+		GLuint index;
+		std::memcpy(&index, indices + i * sizeof(GLuint), sizeof(GLuint));
+		return index;
 	}
-	auto position_data = read_attribute(primitive, model, "POSITION");
-	auto positions = reinterpret_cast<const QVector3D *>(position_data.first);
+	GLushort index;
+	std::memcpy(&index, indices + i * sizeof(GLushort), sizeof(GLushort));
+	return index;
+}
 
+// Möller-Trumbore, both faces count since materials may be double-sided.
+std::optional<float> intersect_triangle(const QVector3D & origin, const QVector3D & direction, const QVector3D & a, const QVector3D & b, const QVector3D & c)
+{
+	constexpr float epsilon = 1e-8f;
+	const auto ab = b - a;
+	const auto ac = c - a;
+	const auto p = QVector3D::crossProduct(direction, ac);
+	const auto det = QVector3D::dotProduct(ab, p);
+	if (std::abs(det) < epsilon)
 	{
-		assert(primitive.attributes.contains("TEXCOORD_0"));
-		[[maybe_unused]] const auto & accessor_tex = model.accessors[primitive.attributes.at("TEXCOORD_0")];
-		assert(accessor_tex.type == TINYGLTF_TYPE_VEC2);
-		assert(accessor_tex.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT);
+		return std::nullopt;
 	}
-	auto texcoords_data = read_attribute(primitive, model, "TEXCOORD_0");
-	const QVector2D * tex_coords = reinterpret_cast<const QVector2D *>(texcoords_data.first);
-
+	const auto to_origin = origin - a;
+	const auto u = QVector3D::dotProduct(to_origin, p) / det;
+	const auto q = QVector3D::crossProduct(to_origin, ab);
+	const auto v = QVector3D::dotProduct(direction, q) / det;
+	if (u < 0.0f || v < 0.0f || u + v > 1.0f)
 	{
-		assert(primitive.attributes.contains("NORMAL"));
-		[[maybe_unused]] const auto & accessor_tex = model.accessors[primitive.attributes.at("NORMAL")];
-		assert(accessor_tex.type == TINYGLTF_TYPE_VEC3);
-		assert(accessor_tex.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT);
+		return std::nullopt;
 	}
-	auto normals_data = read_attribute(primitive, model, "NORMAL");
-	const QVector3D * normals = reinterpret_cast<const QVector3D *>(normals_data.first);
+	const auto t = QVector3D::dotProduct(ac, q) / det;
+	return t >= 0.0f ? std::optional<float>(t) : std::nullopt;
+}
 
+float distance_to_box(const QVector3D & point, const QVector3D & box_min, const QVector3D & box_max)
+{
+	QVector3D delta;
+	for (int i = 0; i < 3; ++i)
 	{
-		assert(primitive.attributes.contains("TANGENT"));
-		[[maybe_unused]] const auto & accessor_tan = model.accessors[primitive.attributes.at("TANGENT")];
-		assert(accessor_tan.type == TINYGLTF_TYPE_VEC4);
-		assert(accessor_tan.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT);
+		delta[i] = std::max({box_min[i] - point[i], 0.0f, point[i] - box_max[i]});
 	}
-	auto tangents_data = read_attribute(primitive, model, "TANGENT");
-	const QVector4D * tangents = reinterpret_cast<const QVector4D *>(tangents_data.first);
+	return delta.length();
+}
 
-	assert(texcoords_data.second == position_data.second);
-	assert(texcoords_data.second == normals_data.second);
-	assert(texcoords_data.second == tangents_data.second);
-	size_t verts_count = texcoords_data.second;
+InstanceData instance_data(const Instance & instance, const Primitive & primitive)
+{
+	InstanceData ans;
+	std::copy_n(instance.model.constData(), 16, ans.model);
+	ans.bounds_min = primitive.bounds_min;
+	ans.bounds_extent = quantization_extent(primitive.bounds_min, primitive.bounds_max);
+	ans.morph_cache_offset = instance.morph_cache_offset;
+	return ans;
+}
 
-	std::vector<Vertex> local_verts;
-	for (size_t i = 0; i < verts_count; i++)
+// Source of the shader at path with defines inserted after its #version line, empty if it
+// cannot be read, which fails compiling.
+QByteArray shader_source(const QString & path, const QByteArray & defines)
+{
+	QFile file(path);
+	if (!file.open(QIODevice::ReadOnly))
 	{
-		QVector4D p(positions[i], 1.0f);
-		p = transform * p;
-
-		QVector3D bitangent = QVector3D::crossProduct(normals[i], tangents[i].toVector3D()) * tangents[i].w();
-		local_verts.push_back({p.toVector3D(), normals[i], tex_coords[i], tangents[i].toVector3D(), bitangent});
+		fprintf(stderr, "Failed to open shader %s: %s\n", qPrintable(path), qPrintable(file.errorString()));
+		return {};
 	}
-
-	model_vertices.insert(model_vertices.end(), local_verts.begin(), local_verts.end());
-
-	return transform;
+	auto source = file.readAll();
+	source.insert(source.indexOf('\n') + 1, defines);
+	return source;
 }
 
-void Window::process_node(const tinygltf::Model & model, int32_t node_ind, std::vector<Vertex> & model_vertices, std::vector<GLuint> & model_indices, QMatrix4x4 parent_transform, int parent_texture)
+// Defines selecting the variant of diffuse.vs for options, MORPH_CAPTURE with capture.
+QByteArray vertex_defines(const RenderOptions & options, const bool capture)
 {
-	const auto & node = model.nodes[node_ind];
-  
-	if (node.mesh < 0)
-		return;
-
-	const auto & mesh = model.meshes[node.mesh];
-	const auto & primitive = mesh.primitives[0];
-	assert(primitive.mode == TINYGLTF_MODE_TRIANGLES);
-	
-	size_t model_vertexes_size = model_vertices.size();
-	size_t indices_offset = model_indices.size();
-
-	QMatrix4x4 transform = read_verts(primitive, node, model, model_vertices, parent_transform);
-	size_t indexCount = read_inds(primitive, model, model_vertexes_size, model_indices);
-
-	const auto & material = model.materials[primitive.material];
-	const auto & texture = material.pbrMetallicRoughness.baseColorTexture.index > 0 ? model.textures[material.pbrMetallicRoughness.baseColorTexture.index] : model.textures[parent_texture];
-	const auto & image = model.images[texture.source];
-	assert(image.component == 4);
-	
-	const auto & normal_texture = model.textures[material.normalTexture.index];
-	const auto normal_image = model.images[normal_texture.source];
-	assert(normal_image.component == 4);
-	
-	auto create_texture = [](int width, int height, const unsigned char * image_data) {
-		auto ans = std::make_unique<QOpenGLTexture>(QOpenGLTexture::Target2D);
-		ans->setMinMagFilters(QOpenGLTexture::Linear, QOpenGLTexture::Linear);
-		ans->setWrapMode(QOpenGLTexture::WrapMode::Repeat);
-		ans->create();
-		ans->setSize(width, height);
-		ans->setFormat(QOpenGLTexture::TextureFormat::RGBA8_UNorm);
-		ans->allocateStorage();
-		ans->setData(QOpenGLTexture::RGBA, QOpenGLTexture::UInt8, image_data);
-		ans->generateMipMaps();
-		return ans;
-	};
-
-	Primitive p;
-
-	p.normals = create_texture(normal_image.width, normal_image.height, normal_image.image.data());
-	p.tex = create_texture(image.width, image.height, image.image.data());
-	
-	p.indices_offset = static_cast<int>(indices_offset);
-	p.indices_size = static_cast<int>(indexCount);
-
-	primitives_data.push_back(std::move(p));
-
-	for (auto i: node.children)
+	QByteArray ans;
+	if (options.packedVertices)
+	{
+		ans.append("#define PACKED_VERTICES\n");
+	}
+	if (!options.analyticMorph)
+	{
+		ans.append("#define FINITE_DIFFERENCE_MORPH\n");
+	}
+	if (capture)
 	{
-		assert(material.pbrMetallicRoughness.baseColorTexture.index > 0);
-		process_node(model, i, model_vertices, model_indices, transform, material.pbrMetallicRoughness.baseColorTexture.index);
+		ans.append("#define MORPH_CAPTURE\n");
 	}
+	return ans;
 }
 
+}// namespace
+
 void Window::onInit()
 {
 	// Configure shaders
 	program_ = std::make_unique<QOpenGLShaderProgram>(this);
-	program_->addShaderFromSourceFile(QOpenGLShader::Vertex, ":/Shaders/diffuse.vs");
+	program_->addShaderFromSourceCode(QOpenGLShader::Vertex, shader_source(":/Shaders/diffuse.vs", vertex_defines(options_, false)));
 	program_->addShaderFromSourceFile(QOpenGLShader::Fragment,
 									  ":/Shaders/diffuse.fs");
 	program_->link();
@@ -332,73 +370,66 @@ void Window::onInit()
 	vao_.create();
 	vao_.bind();
 
-	tinygltf::Model model;
-	tinygltf::TinyGLTF loader;
-	std::string err;
-	std::string warn;
+	// Textures show placeholders until the streamer has decoded and uploaded them.
+	textures_.init();
 
-	QFile file(":/Models/chess.glb");
-	if (!file.open(QIODevice::ReadOnly))
-	{
-		printf("Failed to open resource:");
-	}
-	auto file_data = file.readAll();
-	file.close();
-	bool ret = loader.LoadBinaryFromMemory(&model, &err, &warn, (const unsigned char *)file_data.constData(), file_data.size());
-	//bool ret = loader.LoadASCIIFromFile(&model, &err, &warn, "Models/My.gltf");
-	if (!warn.empty())
-	{
-		printf("Warn: %s\n", warn.c_str());
-	}
-	if (!err.empty())
-	{
-		printf("Err: %s\n", err.c_str());
-	}
-	if (!ret)
-	{
-		printf("Failed to parse glTF\n");
-	}
+	// Geometry streams in from the first frame on, onRender() uploads what the loader has finished.
+	scene_.start(modelPath_, options_);
 
 	// Create VBO
 	vbo_.create();
 	vbo_.bind();
 	vbo_.setUsagePattern(QOpenGLBuffer::StaticDraw);
-	
-	const auto & scene = model.scenes[model.defaultScene];
-
-	std::vector<GLuint> model_indices;
-	std::vector<Vertex> model_vertices;
-
-	for (auto node_ind: scene.nodes)
-	{
-		process_node(model, node_ind, model_vertices, model_indices);
-	}
-
-	vbo_.allocate(model_vertices.data(), static_cast<int>(model_vertices.size() * sizeof(Vertex)));
 
 	// Create IBO
 	ibo_.create();
 	ibo_.bind();
 	ibo_.setUsagePattern(QOpenGLBuffer::StaticDraw);
-	ibo_.allocate(model_indices.data(), static_cast<int>(model_indices.size() * sizeof(GLuint)));
 
 	// Bind attributes
 	program_->bind();
 
-	program_->enableAttributeArray(0);
-	program_->setAttributeBuffer(0, GL_FLOAT, offsetof(Vertex, pos), 3, sizeof(Vertex));
+	if (options_.packedVertices)
+	{
+		// Integer attributes are normalized by setAttributeBuffer.
+		program_->enableAttributeArray(0);
+		program_->setAttributeBuffer(0, GL_UNSIGNED_SHORT, offsetof(PackedVertex, pos), 4, sizeof(PackedVertex));
 
-	program_->enableAttributeArray(1);
-	program_->setAttributeBuffer(1, GL_FLOAT, offsetof(Vertex, normal), 3, sizeof(Vertex));
+		program_->enableAttributeArray(1);
+		program_->setAttributeBuffer(1, GL_SHORT, offsetof(PackedVertex, normal), 2, sizeof(PackedVertex));
 
-	program_->enableAttributeArray(2);
-	program_->setAttributeBuffer(2, GL_FLOAT, offsetof(Vertex, tex), 2, sizeof(Vertex));
+		program_->enableAttributeArray(2);
+		program_->setAttributeBuffer(2, GL_HALF_FLOAT, offsetof(PackedVertex, tex), 2, sizeof(PackedVertex));
+
+		program_->enableAttributeArray(3);
+		program_->setAttributeBuffer(3, GL_SHORT, offsetof(PackedVertex, tangent), 2, sizeof(PackedVertex));
+	}
+	else
+	{
+		program_->enableAttributeArray(0);
+		program_->setAttributeBuffer(0, GL_FLOAT, offsetof(Vertex, pos), 3, sizeof(Vertex));
 
-	program_->enableAttributeArray(3);
-	program_->setAttributeBuffer(3, GL_FLOAT, offsetof(Vertex, tangent), 3, sizeof(Vertex));
+		program_->enableAttributeArray(1);
+		program_->setAttributeBuffer(1, GL_FLOAT, offsetof(Vertex, normal), 3, sizeof(Vertex));
 
-	program_->enableAttributeArray(4);
-	program_->setAttributeBuffer(4, GL_FLOAT, offsetof(Vertex, bitangent), 3, sizeof(Vertex));
+		program_->enableAttributeArray(2);
+		program_->setAttributeBuffer(2, GL_FLOAT, offsetof(Vertex, tex), 2, sizeof(Vertex));
+
+		program_->enableAttributeArray(3);
+		program_->setAttributeBuffer(3, GL_FLOAT, offsetof(Vertex, tangent), 3, sizeof(Vertex));
+
+		program_->enableAttributeArray(4);
+		program_->setAttributeBuffer(4, GL_FLOAT, offsetof(Vertex, bitangent), 3, sizeof(Vertex));
+	}
+
+	gl33_ = QOpenGLContext::currentContext()->versionFunctions<QOpenGLFunctions_3_3_Core>();
+	gl33_->initializeOpenGLFunctions();
+	initInstancing();
+	initMultiDraw();
+	if (options_.morphCache)
+	{
+		initMorphCache();
+	}
 
 	mvpUniform_ = program_->uniformLocation("mvp");
 	modelUniform_ = program_->uniformLocation("model");
@@ -412,6 +443,12 @@ void Window::onInit()
 	cameraPosUniform_ = program_->uniformLocation("cameraPos");
 	timeValueUniform_ = program_->uniformLocation("timeValue");
 	morphSpeedUniform_ = program_->uniformLocation("morphSpeed");
+	morphCachedUniform_ = program_->uniformLocation("morphCached");
+
+	// Samplers always read from the same units.
+	program_->setUniformValue(program_->uniformLocation("tex_2d"), 0);
+	program_->setUniformValue(program_->uniformLocation("normal_tex"), 1);
+	program_->setUniformValue(program_->uniformLocation("morphCache"), g_morph_cache_unit);
 
 	// Release all
 	program_->release();
@@ -464,7 +501,7 @@ void Window::onRender()
 {
 	updateMoving();
 
-	const auto guard = captureMetrics();
+	const auto frame = profiler_.frame();
 
 	// Clear buffers
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -478,10 +515,20 @@ void Window::onRender()
 	view_.translate(cameraPosition);
 	const auto mvp = projection_ * view_ * model_;
 
+	{
+		const auto scope = profiler_.scope("textures");
+		textures_.upload();
+	}
+
 	// Bind VAO and shader program
 	program_->bind();
 	vao_.bind();
 
+	{
+		const auto scope = profiler_.scope("geometry");
+		addPrimitives(scene_.upload(vbo_, ibo_));
+	}
+
 	// Update uniform value
 	program_->setUniformValue(mvpUniform_, mvp);
 	program_->setUniformValue(modelUniform_, model_);
@@ -499,19 +546,69 @@ void Window::onRender()
 	float timeValue = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start_time).count();
 	program_->setUniformValue(timeValueUniform_, timeValue);
 
-	for (const auto & primitive: primitives_data)
+	// Static geometry morphs to itself, drawing it directly costs less than going through the cache.
+	morphCacheActive_ = morphProgram_ && morphSpeed_ != 0.0f && morphCacheEntries_ > 0;
+	program_->setUniformValue(morphCachedUniform_, static_cast<GLint>(morphCacheActive_));
+
+	drawStats_ = {};
+	const Frustum frustum(mvp);
+	eye_ = view_.inverted().column(3).toVector3D();
 	{
-		glActiveTexture(GL_TEXTURE1);
-		primitive.normals->bind();
+		const auto scope = profiler_.scope("cull");
+
+		// The depth buffer is rasterized while LODs are selected and the frustum is culled.
+		// Occluders only stay conservative while they do not move.
+		occlusionActive_ = options_.occlusionCulling && morphSpeed_ == 0.0f && !occluders_.empty();
+		if (occlusionActive_)
+		{
+			occlusion_.start(mvp, eye_, occluders_);
+		}
+		if (!gpuCulling())
+		{
+			if (options_.lod)
+			{
+				selectLods();
+			}
+			cullInstances(frustum);
+		}
+	}
+
+	if (morphCacheActive_)
+	{
+		const auto scope = profiler_.scope("morph");
+		captureMorph(timeValue);
+		program_->bind();
+		glActiveTexture(GL_TEXTURE0 + g_morph_cache_unit);
+		gl33_->glBindTexture(GL_TEXTURE_BUFFER, morphCacheTexture_);
 		glActiveTexture(GL_TEXTURE0);
-		primitive.tex->bind();
-		program_->setUniformValue(program_->uniformLocation("tex_2d"), 0);
-		program_->setUniformValue(program_->uniformLocation("normal_tex"), 1);
+	}
+
+	{
+		const auto scope = profiler_.scope("scene");
 
-		glDrawElements(GL_TRIANGLES, primitive.indices_size, GL_UNSIGNED_INT, (void *)(primitive.indices_offset * sizeof(GLuint)));
+		boundTex_ = nullptr;
+		boundNormals_ = nullptr;
+		if (gpuCulling())
+		{
+			drawGpuCulled(frustum);
+		}
+		else if (gl43_)
+		{
+			drawBatches(frustum);
+		}
+		else
+		{
+			drawPrimitives(frustum);
+		}
+		drawStats_.stateChangesSaved = drawStats_.draws * g_unsorted_state_changes - drawStats_.stateChanges;
 
-		primitive.tex->release();
-		primitive.normals->release();
+		if (boundNormals_)
+		{
+			glActiveTexture(GL_TEXTURE1);
+			boundNormals_->release();
+			glActiveTexture(GL_TEXTURE0);
+			boundTex_->release();
+		}
 	}
 
 	// Release VAO and shader program
@@ -519,6 +616,7 @@ void Window::onRender()
 	program_->release();
 
 	++frameCount_;
+	updateMetrics();
 
 	// Request redraw if animated
 	if (animated_)
@@ -527,6 +625,727 @@ void Window::onRender()
 	}
 }
 
+void Window::bindTextures(const TextureStreamer::Handle tex, const TextureStreamer::Handle normals)
+{
+	// Placeholders resolve to the same texture too, so binds are skipped by pointer, not by handle.
+	auto * normals_texture = textures_.texture(normals);
+	auto * tex_texture = textures_.texture(tex);
+	if (normals_texture != boundNormals_)
+	{
+		glActiveTexture(GL_TEXTURE1);
+		normals_texture->bind();
+		boundNormals_ = normals_texture;
+		drawStats_.stateChanges += 2;
+	}
+	if (tex_texture != boundTex_)
+	{
+		glActiveTexture(GL_TEXTURE0);
+		tex_texture->bind();
+		boundTex_ = tex_texture;
+		drawStats_.stateChanges += 2;
+	}
+}
+
+void Window::selectLods()
+{
+	for (auto & primitive: primitives_data)
+	{
+		// All instances share the level, so the one where the error projects largest decides it.
+		float scale_per_distance = 0.0f;
+		for (size_t i = primitive.instances_first; i < primitive.instances_first + primitive.instances_count; ++i)
+		{
+			const auto & instance = instances_[i];
+			const auto distance = distance_to_box(eye_, instance.bounds_min, instance.bounds_max);
+			scale_per_distance = distance > 0.0f ? std::max(scale_per_distance, instance.max_scale / distance) : std::numeric_limits<float>::max();
+		}
+		const auto pixels = [&](const size_t level) {
+			return primitive.lod_error[level - 1] * lodPixelScale_ * scale_per_distance;
+		};
+		auto lod = primitive.lod;
+		while (lod > 0 && pixels(lod) > g_lod_pixel_error * g_lod_hysteresis)
+		{
+			--lod;
+		}
+		while (lod < primitive.lod_count && pixels(lod + 1) <= g_lod_pixel_error)
+		{
+			++lod;
+		}
+		primitive.lod = lod;
+	}
+}
+
+void Window::cullInstances(const Frustum & frustum)
+{
+	visibleItems_.clear();
+	if (options_.frustumCulling)
+	{
+		instanceBvh_.cull(frustum, visibleItems_);
+	}
+	else
+	{
+		visibleItems_.resize(instances_.size());
+		std::iota(visibleItems_.begin(), visibleItems_.end(), 0);
+	}
+	drawStats_.culled += instances_.size() - visibleItems_.size();
+	if (occlusionActive_)
+	{
+		occlusion_.wait();
+		const auto visible_end = std::remove_if(visibleItems_.begin(), visibleItems_.end(), [&](const uint32_t item) {
+			return occlusion_.occluded(instances_[item].bounds_min, instances_[item].bounds_max);
+		});
+		drawStats_.occluded += static_cast<size_t>(visibleItems_.end() - visible_end);
+		visibleItems_.erase(visible_end, visibleItems_.end());
+	}
+
+	// Counting sort by primitive, the work grows with visible instances and primitives, not with all instances.
+	for (auto & primitive: primitives_data)
+	{
+		primitive.visible_count = 0;
+	}
+	for (const auto item: visibleItems_)
+	{
+		++primitives_data[instances_[item].primitive].visible_count;
+	}
+	size_t first = 0;
+	for (auto & primitive: primitives_data)
+	{
+		primitive.visible_first = first;
+		first += primitive.visible_count;
+		primitive.visible_count = 0;
+	}
+	frameInstances_.resize(visibleItems_.size());
+	visibleInstances_.resize(visibleItems_.size());
+	for (const auto item: visibleItems_)
+	{
+		const auto & instance = instances_[item];
+		auto & primitive = primitives_data[instance.primitive];
+		const auto slot = primitive.visible_first + primitive.visible_count++;
+		frameInstances_[slot] = instance_data(instance, primitive);
+		visibleInstances_[slot] = item;
+	}
+	if (morphCacheActive_)
+	{
+		// Only the visible instances are morphed, packed in the order captureMorph() draws them.
+		GLint entries = 0;
+		for (const auto & primitive: primitives_data)
+		{
+			for (size_t slot = primitive.visible_first; slot < primitive.visible_first + primitive.visible_count; ++slot)
+			{
+				frameInstances_[slot].morph_cache_offset = entries - primitive.base_vertex;
+				entries += static_cast<GLint>(primitive.vertex_count);
+			}
+		}
+	}
+
+	instanceBuffer_.bind();
+	instanceBuffer_.allocate(frameInstances_.data(), static_cast<int>(frameInstances_.size() * sizeof(InstanceData)));
+	instanceBuffer_.release();
+}
+
+void Window::bindInstances(QOpenGLBuffer & buffer, const size_t first)
+{
+	const auto offset = static_cast<int>(first * sizeof(InstanceData));
+	buffer.bind();
+	for (int column = 0; column < 4; ++column)
+	{
+		program_->setAttributeBuffer(g_instance_model_location + column, GL_FLOAT, offset + offsetof(InstanceData, model) + column * 4 * sizeof(float), 4, sizeof(InstanceData));
+	}
+	if (options_.packedVertices)
+	{
+		program_->setAttributeBuffer(4, GL_FLOAT, offset + offsetof(InstanceData, bounds_min), 3, sizeof(InstanceData));
+		program_->setAttributeBuffer(5, GL_FLOAT, offset + offsetof(InstanceData, bounds_extent), 3, sizeof(InstanceData));
+	}
+	gl33_->glVertexAttribIPointer(g_morph_cache_offset_location, 1, GL_INT, sizeof(InstanceData), reinterpret_cast<const void *>(offset + offsetof(InstanceData, morph_cache_offset)));
+	buffer.release();
+}
+
+bool Window::meshletCulling(const Primitive & primitive) const
+{
+	return options_.meshletCulling && primitive.lod == 0 && primitive.meshlet_count > 0;
+}
+
+void Window::cullMeshlets(const Primitive & primitive, const Instance & instance, const Frustum & frustum)
+{
+	ranges_.clear();
+	const auto lod = lod_indices(primitive);
+	if (!meshletCulling(primitive))
+	{
+		ranges_.push_back(lod);
+		return;
+	}
+
+	// Spheres are tested placed, cones in the space of the vertices, where the eye moves instead.
+	// Mirroring swaps front and back faces, so cones cannot cull then.
+	const auto eye = instance.inverse.map(eye_);
+	const auto local_morph_margin = g_morph_amplitude / instance.min_scale;
+	const auto size = index_size(primitive.index_type);
+	for (size_t i = 0; i < primitive.meshlet_count; ++i)
+	{
+		const auto & meshlet = primitive.meshlets[i];
+		const QVector3D center(meshlet.center[0], meshlet.center[1], meshlet.center[2]);
+		const QVector3D axis(meshlet.cone_axis[0], meshlet.cone_axis[1], meshlet.cone_axis[2]);
+		const auto radius = meshlet.radius + local_morph_margin;
+		const auto view = center - eye;
+		const auto outside = !frustum.intersects(instance.model.map(center), meshlet.radius * instance.max_scale + g_morph_amplitude);
+		if (outside || (!instance.mirrored && QVector3D::dotProduct(view, axis) >= meshlet.cone_cutoff * view.length() + radius))
+		{
+			++drawStats_.meshletsCulled;
+			continue;
+		}
+
+		const auto byte_offset = primitive.indices_byte_offset + static_cast<int>(meshlet.first_index) * size;
+		if (!ranges_.empty() && ranges_.back().byte_offset + ranges_.back().count * size == byte_offset)
+		{
+			ranges_.back().count += static_cast<int>(meshlet.index_count);
+		}
+		else
+		{
+			ranges_.push_back({byte_offset, static_cast<int>(meshlet.index_count)});
+		}
+	}
+}
+
+void Window::drawPrimitives(const Frustum & frustum)
+{
+	// Arguments of glMultiDrawElementsBaseVertex when meshlet culling split a primitive.
+	std::vector<GLsizei> counts;
+	std::vector<const void *> offsets;
+	std::vector<GLint> base_vertices;
+	for (const auto & primitive: primitives_data)
+	{
+		if (primitive.visible_count == 0)
+		{
+			continue;
+		}
+
+		if (!meshletCulling(primitive))
+		{
+			// GL 3.3 has no base instance, the instanced attributes are pointed at the first instance instead.
+			const auto lod = lod_indices(primitive);
+			bindTextures(primitive.tex, primitive.normals);
+			bindInstances(instanceBuffer_, primitive.visible_first);
+			gl33_->glDrawElementsInstancedBaseVertex(GL_TRIANGLES, lod.count, primitive.index_type, (void *)static_cast<size_t>(lod.byte_offset), static_cast<GLsizei>(primitive.visible_count), primitive.base_vertex);
+			drawStats_.triangles += static_cast<size_t>(lod.count) / 3 * primitive.visible_count;
+			drawStats_.instances += primitive.visible_count;
+			++drawStats_.draws;
+			++drawStats_.drawCalls;
+			continue;
+		}
+
+		// Every instance sees other meshlets, so each one is drawn on its own.
+		bool drawn = false;
+		for (size_t i = primitive.visible_first; i < primitive.visible_first + primitive.visible_count; ++i)
+		{
+			cullMeshlets(primitive, instances_[visibleInstances_[i]], frustum);
+			if (ranges_.empty())
+			{
+				++drawStats_.culled;
+				continue;
+			}
+
+			bindTextures(primitive.tex, primitive.normals);
+			bindInstances(instanceBuffer_, i);
+			counts.clear();
+			offsets.clear();
+			for (const auto & range: ranges_)
+			{
+				counts.push_back(range.count);
+				offsets.push_back((void *)static_cast<size_t>(range.byte_offset));
+				drawStats_.triangles += static_cast<size_t>(range.count) / 3;
+			}
+			base_vertices.assign(ranges_.size(), primitive.base_vertex);
+			gl33_->glMultiDrawElementsBaseVertex(GL_TRIANGLES, counts.data(), primitive.index_type, offsets.data(), static_cast<GLsizei>(ranges_.size()), base_vertices.data());
+			++drawStats_.instances;
+			++drawStats_.drawCalls;
+			drawn = true;
+		}
+		if (drawn)
+		{
+			++drawStats_.draws;
+		}
+	}
+}
+
+void Window::drawBatches(const Frustum & frustum)
+{
+	// Commands of visible primitives are compacted per batch and uploaded once per frame.
+	// baseInstance points the instanced attributes at the primitive's visible instances.
+	commands_.clear();
+	for (auto & batch: batches_)
+	{
+		batch.visible_first = commands_.size();
+		for (size_t i = batch.first; i < batch.first + batch.count; ++i)
+		{
+			const auto & primitive = primitives_data[i];
+			if (primitive.visible_count == 0)
+			{
+				continue;
+			}
+			const auto size = index_size(primitive.index_type);
+
+			if (!meshletCulling(primitive))
+			{
+				const auto lod = lod_indices(primitive);
+				commands_.push_back({static_cast<GLuint>(lod.count), static_cast<GLuint>(primitive.visible_count), static_cast<GLuint>(lod.byte_offset / size), static_cast<GLuint>(primitive.base_vertex), static_cast<GLuint>(primitive.visible_first)});
+				drawStats_.triangles += static_cast<size_t>(lod.count) / 3 * primitive.visible_count;
+				drawStats_.instances += primitive.visible_count;
+				++drawStats_.draws;
+				continue;
+			}
+
+			bool drawn = false;
+			for (size_t j = primitive.visible_first; j < primitive.visible_first + primitive.visible_count; ++j)
+			{
+				cullMeshlets(primitive, instances_[visibleInstances_[j]], frustum);
+				if (ranges_.empty())
+				{
+					++drawStats_.culled;
+					continue;
+				}
+				for (const auto & range: ranges_)
+				{
+					commands_.push_back({static_cast<GLuint>(range.count), 1, static_cast<GLuint>(range.byte_offset / size), static_cast<GLuint>(primitive.base_vertex), static_cast<GLuint>(j)});
+					drawStats_.triangles += static_cast<size_t>(range.count) / 3;
+				}
+				++drawStats_.instances;
+				drawn = true;
+			}
+			if (drawn)
+			{
+				++drawStats_.draws;
+			}
+		}
+		batch.visible_count = commands_.size() - batch.visible_first;
+	}
+
+	gl43_->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer_);
+	gl43_->glBufferData(GL_DRAW_INDIRECT_BUFFER, static_cast<GLsizeiptr>(commands_.size() * sizeof(DrawElementsIndirectCommand)), commands_.data(), GL_STREAM_DRAW);
+	bindInstances(instanceBuffer_, 0);
+	for (const auto & batch: batches_)
+	{
+		if (batch.visible_count == 0)
+		{
+			continue;
+		}
+		bindTextures(batch.tex, batch.normals);
+		const auto * commands = reinterpret_cast<const void *>(batch.visible_first * sizeof(DrawElementsIndirectCommand));
+		gl43_->glMultiDrawElementsIndirect(GL_TRIANGLES, batch.index_type, commands, static_cast<GLsizei>(batch.visible_count), 0);
+		++drawStats_.drawCalls;
+	}
+	gl43_->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+bool Window::gpuCulling() const noexcept
+{
+	// Occlusion and meshlets are culled on the CPU, which needs the instances sorted there.
+	return gpuCuller_ && !occlusionActive_ && !options_.meshletCulling;
+}
+
+void Window::drawGpuCulled(const Frustum & frustum)
+{
+	// Per frame the CPU work only grows with the batches, the GPU walks the instances.
+	gpuCuller_->cull(options_.frustumCulling ? &frustum : nullptr, eye_, lodPixelScale_, options_.lod);
+	program_->bind();
+	bindInstances(allInstanceBuffer_, 0);
+	for (size_t i = 0; i < batches_.size(); ++i)
+	{
+		bindTextures(batches_[i].tex, batches_[i].normals);
+		gpuCuller_->draw(i, batches_[i].index_type);
+		++drawStats_.drawCalls;
+	}
+	// What survived is only known on the GPU, counting it would need a readback.
+	drawStats_.draws = primitives_data.size();
+	drawStats_.instances = instances_.size();
+}
+
+void Window::initInstancing()
+{
+	instanceBuffer_.create();
+	instanceBuffer_.setUsagePattern(QOpenGLBuffer::DynamicDraw);
+	allInstanceBuffer_.create();
+	allInstanceBuffer_.setUsagePattern(QOpenGLBuffer::StaticDraw);
+	program_->enableAttributeArray(g_morph_cache_offset_location);
+	gl33_->glVertexAttribDivisor(g_morph_cache_offset_location, 1);
+	for (int column = 0; column < 4; ++column)
+	{
+		program_->enableAttributeArray(g_instance_model_location + column);
+		gl33_->glVertexAttribDivisor(g_instance_model_location + column, 1);
+	}
+	if (options_.packedVertices)
+	{
+		program_->enableAttributeArray(4);
+		gl33_->glVertexAttribDivisor(4, 1);
+		program_->enableAttributeArray(5);
+		gl33_->glVertexAttribDivisor(5, 1);
+	}
+	bindInstances(instanceBuffer_, 0);
+}
+
+void Window::initMultiDraw()
+{
+	auto * context = QOpenGLContext::currentContext();
+	if (!options_.multiDrawIndirect || context->isOpenGLES() || context->format().version() < qMakePair(4, 3))
+	{
+		return;
+	}
+	gl43_ = context->versionFunctions<QOpenGLFunctions_4_3_Core>();
+	if (!gl43_ || !gl43_->initializeOpenGLFunctions())
+	{
+		gl43_ = nullptr;
+		return;
+	}
+
+	gl43_->glGenBuffers(1, &indirectBuffer_);
+
+	if (options_.gpuCulling)
+	{
+		gpuCuller_ = GpuCuller::create(*gl43_);
+	}
+}
+
+void Window::addPrimitives(const std::vector<CachedPrimitive> & primitives)
+{
+	for (const auto & primitive: primitives)
+	{
+		stagedPrimitives_.push_back(primitive);
+		stagedInstances_ += primitive.instances_count;
+	}
+	if (stagedPrimitives_.empty())
+	{
+		return;
+	}
+	// The rebuilds below cost as much as everything added so far, doing them for every upload
+	// would be quadratic over the stream. They wait until the staged instances are a fair share
+	// of the drawn ones, a while passed or streaming ended.
+	const auto grown = stagedInstances_ * g_rebuild_growth >= instances_.size();
+	if (!grown && scene_.pending() && rebuildTimer_.isValid() && rebuildTimer_.elapsed() < g_rebuild_interval_ms)
+	{
+		return;
+	}
+	rebuildTimer_.start();
+
+	// Staged primitives are sorted on their own and merged, the drawn ones already are.
+	const auto sorted_end = primitives_data.size();
+	for (const auto & primitive: stagedPrimitives_)
+	{
+		Primitive p;
+		p.normals = scene_.requestTexture(textures_, primitive.normals, TextureStreamer::Placeholder::Normal);
+		p.tex = scene_.requestTexture(textures_, primitive.tex, TextureStreamer::Placeholder::Color);
+		p.index_type = primitive.index_size == sizeof(GLuint) ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+		p.indices_byte_offset = static_cast<int>(primitive.indices_byte_offset);
+		p.indices_size = static_cast<int>(primitive.indices_count);
+		p.base_vertex = static_cast<GLint>(primitive.vertices_offset);
+		p.vertex_count = primitive.vertices_count;
+		p.bounds_min = QVector3D(primitive.bounds_min[0], primitive.bounds_min[1], primitive.bounds_min[2]);
+		p.bounds_max = QVector3D(primitive.bounds_max[0], primitive.bounds_max[1], primitive.bounds_max[2]);
+		p.instances_first = instances_.size();
+		p.instances_count = primitive.instances_count;
+		for (size_t i = 0; i < primitive.instances_count; ++i)
+		{
+			const QMatrix4x4 model(scene_.instances()[primitive.instances_offset + i].model);
+			instances_.push_back(make_instance(model, p.bounds_min, p.bounds_max));
+		}
+		p.meshlets = scene_.meshlets() + primitive.meshlets_offset;
+		p.meshlet_count = primitive.meshlets_count;
+		p.lod_count = primitive.lod_count;
+		for (size_t i = 0; i < kMaxLods; ++i)
+		{
+			p.lod_indices_size[i] = static_cast<int>(primitive.lod_indices_count[i]);
+			p.lod_error[i] = primitive.lod_error[i];
+		}
+		primitives_data.push_back(std::move(p));
+	}
+	stagedPrimitives_.clear();
+	stagedInstances_ = 0;
+	const auto by_state = [](const Primitive & a, const Primitive & b) {
+		return std::tie(a.tex, a.normals, a.index_type) < std::tie(b.tex, b.normals, b.index_type);
+	};
+	const auto staged_begin = primitives_data.begin() + static_cast<ptrdiff_t>(sorted_end);
+	std::stable_sort(staged_begin, primitives_data.end(), by_state);
+	std::inplace_merge(primitives_data.begin(), staged_begin, primitives_data.end(), by_state);
+	rebuildInstanceBvh();
+	rebuildOccluders();
+	if (morphProgram_)
+	{
+		rebuildMorphCache();
+	}
+
+	if (gl43_)
+	{
+		rebuildBatches();
+	}
+	if (gpuCuller_ || morphProgram_)
+	{
+		uploadInstances();
+	}
+	if (gpuCuller_)
+	{
+		uploadGpuCulling();
+	}
+}
+
+void Window::rebuildBatches()
+{
+	// Primitives are sorted by texture pair and index type, so every batch is a contiguous run of them.
+	batches_.clear();
+	for (size_t i = 0; i < primitives_data.size(); ++i)
+	{
+		const auto & primitive = primitives_data[i];
+		if (batches_.empty() || batches_.back().tex != primitive.tex || batches_.back().normals != primitive.normals || batches_.back().index_type != primitive.index_type)
+		{
+			batches_.push_back({primitive.tex, primitive.normals, primitive.index_type, i, 0});
+		}
+		++batches_.back().count;
+	}
+	commands_.reserve(primitives_data.size());
+}
+
+void Window::uploadGpuCulling()
+{
+	std::vector<GpuPrimitive> primitives(primitives_data.size());
+	std::vector<uint32_t> batch_capacity(batches_.size(), 0);
+	for (size_t i = 0; i < batches_.size(); ++i)
+	{
+		for (size_t j = batches_[i].first; j < batches_[i].first + batches_[i].count; ++j)
+		{
+			const auto & primitive = primitives_data[j];
+			auto & gpu = primitives[j];
+			gpu = {};
+			gpu.lod_count = static_cast<uint32_t>(primitive.lod_count);
+			gpu.batch = static_cast<uint32_t>(i);
+			gpu.base_vertex = primitive.base_vertex;
+			for (size_t level = 0; level <= primitive.lod_count; ++level)
+			{
+				const auto indices = level_indices(primitive, level);
+				gpu.index_count[level] = static_cast<uint32_t>(indices.count);
+				gpu.first_index[level] = static_cast<uint32_t>(indices.byte_offset / index_size(primitive.index_type));
+				gpu.lod_error[level] = level > 0 ? primitive.lod_error[level - 1] : 0.0f;
+			}
+			batch_capacity[i] += static_cast<uint32_t>(primitive.instances_count);
+		}
+	}
+
+	// Bounds grow like the ones of the instance BVH, the draws read allInstanceBuffer_ at baseInstance.
+	std::vector<GpuInstance> instances(instances_.size());
+	for (size_t i = 0; i < instances_.size(); ++i)
+	{
+		const auto & instance = instances_[i];
+		auto & gpu = instances[i];
+		std::copy_n(instance.model.constData(), 16, gpu.model);
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const auto margin = axis == 0 ? g_morph_amplitude : 0.0f;
+			gpu.bounds_min[axis] = instance.bounds_min[axis] - margin;
+			gpu.bounds_max[axis] = instance.bounds_max[axis] + margin;
+		}
+		gpu.bounds_min[3] = gpu.bounds_max[3] = 0.0f;
+		gpu.primitive = static_cast<uint32_t>(instance.primitive);
+		gpu.max_scale = instance.max_scale;
+		gpu.padding[0] = gpu.padding[1] = 0;
+	}
+	gpuCuller_->upload(primitives, instances, batch_capacity);
+}
+
+void Window::uploadInstances()
+{
+	std::vector<InstanceData> data(instances_.size());
+	for (size_t i = 0; i < instances_.size(); ++i)
+	{
+		data[i] = instance_data(instances_[i], primitives_data[instances_[i].primitive]);
+	}
+	allInstanceBuffer_.bind();
+	allInstanceBuffer_.allocate(data.data(), static_cast<int>(data.size() * sizeof(InstanceData)));
+	allInstanceBuffer_.release();
+}
+
+void Window::rebuildMorphCache()
+{
+	// Transform feedback appends in draw order, captureMorph() draws primitives and their instances in this one.
+	size_t entries = 0;
+	for (const auto & primitive: primitives_data)
+	{
+		for (size_t i = primitive.instances_first; i < primitive.instances_first + primitive.instances_count; ++i)
+		{
+			instances_[i].morph_cache_offset = static_cast<GLint>(entries) - primitive.base_vertex;
+			entries += primitive.vertex_count;
+		}
+	}
+	// Larger scenes than a buffer texture can address keep morphing in every draw.
+	morphCacheEntries_ = entries * g_morph_cache_texels <= static_cast<size_t>(maxTextureBufferSize_) ? entries : 0;
+	if (morphCacheEntries_ <= morphCacheCapacity_)
+	{
+		return;
+	}
+
+	// Captures rewrite the whole cache every frame, so it grows without keeping its contents,
+	// with headroom for the primitives still streaming in.
+	const auto max_entries = static_cast<size_t>(maxTextureBufferSize_) / g_morph_cache_texels;
+	morphCacheCapacity_ = std::min(std::max(morphCacheEntries_, morphCacheCapacity_ * 3 / 2), max_entries);
+	gl33_->glBindBuffer(GL_TEXTURE_BUFFER, morphCacheBuffer_);
+	gl33_->glBufferData(GL_TEXTURE_BUFFER, static_cast<GLsizeiptr>(morphCacheCapacity_ * g_morph_cache_texels * sizeof(QVector4D)), nullptr, GL_DYNAMIC_COPY);
+	gl33_->glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void Window::captureMorph(const float timeValue)
+{
+	morphProgram_->bind();
+	morphProgram_->setUniformValue(morphProgramTimeUniform_, timeValue);
+	morphProgram_->setUniformValue(morphProgramSpeedUniform_, morphSpeed_);
+	glEnable(GL_RASTERIZER_DISCARD);
+	gl33_->glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, morphCacheBuffer_);
+	gl33_->glBeginTransformFeedback(GL_POINTS);
+	// GPU culling draws every instance from allInstanceBuffer_, otherwise only the ones
+	// cullInstances() left in instanceBuffer_ are drawn and need morphing.
+	const auto all = gpuCulling();
+	for (const auto & primitive: primitives_data)
+	{
+		const auto count = all ? primitive.instances_count : primitive.visible_count;
+		if (count == 0)
+		{
+			continue;
+		}
+		// Every vertex once per instance, instance by instance.
+		bindInstances(all ? allInstanceBuffer_ : instanceBuffer_, all ? primitive.instances_first : primitive.visible_first);
+		gl33_->glDrawArraysInstanced(GL_POINTS, primitive.base_vertex, static_cast<GLsizei>(primitive.vertex_count), static_cast<GLsizei>(count));
+		drawStats_.morphedVertices += primitive.vertex_count * count;
+	}
+	gl33_->glEndTransformFeedback();
+	gl33_->glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+	glDisable(GL_RASTERIZER_DISCARD);
+	morphProgram_->release();
+}
+
+void Window::initMorphCache()
+{
+	morphProgram_ = std::make_unique<QOpenGLShaderProgram>(this);
+	morphProgram_->addShaderFromSourceCode(QOpenGLShader::Vertex, shader_source(":/Shaders/diffuse.vs", vertex_defines(options_, true)));
+	// Interleaved in the order the buffer texture reads them.
+	const std::array<const GLchar *, g_morph_cache_texels> varyings{"morphed0", "morphed1", "morphed2"};
+	gl33_->glTransformFeedbackVaryings(morphProgram_->programId(), static_cast<GLsizei>(varyings.size()), varyings.data(), GL_INTERLEAVED_ATTRIBS);
+	if (!morphProgram_->link())
+	{
+		morphProgram_.reset();
+		return;
+	}
+	morphProgramTimeUniform_ = morphProgram_->uniformLocation("timeValue");
+	morphProgramSpeedUniform_ = morphProgram_->uniformLocation("morphSpeed");
+
+	gl33_->glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTextureBufferSize_);
+	gl33_->glGenBuffers(1, &morphCacheBuffer_);
+	gl33_->glGenTextures(1, &morphCacheTexture_);
+	gl33_->glBindBuffer(GL_TEXTURE_BUFFER, morphCacheBuffer_);
+	gl33_->glBindTexture(GL_TEXTURE_BUFFER, morphCacheTexture_);
+	gl33_->glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, morphCacheBuffer_);
+	gl33_->glBindTexture(GL_TEXTURE_BUFFER, 0);
+	gl33_->glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void Window::rebuildInstanceBvh()
+{
+	// Sorting moved the primitives, and the boxes grow by how far morphing moves vertices.
+	const QVector3D morph_margin(g_morph_amplitude, 0.0f, 0.0f);
+	std::vector<Bvh::Box> boxes(instances_.size());
+	for (size_t i = 0; i < primitives_data.size(); ++i)
+	{
+		const auto & primitive = primitives_data[i];
+		for (size_t j = primitive.instances_first; j < primitive.instances_first + primitive.instances_count; ++j)
+		{
+			instances_[j].primitive = i;
+			boxes[j] = {instances_[j].bounds_min - morph_margin, instances_[j].bounds_max + morph_margin};
+		}
+	}
+	instanceBvh_.build(boxes);
+}
+
+void Window::rebuildOccluders()
+{
+	QVector3D scene_min(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+	QVector3D scene_max = -scene_min;
+	for (const auto & instance: instances_)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			scene_min[i] = std::min(scene_min[i], instance.bounds_min[i]);
+			scene_max[i] = std::max(scene_max[i], instance.bounds_max[i]);
+		}
+	}
+	const auto min_size = (scene_max - scene_min).length() * g_min_occluder_size;
+
+	occluders_.clear();
+	for (const auto & primitive: primitives_data)
+	{
+		// Simplified levels may bulge out of the full surface and hide what is visible, only
+		// full detail keeps the occlusion test conservative.
+		const auto indices = level_indices(primitive, 0);
+		if (static_cast<size_t>(indices.count) / 3 > g_max_occluder_triangles)
+		{
+			continue;
+		}
+		for (size_t i = primitive.instances_first; i < primitive.instances_first + primitive.instances_count; ++i)
+		{
+			const auto & instance = instances_[i];
+			if ((instance.bounds_max - instance.bounds_min).length() >= min_size)
+			{
+				occluders_.push_back({instance.model, scene_.vertices() + primitive.base_vertex, scene_.indices() + indices.byte_offset,
+									  static_cast<size_t>(index_size(primitive.index_type)), static_cast<size_t>(indices.count), instance.bounds_min, instance.bounds_max});
+			}
+		}
+	}
+}
+
+std::optional<Bvh::Hit> Window::pick(const QPointF & ndc)
+{
+	const auto inverse = (projection_ * view_ * model_).inverted();
+	const auto near = inverse.map(QVector3D(static_cast<float>(ndc.x()), static_cast<float>(ndc.y()), -1.0f));
+	const auto far = inverse.map(QVector3D(static_cast<float>(ndc.x()), static_cast<float>(ndc.y()), 1.0f));
+	const auto direction = (far - near).normalized();
+	return instanceBvh_.raycast(near, direction, (far - near).length(), [&](const uint32_t item, const float max_distance) {
+		return intersectTriangles(instances_[item], near, direction, max_distance);
+	});
+}
+
+std::optional<Bvh::Hit> Window::nearestInstance(const QVector3D & point) const
+{
+	return instanceBvh_.nearest(point, std::numeric_limits<float>::max(), [&](const uint32_t item, float) {
+		return std::optional<float>(distance_to_box(point, instances_[item].bounds_min, instances_[item].bounds_max));
+	});
+}
+
+std::optional<float> Window::intersectTriangles(const Instance & instance, const QVector3D & origin, const QVector3D & direction, const float max_distance)
+{
+	auto & primitive = primitives_data[instance.primitive];
+	const auto * vertices = scene_.vertices() + primitive.base_vertex;
+	const auto * indices = scene_.indices() + primitive.indices_byte_offset;
+	const auto triangle = [&](const size_t i, const size_t corner) {
+		return vertices[read_index(indices, primitive.index_type, i * 3 + corner)].pos;
+	};
+	if (!primitive.triangles)
+	{
+		std::vector<Bvh::Box> boxes(static_cast<size_t>(primitive.indices_size) / 3);
+		for (size_t i = 0; i < boxes.size(); ++i)
+		{
+			const auto a = triangle(i, 0);
+			const auto b = triangle(i, 1);
+			const auto c = triangle(i, 2);
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				boxes[i].min[axis] = std::min({a[axis], b[axis], c[axis]});
+				boxes[i].max[axis] = std::max({a[axis], b[axis], c[axis]});
+			}
+		}
+		primitive.triangles = std::make_unique<Bvh>();
+		primitive.triangles->build(boxes);
+	}
+
+	// Affine transforms keep distances along the ray when the direction is transformed too.
+	const auto local_origin = instance.inverse.map(origin);
+	const auto local_direction = instance.inverse.mapVector(direction);
+	const auto hit = primitive.triangles->raycast(local_origin, local_direction, max_distance, [&](const uint32_t i, float) {
+		return intersect_triangle(local_origin, local_direction, triangle(i, 0), triangle(i, 1), triangle(i, 2));
+	});
+	return hit ? std::optional<float>(hit->distance) : std::nullopt;
+}
+
 void Window::onResize(const size_t width, const size_t height)
 {
 	// Configure viewport
@@ -539,6 +1358,7 @@ void Window::onResize(const size_t width, const size_t height)
 	const auto fov = 60.0f;
 	projection_.setToIdentity();
 	projection_.perspective(fov, aspect, zNear, zFar);
+	lodPixelScale_ = static_cast<float>(height) / (2.0f * std::tan(qDegreesToRadians(fov) / 2.0f));
 }
 
 void Window::mouseMoveEvent(QMouseEvent * e)
@@ -557,11 +1377,17 @@ void Window::mousePressEvent(QMouseEvent * e)
 {
 	dragging_ = true;
 	lastMousePos_ = e->pos();
+	pressMousePos_ = e->pos();
 }
 
-void Window::mouseReleaseEvent(QMouseEvent *)
+void Window::mouseReleaseEvent(QMouseEvent * e)
 {
 	dragging_ = false;
+	// A click without dragging picks.
+	if ((e->pos() - pressMousePos_).manhattanLength() <= 2)
+	{
+		picked_ = pick(QPointF(2.0 * e->pos().x() / width() - 1.0, 1.0 - 2.0 * e->pos().y() / height()));
+	}
 }
 
 void Window::keyPressEvent(QKeyEvent * event)
@@ -618,30 +1444,51 @@ void Window::keyReleaseEvent(QKeyEvent * event)
 	}
 }
 
-Window::PerfomanceMetricsGuard::PerfomanceMetricsGuard(std::function<void()> callback)
-	: callback_{ std::move(callback) }
+void Window::updateMetrics()
 {
-}
-
-Window::PerfomanceMetricsGuard::~PerfomanceMetricsGuard()
-{
-	if (callback_)
+	if (timer_.elapsed() < 1000)
 	{
-		callback_();
+		return;
 	}
-}
 
-auto Window::captureMetrics() -> PerfomanceMetricsGuard
-{
-	return PerfomanceMetricsGuard{
-		[&] {
-			if (timer_.elapsed() >= 1000)
-			{
-				const auto elapsedSeconds = static_cast<float>(timer_.restart()) / 1000.0f;
-				ui_.fps = static_cast<size_t>(std::round(frameCount_ / elapsedSeconds));
-				frameCount_ = 0;
-				emit updateUI();
-			}
-		}
+	const auto elapsedSeconds = static_cast<float>(timer_.restart()) / 1000.0f;
+	ui_.fps = static_cast<size_t>(std::round(frameCount_ / elapsedSeconds));
+	frameCount_ = 0;
+
+	const auto formatStats = [](const QString & name, const FrameProfiler::Stats & stats) {
+		return QString("%1 min/avg/p99: %2 / %3 / %4 ms")
+			.arg(name)
+			.arg(stats.min, 0, 'f', 2)
+			.arg(stats.avg, 0, 'f', 2)
+			.arg(stats.p99, 0, 'f', 2);
 	};
+
+	QStringList lines;
+	lines << formatStats("Frame", profiler_.frameIntervalStats());
+	lines << formatStats("CPU", profiler_.frameCpuStats());
+	for (size_t i = 0; i < profiler_.scopeNames().size(); ++i)
+	{
+		lines << formatStats(QString("GPU %1").arg(QString::fromStdString(profiler_.scopeNames()[i])), profiler_.scopeGpuStats(i));
+	}
+	ui_.frameTimes = lines.join('\n');
+	ui_.drawStats = QString("Draws: %1 of %2 instances in %3 calls, %4 culled, %5 occluded, %6 meshlets culled, %7 triangles, state changes: %8 (%9 saved by sorting)")
+						.arg(drawStats_.draws)
+						.arg(drawStats_.instances)
+						.arg(drawStats_.drawCalls)
+						.arg(drawStats_.culled)
+						.arg(drawStats_.occluded)
+						.arg(drawStats_.meshletsCulled)
+						.arg(drawStats_.triangles)
+						.arg(drawStats_.stateChanges)
+						.arg(drawStats_.stateChangesSaved);
+	if (const auto nearest = nearestInstance(eye_))
+	{
+		ui_.drawStats += QString("\nNearest instance: %1 at %2").arg(nearest->item).arg(nearest->distance, 0, 'f', 2);
+	}
+	if (picked_)
+	{
+		ui_.drawStats += QString("\nPicked instance: %1 at %2").arg(picked_->item).arg(picked_->distance, 0, 'f', 2);
+	}
+
+	emit updateUI();
 }
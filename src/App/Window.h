@@ -2,41 +2,108 @@
 
 #include <Base/GLWidget.hpp>
 
-#include <QElapsedTimer>
+#include "Bvh.h"
+#include "GpuCuller.h"
+#include "OcclusionCuller.h"
+#include "Profiler.h"
+#include "RenderOptions.h"
+#include "SceneLoader.h"
+#include "SceneStreamer.h"
+#include "TextureStreamer.h"
+
 #include <QMatrix4x4>
 #include <QOpenGLBuffer>
+#include <QOpenGLFunctions_3_3_Core>
+#include <QOpenGLFunctions_4_3_Core>
 #include <QOpenGLShaderProgram>
-#include <QOpenGLTexture>
 #include <QOpenGLVertexArrayObject>
 
-#include <functional>
+#include <array>
 #include <memory>
+#include <optional>
+
+// Placement of a primitive, with what culling and LOD selection need of it.
+struct Instance {
+	QMatrix4x4 model;
+	QMatrix4x4 inverse;
+	QVector3D bounds_min;// Primitive bounds after the transform.
+	QVector3D bounds_max;
+	// Longest and shortest stretch of a vector, exact for glTF's translation, rotation and scale.
+	float max_scale;
+	float min_scale;
+	bool mirrored;
+	size_t primitive;// Index into Window::primitives_data.
+	// Morph cache entry of vertex 0 minus the base vertex of the primitive, see Window::captureMorph().
+	GLint morph_cache_offset = 0;
+};
+
+// Per-instance attributes, the model matrix is column-major as mat4 attributes read it.
+struct InstanceData {
+	float model[16];
+	QVector3D bounds_min;// Quantization box of packed vertices.
+	QVector3D bounds_extent;
+	GLint morph_cache_offset;
+};
 
 struct Primitive {
-	std::unique_ptr<QOpenGLTexture> tex;
-	std::unique_ptr<QOpenGLTexture> normals;
-	int indices_offset;
+	TextureStreamer::Handle tex;
+	TextureStreamer::Handle normals;
+	GLenum index_type;
+	int indices_byte_offset;
 	int indices_size;
+	GLint base_vertex;
+	size_t vertex_count;
+	QVector3D bounds_min;// Of the vertices, before instance transforms.
+	QVector3D bounds_max;
+	// Placements in Window::instances_, the ones of the current frame that survived culling
+	// are in the instance buffer from visible_first on.
+	size_t instances_first;
+	size_t instances_count;
+	size_t visible_first = 0;
+	size_t visible_count = 0;
+	// Simplified levels follow the full indices in the index buffer, lod is the one drawn.
+	size_t lod_count;
+	std::array<int, kMaxLods> lod_indices_size;
+	std::array<float, kMaxLods> lod_error;
+	size_t lod = 0;
+	// Split of the full indices, owned by SceneStreamer.
+	const Meshlet * meshlets;
+	size_t meshlet_count;
+	// Over the full detail triangles, built by the first pick that reaches the primitive.
+	std::unique_ptr<Bvh> triangles;
 };
 
-struct Vertex {
-	QVector3D pos;
-	QVector3D normal;
-	QVector2D tex;
-	QVector3D tangent;
-	QVector3D bitangent;
+// Part of the index buffer drawn with one command.
+struct IndexRange {
+	int byte_offset;
+	int count;
 };
 
-namespace tinygltf
-{
-class Model;
-}
+// GL calls issued for the draws of the last frame.
+struct DrawStats {
+	size_t draws = 0;
+	size_t drawCalls = 0;
+	// Instances drawn, several of them share one draw when a mesh is placed more than once.
+	size_t instances = 0;
+	size_t culled = 0;
+	// Inside of the frustum but hidden behind occluders.
+	size_t occluded = 0;
+	size_t meshletsCulled = 0;
+	size_t triangles = 0;
+	size_t stateChanges = 0;
+	// Calls the unsorted per-primitive loop would have made on top.
+	size_t stateChangesSaved = 0;
+	// Vertices written to the morph cache, one per vertex of every morphed instance.
+	size_t morphedVertices = 0;
+};
+
+class Frustum;
 
 class Window final : public fgl::GLWidget
 {
 	Q_OBJECT
 public:
-	Window() noexcept;
+	explicit Window(QString modelPath = ":/Models/chess.glb", RenderOptions options = {}) noexcept;
 	~Window() override;
 
 public:// fgl::GLWidget
@@ -50,27 +117,69 @@ public:// fgl::GLWidget
 	void keyReleaseEvent(QKeyEvent * event) override;
 	void updateMoving();
 
-private:
-	void process_node(const tinygltf::Model & model, int32_t node_ind, std::vector<Vertex> & model_vertices, std::vector<GLuint> & model_indices, QMatrix4x4 parent_transform = QMatrix4x4(), int parent_texture = -1);
-
-	class PerfomanceMetricsGuard final
-	{
-	public:
-		explicit PerfomanceMetricsGuard(std::function<void()> callback);
-		~PerfomanceMetricsGuard();
-
-		PerfomanceMetricsGuard(const PerfomanceMetricsGuard &) = delete;
-		PerfomanceMetricsGuard(PerfomanceMetricsGuard &&) = delete;
-
-		PerfomanceMetricsGuard & operator=(const PerfomanceMetricsGuard &) = delete;
-		PerfomanceMetricsGuard & operator=(PerfomanceMetricsGuard &&) = delete;
+public:
+	[[nodiscard]] FrameProfiler & profiler() noexcept { return profiler_; }
+	[[nodiscard]] const TextureStreamer & textures() const noexcept { return textures_; }
+	[[nodiscard]] const DrawStats & drawStats() const noexcept { return drawStats_; }
+	[[nodiscard]] bool multiDrawIndirect() const noexcept { return gl43_ != nullptr; }
+	// True if culling and LOD selection run in a compute shader, see GpuCuller.
+	[[nodiscard]] bool gpuCulling() const noexcept;
+	// True if the last frame drew from vertices morphed once up front instead of in every draw.
+	[[nodiscard]] bool morphCached() const noexcept { return morphCacheActive_; }
+	// True while geometry is still being loaded, uploaded or waits to be drawn.
+	[[nodiscard]] bool loading() const { return scene_.pending() || !stagedPrimitives_.empty(); }
+	// True if the model could not be loaded, the scene stays empty.
+	[[nodiscard]] bool loadFailed() const { return scene_.failed(); }
+	// True if the scene was read from SceneCache instead of parsing the model.
+	[[nodiscard]] bool sceneCacheHit() const { return scene_.sceneCacheHit(); }
+	[[nodiscard]] WeldStats weldStats() const { return scene_.weldStats(); }
+	[[nodiscard]] MeshOptimizationStats meshStats() const { return scene_.meshStats(); }
 
-	private:
-		std::function<void()> callback_;
-	};
+	// Over the world bounds of all instances drawn so far, rebuilt whenever staged primitives are added.
+	[[nodiscard]] const Bvh & instanceBvh() const noexcept { return instanceBvh_; }
+	// Instance under a point of the last frame's view, in normalized device coordinates, and
+	// the distance to it. Hits are exact on the unmorphed triangles.
+	[[nodiscard]] std::optional<Bvh::Hit> pick(const QPointF & ndc);
+	// Instance whose bounds are nearest to point and the distance to them.
+	[[nodiscard]] std::optional<Bvh::Hit> nearestInstance(const QVector3D & point) const;
 
 private:
-	[[nodiscard]] PerfomanceMetricsGuard captureMetrics();
+	void updateMetrics();
+	void initInstancing();
+	void initMultiDraw();
+	void initMorphCache();
+	// Stages uploaded primitives and, now and then, adds the staged ones to what is drawn.
+	void addPrimitives(const std::vector<CachedPrimitive> & primitives);
+	void rebuildBatches();
+	// Refills allInstanceBuffer_ when something reads it.
+	void uploadInstances();
+	// Hands all instances and the draw arguments of every primitive to gpuCuller_.
+	void uploadGpuCulling();
+	// Places the vertices of every instance in the morph cache and grows it if they do not fit.
+	void rebuildMorphCache();
+	// Morphs every vertex of the instances drawn this frame into the morph cache with transform
+	// feedback: all of them with GPU culling, the visible ones otherwise.
+	void captureMorph(float timeValue);
+	void rebuildInstanceBvh();
+	// Picks the instances large enough to occlude others whose full detail mesh is small enough.
+	void rebuildOccluders();
+	// Exact distance along the ray to the triangles of instance, or nothing on a miss.
+	[[nodiscard]] std::optional<float> intersectTriangles(const Instance & instance, const QVector3D & origin, const QVector3D & direction, float max_distance);
+	void bindTextures(TextureStreamer::Handle tex, TextureStreamer::Handle normals);
+	void selectLods();
+	// Fills the instance buffer with the visible instances of every primitive.
+	void cullInstances(const Frustum & frustum);
+	// Points the instanced attributes at entry first of buffer, which holds InstanceData.
+	void bindInstances(QOpenGLBuffer & buffer, size_t first);
+	[[nodiscard]] bool meshletCulling(const Primitive & primitive) const;
+	// Fills ranges_ with what primitive draws this frame, for one instance when meshletCulling(),
+	// for all of them otherwise. Meshlets outside of the frustum or facing away are left out,
+	// neighbouring ones merge into one range.
+	void cullMeshlets(const Primitive & primitive, const Instance & instance, const Frustum & frustum);
+	void drawPrimitives(const Frustum & frustum);
+	void drawBatches(const Frustum & frustum);
+	// Culls, selects LODs and draws every batch without looking at single instances.
+	void drawGpuCulled(const Frustum & frustum);
 
 signals:
 	void updateUI();
@@ -88,6 +197,7 @@ private:
 	GLint cameraPosUniform_ = -1;
 	GLint timeValueUniform_ = -1;
 	GLint morphSpeedUniform_ = -1;
+	GLint morphCachedUniform_ = -1;
 
 	QOpenGLBuffer vbo_{QOpenGLBuffer::Type::VertexBuffer};
 	QOpenGLBuffer ibo_{QOpenGLBuffer::Type::IndexBuffer};
@@ -96,9 +206,14 @@ private:
 	QMatrix4x4 model_;
 	QMatrix4x4 view_;
 	QMatrix4x4 projection_;
+	// Pixels a unit long object covers at unit distance, LOD errors are projected with it.
+	float lodPixelScale_ = 0.0f;
+	QVector3D eye_;
 
 	bool dragging_ = false;
 	QPoint lastMousePos_;
+	QPoint pressMousePos_;
+	std::optional<Bvh::Hit> picked_;
 	float cameraRotationX = 21.5f;
 	float cameraRotationY = 13.1f;
 	QVector3D cameraPosition = {0.16f, -0.31f, -0.81f};
@@ -112,17 +227,82 @@ private:
 	float morphSpeed_ = 0.2f;
 
 	std::unique_ptr<QOpenGLShaderProgram> program_;
+	// Base-vertex draws, indices are stored relative to the first vertex of their primitive.
+	QOpenGLFunctions_3_3_Core * gl33_ = nullptr;
+	// Sorted by texture pair and index type, so consecutive draws can skip rebinding.
 	std::vector<Primitive> primitives_data;
+	// Uploaded but not drawn yet, see addPrimitives().
+	std::vector<CachedPrimitive> stagedPrimitives_;
+	size_t stagedInstances_ = 0;
+	QElapsedTimer rebuildTimer_;
+	std::vector<Instance> instances_;
+	Bvh instanceBvh_;
+	// Instances the BVH found inside of the frustum this frame.
+	std::vector<uint32_t> visibleItems_;
+	std::vector<Occluder> occluders_;
+	// Rasterizes occluders_ on its worker from the start of the scene scope to cullInstances().
+	OcclusionCuller occlusion_;
+	bool occlusionActive_ = false;
+	// Rewritten every frame with the instances that survived culling, grouped by primitive.
+	QOpenGLBuffer instanceBuffer_{QOpenGLBuffer::Type::VertexBuffer};
+	std::vector<InstanceData> frameInstances_;
+	// Index into instances_ of every frameInstances_ entry.
+	std::vector<size_t> visibleInstances_;
+	DrawStats drawStats_;
+	QOpenGLTexture * boundTex_ = nullptr;
+	QOpenGLTexture * boundNormals_ = nullptr;
+
+	// Multi-draw indirect path, gl43_ stays null when it is unavailable or disabled.
+	struct DrawBatch {
+		TextureStreamer::Handle tex;
+		TextureStreamer::Handle normals;
+		GLenum index_type;
+		size_t first;
+		size_t count;
+		// Commands of the current frame that survived culling.
+		size_t visible_first = 0;
+		size_t visible_count = 0;
+	};
+	QOpenGLFunctions_4_3_Core * gl43_ = nullptr;
+	GLuint indirectBuffer_ = 0;
+	std::vector<DrawBatch> batches_;
+	std::vector<DrawElementsIndirectCommand> commands_;
+	// Set with RenderOptions::gpuCulling on top of gl43_.
+	std::unique_ptr<GpuCuller> gpuCuller_;
+	// Every instance in the order of instances_, for GPU culling and morph capture.
+	QOpenGLBuffer allInstanceBuffer_{QOpenGLBuffer::Type::VertexBuffer};
+
+	// Set with RenderOptions::morphCache: the vertex shader built with MORPH_CAPTURE, and the
+	// buffer it fills, read by program_ through a buffer texture. Only used while something morphs.
+	std::unique_ptr<QOpenGLShaderProgram> morphProgram_;
+	GLint morphProgramTimeUniform_ = -1;
+	GLint morphProgramSpeedUniform_ = -1;
+	GLuint morphCacheBuffer_ = 0;
+	GLuint morphCacheTexture_ = 0;
+	GLint maxTextureBufferSize_ = 0;
+	size_t morphCacheEntries_ = 0;
+	size_t morphCacheCapacity_ = 0;// Entries morphCacheBuffer_ has room for.
+	bool morphCacheActive_ = false;
+	// Index ranges of the primitive being drawn that survived meshlet culling.
+	std::vector<IndexRange> ranges_;
+	TextureStreamer textures_;
+	SceneStreamer scene_;
 
 	// W A S D Ctrl Space
 	bool buttons_[6] = {};
 
+	FrameProfiler profiler_;
 	QElapsedTimer timer_;
 	size_t frameCount_ = 0;
 
 	struct {
 		size_t fps = 0;
+		QString frameTimes;
+		QString drawStats;
 	} ui_;
 
 	bool animated_ = true;
+
+	QString modelPath_;
+	RenderOptions options_;
 };
@@ -1,6 +1,10 @@
 #include <QApplication>
+#include <QCommandLineParser>
 #include <QSurfaceFormat>
 
+#include <cstdio>
+
+#include "Benchmark.h"
 #include "Window.h"
 
 namespace
@@ -8,6 +12,20 @@ namespace
 constexpr auto g_sampels = 16;
 constexpr auto g_gl_major_version = 3;
 constexpr auto g_gl_minor_version = 3;
+
+// Reads the positive count given to option, prints a usage error if it is not one.
+bool parse_count(const QCommandLineParser & parser, const QCommandLineOption & option, size_t & count)
+{
+	const auto value = parser.value(option);
+	auto ok = false;
+	count = value.toUInt(&ok);
+	if (!ok || count == 0)
+	{
+		fprintf(stderr, "--%s expects a positive number, got \"%s\"\n", qPrintable(option.names().first()), qPrintable(value));
+		return false;
+	}
+	return true;
+}
 }// namespace
 
 int main(int argc, char ** argv)
@@ -16,6 +34,57 @@ int main(int argc, char ** argv)
 	QApplication::setAttribute(Qt::AA_UseDesktopOpenGL);
 	QApplication app(argc, argv);
 
+	// Parse command line.
+	QCommandLineParser parser;
+	parser.addHelpOption();
+	const QCommandLineOption modelOption("model", "glTF/GLB model to load.", "path", ":/Models/chess.glb");
+	parser.addOption(modelOption);
+	const QCommandLineOption packedVerticesOption("packed-vertices", "Use the 20-byte quantized vertex format.");
+	parser.addOption(packedVerticesOption);
+	const QCommandLineOption noMultiDrawOption("no-multi-draw", "Draw primitives one by one even if GL 4.3 multi-draw indirect is available.");
+	parser.addOption(noMultiDrawOption);
+	const QCommandLineOption gpuCullingOption("gpu-culling", "Cull instances and select LODs in a compute shader that writes the multi-draw commands. Needs GL 4.3.");
+	parser.addOption(gpuCullingOption);
+	const QCommandLineOption noCullingOption("no-culling", "Draw every primitive, even outside of the view frustum.");
+	parser.addOption(noCullingOption);
+	const QCommandLineOption occlusionCullingOption("occlusion-culling", "Skip instances hidden behind large occluders, rasterized on the CPU. Only while the morph speed is 0.");
+	parser.addOption(occlusionCullingOption);
+	const QCommandLineOption morphSpeedOption("morph-speed", "Initial speed of the vertex deformation, 0 keeps the geometry static.", "speed", "0.2");
+	parser.addOption(morphSpeedOption);
+	const QCommandLineOption morphDerivativesOption("morph-derivatives", "How the vertex shader bends normals and tangents: analytic or finite differences.", "analytic|finite", "analytic");
+	parser.addOption(morphDerivativesOption);
+	const QCommandLineOption morphCacheOption("morph-cache", "Morph every vertex once per frame with transform feedback and draw from the result. Only while the morph speed is not 0.");
+	parser.addOption(morphCacheOption);
+	const QCommandLineOption noSceneCacheOption("no-scene-cache", "Always parse the model and do not write a baked scene cache.");
+	parser.addOption(noSceneCacheOption);
+	const QCommandLineOption noWeldOption("no-weld", "Keep duplicate vertices of the model.");
+	parser.addOption(noWeldOption);
+	const QCommandLineOption noInstancingOption("no-instancing", "Bake node transforms into a copy of the mesh for every node.");
+	parser.addOption(noInstancingOption);
+	const QCommandLineOption meshletsOption("meshlets", "Cull meshlets of 124 triangles by frustum and facing, instead of whole primitives only.");
+	parser.addOption(meshletsOption);
+	const QCommandLineOption noLodOption("no-lod", "Do not simplify primitives, always draw them at full detail.");
+	parser.addOption(noLodOption);
+	const QCommandLineOption noMeshOptimizationOption("no-mesh-optimization", "Keep the triangle and vertex order of the model.");
+	parser.addOption(noMeshOptimizationOption);
+	const QCommandLineOption benchmarkOption("benchmark", "Render <frames> frames offscreen and print frame times as JSON.", "frames");
+	parser.addOption(benchmarkOption);
+	const QCommandLineOption vertexBoundBenchmarkOption("vertex-bound-benchmark", "Render <frames> frames into a 16x16 target at full detail with both morph derivatives and print GPU times as JSON.", "frames");
+	parser.addOption(vertexBoundBenchmarkOption);
+	const QCommandLineOption kernelBenchmarkOption("vertex-kernel-benchmark", "Time the vertex transform kernel on <vertices> random vertices and print JSON.", "vertices");
+	parser.addOption(kernelBenchmarkOption);
+	parser.process(app);
+
+	if (parser.isSet(kernelBenchmarkOption))
+	{
+		size_t vertices = 0;
+		if (!parse_count(parser, kernelBenchmarkOption, vertices))
+		{
+			return 1;
+		}
+		return run_vertex_kernel_benchmark(vertices);
+	}
+
 	// Set default surface format.
 	QSurfaceFormat format;
 	format.setSamples(g_sampels);
@@ -23,10 +92,62 @@ int main(int argc, char ** argv)
 	format.setProfile(QSurfaceFormat::CoreProfile);
 	QSurfaceFormat::setDefaultFormat(format);
 
+	RenderOptions renderOptions;
+	renderOptions.packedVertices = parser.isSet(packedVerticesOption);
+	renderOptions.multiDrawIndirect = !parser.isSet(noMultiDrawOption);
+	renderOptions.gpuCulling = parser.isSet(gpuCullingOption);
+	renderOptions.frustumCulling = !parser.isSet(noCullingOption);
+	renderOptions.occlusionCulling = parser.isSet(occlusionCullingOption);
+	auto morphSpeedOk = false;
+	renderOptions.morphSpeed = parser.value(morphSpeedOption).toFloat(&morphSpeedOk);
+	if (!morphSpeedOk)
+	{
+		fprintf(stderr, "--morph-speed expects a number, got \"%s\"\n", qPrintable(parser.value(morphSpeedOption)));
+		return 1;
+	}
+	const auto morphDerivatives = parser.value(morphDerivativesOption);
+	if (morphDerivatives != "analytic" && morphDerivatives != "finite")
+	{
+		fprintf(stderr, "--morph-derivatives expects analytic or finite, got \"%s\"\n", qPrintable(morphDerivatives));
+		return 1;
+	}
+	renderOptions.analyticMorph = morphDerivatives == "analytic";
+	renderOptions.morphCache = parser.isSet(morphCacheOption);
+	renderOptions.sceneCache = !parser.isSet(noSceneCacheOption);
+	renderOptions.weldVertices = !parser.isSet(noWeldOption);
+	renderOptions.instancing = !parser.isSet(noInstancingOption);
+	renderOptions.meshletCulling = parser.isSet(meshletsOption);
+	renderOptions.lod = !parser.isSet(noLodOption);
+	renderOptions.optimizeMeshes = !parser.isSet(noMeshOptimizationOption);
+
+	if (parser.isSet(benchmarkOption))
+	{
+		BenchmarkOptions options;
+		options.render = renderOptions;
+		options.modelPath = parser.value(modelOption);
+		if (!parse_count(parser, benchmarkOption, options.frames))
+		{
+			return 1;
+		}
+		return run_benchmark(options);
+	}
+
+	if (parser.isSet(vertexBoundBenchmarkOption))
+	{
+		BenchmarkOptions options;
+		options.render = renderOptions;
+		options.modelPath = parser.value(modelOption);
+		if (!parse_count(parser, vertexBoundBenchmarkOption, options.frames))
+		{
+			return 1;
+		}
+		return run_vertex_bound_benchmark(options);
+	}
+
 	// Now create window.
-	Window window;
+	Window window(parser.value(modelOption), renderOptions);
 	window.resize(640, 480);
 	window.show();
 
 	return app.exec();
-}
\ No newline at end of file
+}
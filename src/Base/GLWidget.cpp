@@ -19,6 +19,12 @@ auto GLWidget::bindContext() noexcept -> ContextGuard
 	return ContextGuard{*this};
 }
 
+void GLWidget::initializeOffscreen()
+{
+	initializeOpenGLFunctions();
+	onInit();
+}
+
 void GLWidget::initializeGL()
 {
 	initializeOpenGLFunctions();
@@ -38,6 +38,10 @@ public:
 
 	[[nodiscard]] ContextGuard bindContext() noexcept;
 
+	// Initializes the widget against the context current on the calling thread
+	// instead of its own one. Used to render without ever showing the widget.
+	void initializeOffscreen();
+
 private:// QOpenGLWidget
 	void initializeGL() override;
 	void resizeGL(int width, int height) override;